@@ -0,0 +1,490 @@
+/**
+ * File: bytecode.cpp
+ * ------------------
+ * This file implements the bytecode.h interface.
+ */
+
+#include "bytecode.h"
+#include "exp.h"
+#include "error.h"
+#include <cassert>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+using namespace std;
+
+/* Evaluation stacks up to this depth live on the C++ stack */
+
+static const int kInlineStackDepth = 64;
+
+/* runColumn evaluates this many rows at a time, keeping one slice of values per stack entry */
+
+static const int kColumnRows = 256;
+
+/* Column evaluation stacks up to this depth live on the C++ stack */
+
+static const int kInlineColumnDepth = 8;
+
+Program::Program(const Expression* exp, RangeTable* table) {
+    this->table = table;
+    shared = NULL;
+    maxDepth = 0;
+    compile(exp, 0);
+    if (!ranges.empty() && (exp->getType() == COMPOUND || exp->getType() == NARY)) {
+        share(exp);
+    }
+    assert(!code.empty() && maxDepth >= 1);
+}
+
+Program::~Program() {
+    for (const RangeRef& ref : ranges) {
+        table->release(ref.aggregate);
+    }
+    if (shared != NULL) {
+        table->releaseShared(shared);
+    }
+}
+
+/**
+ * Appends the bytes of value to key.
+ */
+template <typename T>
+static void appendBytes(string& key, const T& value) {
+    key.append((const char*) &value, sizeof(T));
+}
+
+/**
+ * Appends to key a description of exp in prefix order, a tag per node
+ * followed by what the node holds.  Cells are described by their ids as
+ * written and constants by their bits, so two formulas get the same key
+ * exactly when they compile to the same code.  Text strings all evaluate
+ * to 0.0 and share a tag.
+ */
+static void structureKey(const Expression* exp, string& key) {
+    switch (exp->getType()) {
+    case DOUBLE:
+        key += 'd';
+        appendBytes(key, ((const DoubleExp*) exp)->getDoubleValue());
+        break;
+    case TEXTSTRING:
+        key += 't';
+        break;
+    case IDENTIFIER:
+        key += 'c';
+        appendBytes(key, ((const IdentifierExp*) exp)->getCellId());
+        break;
+    case CELLRUN:
+        key += 'u';
+        appendBytes(key, ((const CellRunExp*) exp)->getStartCell());
+        appendBytes(key, ((const CellRunExp*) exp)->getEndCell());
+        break;
+    case RANGE: {
+        const RangeExp* rangeExp = (const RangeExp*) exp;
+        key += 'r';
+        appendBytes(key, rangeExp->getRangeFnId());
+        appendBytes(key, rangeExp->getStartCell());
+        appendBytes(key, rangeExp->getEndCell());
+        appendBytes(key, rangeExp->getParameter());
+        appendBytes(key, rangeExp->getRangeKind());
+        break;
+    }
+    case COMPOUND: {
+        const CompoundExp* compound = (const CompoundExp*) exp;
+        key += 'o';
+        key += compound->getOperator()[0];
+        structureKey(compound->getLHS(), key);
+        structureKey(compound->getRHS(), key);
+        break;
+    }
+    case NARY: {
+        const NaryExp* nary = (const NaryExp*) exp;
+        key += 'n';
+        key += nary->getOperator()[0];
+        appendBytes(key, nary->getOperandCount());
+        for (int i = 0; i < nary->getOperandCount(); i++) {
+            structureKey(nary->getOperand(i), key);
+        }
+        break;
+    }
+    }
+}
+
+/**
+ * @brief Program::share
+ * @param exp: the formula the program was compiled from
+ * Encloses the compiled code in OP_SHARED and OP_STORE for the entry of exp
+ * in table, so that every program compiled from the same formula with the
+ * same references shares its value.  Only the whole formula is shared: the
+ * subexpressions inside it are part of the value it shares, and keying each
+ * of them would walk the tree again for every level it nests.  The key is
+ * made in one walk, once compiling has shown that the formula calls a range
+ * function and so is worth looking up.
+ */
+void Program::share(const Expression* exp) {
+    string key;
+    structureKey(exp, key);
+    shared = table->acquireShared(key);
+    Instruction instr;
+    instr.op = OP_SHARED;
+    instr.operand = code.size() + 1;
+    code.insert(code.begin(), instr);
+    emit(OP_STORE, 0, 1);
+}
+
+/**
+ * Returns the instruction applying the arithmetic operator op.
+ */
+static OpCode operatorCode(const string& op) {
+    if (op == "+") return OP_ADD;
+    if (op == "-") return OP_SUB;
+    if (op == "*") return OP_MUL;
+    if (op == "/") return OP_DIV;
+    error("Illegal operator in expression.");
+    return OP_ADD;
+}
+
+/**
+ * @brief Program::compile
+ * @param exp: subexpression to compile
+ * @param depth: number of values already on the evaluation stack
+ * Emits postfix code for exp: operands first, then the operator.  Operators
+ * are mapped from their strings to opcodes here, once, instead of on every
+ * evaluation.  Text strings evaluate to 0.0, as in TextStringExp::eval.
+ * A chain applies its operator after each operand but the first, so it
+ * needs two stack entries however long it is.  A run of cells after the
+ * first operand of a sum is added straight to the sum so far, just as its
+ * cells would be one by one.  The instructions for runs reserve one stack
+ * entry more than they use, which runColumn reads the cells into.
+ */
+void Program::compile(const Expression* exp, int depth) {
+    switch (exp->getType()) {
+    case DOUBLE:
+        constants.push_back(((const DoubleExp*) exp)->getDoubleValue());
+        emit(OP_CONST, constants.size() - 1, depth + 1);
+        break;
+    case TEXTSTRING:
+        constants.push_back(0.0);
+        emit(OP_CONST, constants.size() - 1, depth + 1);
+        break;
+    case IDENTIFIER:
+        slots.push_back(((const IdentifierExp*) exp)->getSlot());
+        slotCells.push_back(((const IdentifierExp*) exp)->getCellId());
+        emit(OP_LOAD, slots.size() - 1, depth + 1);
+        break;
+    case RANGE: {
+        const RangeExp* rangeExp = (const RangeExp*) exp;
+        RangeRef ref;
+        ref.fn = rangeExp->getRangeFnId();
+        ref.startCell = rangeExp->getStartCell();
+        ref.endCell = rangeExp->getEndCell();
+        ref.parameter = rangeExp->getParameter();
+        ref.kind = rangeExp->getRangeKind();
+        ref.aggregate = table->acquire(ref.fn, ref.startCell, ref.endCell, ref.parameter, ref.kind);
+        ranges.push_back(ref);
+        emit(OP_RANGE, ranges.size() - 1, depth + 1);
+        break;
+    }
+    case CELLRUN:
+        emit(OP_RUN, addRun(exp), depth + 2);
+        break;
+    case COMPOUND: {
+        const CompoundExp* compound = (const CompoundExp*) exp;
+        compile(compound->getLHS(), depth);
+        compile(compound->getRHS(), depth + 1);
+        emit(operatorCode(compound->getOperator()), 0, depth + 1);
+        break;
+    }
+    case NARY: {
+        const NaryExp* nary = (const NaryExp*) exp;
+        OpCode op = operatorCode(nary->getOperator());
+        compile(nary->getOperand(0), depth);
+        for (int i = 1; i < nary->getOperandCount(); i++) {
+            if (op == OP_ADD && nary->getOperand(i)->getType() == CELLRUN) {
+                emit(OP_ADDRUN, addRun(nary->getOperand(i)), depth + 2);
+                continue;
+            }
+            compile(nary->getOperand(i), depth + 1);
+            emit(op, 0, depth + 1);
+        }
+        break;
+    }
+    }
+}
+
+/**
+ * @brief Program::addRun
+ * Adds the run exp to the run table and returns its index.
+ */
+int Program::addRun(const Expression* exp) {
+    const CellRunExp* run = (const CellRunExp*) exp;
+    RunRef ref;
+    ref.startCell = run->getStartCell();
+    ref.length = run->getLength();
+    ref.rowStep = (run->getLength() > 1) ? cellIdRow(run->getCell(1)) - cellIdRow(ref.startCell) : 0;
+    ref.colStep = (run->getLength() > 1) ? cellIdCol(run->getCell(1)) - cellIdCol(ref.startCell) : 0;
+    runs.push_back(ref);
+    return runs.size() - 1;
+}
+
+/**
+ * @brief Program::emit
+ * Appends one instruction and records the stack depth reached while it runs.
+ */
+void Program::emit(OpCode op, int operand, int depth) {
+    Instruction instr;
+    instr.op = op;
+    instr.operand = operand;
+    code.push_back(instr);
+    if (depth > maxDepth) maxDepth = depth;
+}
+
+bool Program::hasRanges() const {
+    return !ranges.empty();
+}
+
+/**
+ * @brief Program::acquireRanges
+ * @param rowOffset, colOffset: distance of the cell using the program from the cell it was compiled for
+ * @param aggregates: receives one range table entry per range operand
+ * Open ranges move only along their open side, as in run.
+ */
+void Program::acquireRanges(int rowOffset, int colOffset, vector<RangeAggregate*>& aggregates) const {
+    aggregates.clear();
+    for (const RangeRef& ref : ranges) {
+        aggregates.push_back(table->acquire(ref.fn, shiftRangeCorner(ref.startCell, ref.kind, rowOffset, colOffset),
+                                            shiftRangeCorner(ref.endCell, ref.kind, rowOffset, colOffset),
+                                            ref.parameter, ref.kind));
+    }
+}
+
+void Program::releaseRanges(const vector<RangeAggregate*>& aggregates) const {
+    for (RangeAggregate* aggregate : aggregates) {
+        table->release(aggregate);
+    }
+}
+
+/**
+ * @brief Program::run
+ * @param model: spreadsheet model supplying cell values and range functions
+ * @param rowOffset, colOffset: distance of the cell being evaluated from the cell the program was compiled for
+ * The evaluation stack is a local array unless the formula is unusually deeply
+ * nested, so ordinary formulas evaluate without touching the heap.
+ * Moved references cannot use the bound slots and are looked up in the model.
+ * A range call is read through its entry in the range table, the program's
+ * own or the moved one in aggregates, so a call shared by several formulas
+ * is computed once per pass and kept while its range is unchanged.
+ * A shared formula already computed in the current pass, by this or another
+ * program, is pushed instead of computed; the value is stored before the
+ * pass, so a thread that finds the pass matching also sees the value.
+ * Divide by 0.0 gives +/-INF, as in CompoundExp::eval.
+ */
+double Program::run(SSModel* model, int rowOffset, int colOffset, RangeAggregate* const* aggregates) const {
+    bool moved = rowOffset != 0 || colOffset != 0;
+    double inlineStack[kInlineStackDepth];
+    vector<double> deepStack;
+    double* stack = inlineStack;
+    if (maxDepth > kInlineStackDepth) {
+        deepStack.resize(maxDepth);
+        stack = &deepStack[0];
+    }
+    int sp = 0;
+    const Instruction* pc = &code[0];
+    const Instruction* end = pc + code.size();
+    for (; pc < end; pc++) {
+        switch (pc->op) {
+        case OP_CONST:
+            stack[sp++] = constants[pc->operand];
+            break;
+        case OP_LOAD:
+            if (moved) {
+                stack[sp++] = model->cellValue(shiftCellId(slotCells[pc->operand], rowOffset, colOffset));
+            } else {
+                stack[sp++] = *slots[pc->operand];
+            }
+            break;
+        case OP_RANGE: {
+            const RangeRef& ref = ranges[pc->operand];
+            if (!moved) {
+                stack[sp++] = model->aggregateValue(*ref.aggregate);
+            } else if (aggregates != NULL) {
+                stack[sp++] = model->aggregateValue(*aggregates[pc->operand]);
+            } else {
+                stack[sp++] = model->applyRangeFunction(ref.fn,
+                        shiftRangeCorner(ref.startCell, ref.kind, rowOffset, colOffset),
+                        shiftRangeCorner(ref.endCell, ref.kind, rowOffset, colOffset), ref.parameter, ref.kind);
+            }
+            break;
+        }
+        case OP_ADD:
+            sp--;
+            stack[sp - 1] += stack[sp];
+            break;
+        case OP_SUB:
+            sp--;
+            stack[sp - 1] -= stack[sp];
+            break;
+        case OP_MUL:
+            sp--;
+            stack[sp - 1] *= stack[sp];
+            break;
+        case OP_DIV:
+            sp--;
+            stack[sp - 1] /= stack[sp];
+            break;
+        case OP_RUN:
+        case OP_ADDRUN: {
+            const RunRef& ref = runs[pc->operand];
+            int i = 0;
+            if (pc->op == OP_RUN) {
+                stack[sp++] = model->cellValue(shiftCellId(ref.startCell, rowOffset, colOffset));
+                i = 1;
+            }
+            for (; i < ref.length; i++) {
+                stack[sp - 1] += model->cellValue(shiftCellId(ref.startCell, rowOffset + i * ref.rowStep,
+                                                              colOffset + i * ref.colStep));
+            }
+            break;
+        }
+        case OP_SHARED:
+            if (!moved && shared->pass.load(memory_order_acquire) == table->currentPass()) {
+                stack[sp++] = shared->value.load(memory_order_relaxed);
+                pc = &code[pc->operand];
+            }
+            break;
+        case OP_STORE:
+            if (!moved) {
+                shared->value.store(stack[sp - 1], memory_order_relaxed);
+                shared->pass.store(table->currentPass(), memory_order_release);
+            }
+            break;
+        }
+    }
+    assert(sp == 1);
+    return stack[sp - 1];
+}
+
+/**
+ * @brief Program::canRunOnColumn
+ * @param col: column of the cells the program would be run for
+ * A range function reads a rectangle rather than one value per row, and a
+ * reference into col itself could read a cell of the same run before it is
+ * evaluated, so either rules out running the program a column at a time.
+ * A run of cells is read a column slice per cell, like the cell alone.
+ */
+bool Program::canRunOnColumn(int col) const {
+    if (!ranges.empty()) return false;
+    for (size_t i = 0; i < slotCells.size(); i++) {
+        if (cellIdCol(slotCells[i]) == col) return false;
+    }
+    for (const RunRef& ref : runs) {
+        int first = cellIdCol(ref.startCell);
+        if (col >= first && col <= first + (ref.length - 1) * ref.colStep) return false;
+    }
+    return true;
+}
+
+/**
+ * Applies the arithmetic instruction op to n pairs of values, storing the
+ * results over lhs.  Where SSE2 is available, as on every x86-64, two pairs
+ * are done per instruction; the results are those of the scalar operators.
+ */
+static void applyToColumn(OpCode op, double* lhs, const double* rhs, int n) {
+    int i = 0;
+#ifdef __SSE2__
+    switch (op) {
+    case OP_ADD:
+        for (; i + 2 <= n; i += 2) _mm_storeu_pd(lhs + i, _mm_add_pd(_mm_loadu_pd(lhs + i), _mm_loadu_pd(rhs + i)));
+        break;
+    case OP_SUB:
+        for (; i + 2 <= n; i += 2) _mm_storeu_pd(lhs + i, _mm_sub_pd(_mm_loadu_pd(lhs + i), _mm_loadu_pd(rhs + i)));
+        break;
+    case OP_MUL:
+        for (; i + 2 <= n; i += 2) _mm_storeu_pd(lhs + i, _mm_mul_pd(_mm_loadu_pd(lhs + i), _mm_loadu_pd(rhs + i)));
+        break;
+    case OP_DIV:
+        for (; i + 2 <= n; i += 2) _mm_storeu_pd(lhs + i, _mm_div_pd(_mm_loadu_pd(lhs + i), _mm_loadu_pd(rhs + i)));
+        break;
+    default:
+        break;
+    }
+#endif
+    for (; i < n; i++) {
+        switch (op) {
+        case OP_ADD: lhs[i] += rhs[i]; break;
+        case OP_SUB: lhs[i] -= rhs[i]; break;
+        case OP_MUL: lhs[i] *= rhs[i]; break;
+        case OP_DIV: lhs[i] /= rhs[i]; break;
+        default: break;
+        }
+    }
+}
+
+/**
+ * @brief Program::runColumn
+ * @param model: spreadsheet model supplying cell values
+ * @param rowOffset, colOffset: distance of the first cell being evaluated from the cell the program was compiled for
+ * @param count: number of cells, one per row, to evaluate
+ * @param values: receives the value of each cell
+ * The rows are taken kColumnRows at a time.  Each stack entry is then a slice
+ * of that many values: OP_LOAD copies a slice of the referenced column out of
+ * the model, and an arithmetic instruction combines two slices with one pass
+ * of vector instructions.  A run of cells adds the slice of each of its cells
+ * in turn, read into the entry above the top.  Every cell gets the value
+ * run() would give it.
+ */
+void Program::runColumn(SSModel* model, int rowOffset, int colOffset, int count, double* values) const {
+    double inlineStack[kInlineColumnDepth * kColumnRows];
+    vector<double> deepStack;
+    double* stack = inlineStack;
+    if (maxDepth > kInlineColumnDepth) {
+        deepStack.resize(maxDepth * kColumnRows);
+        stack = &deepStack[0];
+    }
+    for (int first = 0; first < count; first += kColumnRows) {
+        int n = min(kColumnRows, count - first);
+        int sp = 0;
+        const Instruction* pc = &code[0];
+        const Instruction* end = pc + code.size();
+        for (; pc < end; pc++) {
+            switch (pc->op) {
+            case OP_CONST:
+                fill(stack + sp * kColumnRows, stack + sp * kColumnRows + n, constants[pc->operand]);
+                sp++;
+                break;
+            case OP_LOAD:
+                model->columnValues(shiftCellId(slotCells[pc->operand], rowOffset + first, colOffset), n,
+                                    stack + sp * kColumnRows);
+                sp++;
+                break;
+            case OP_RANGE:
+            case OP_SHARED:
+            case OP_STORE:
+                error("Range function in a column evaluation.");
+                break;
+            case OP_RUN:
+            case OP_ADDRUN: {
+                const RunRef& ref = runs[pc->operand];
+                int i = 0;
+                if (pc->op == OP_RUN) {
+                    model->columnValues(shiftCellId(ref.startCell, rowOffset + first, colOffset), n,
+                                        stack + sp * kColumnRows);
+                    sp++;
+                    i = 1;
+                }
+                for (; i < ref.length; i++) {
+                    model->columnValues(shiftCellId(ref.startCell, rowOffset + first + i * ref.rowStep,
+                                                    colOffset + i * ref.colStep), n, stack + sp * kColumnRows);
+                    applyToColumn(OP_ADD, stack + (sp - 1) * kColumnRows, stack + sp * kColumnRows, n);
+                }
+                break;
+            }
+            default:
+                sp--;
+                applyToColumn(pc->op, stack + (sp - 1) * kColumnRows, stack + sp * kColumnRows, n);
+                break;
+            }
+        }
+        copy(stack, stack + n, values + first);
+    }
+}
@@ -0,0 +1,203 @@
+/**
+ * File: bytecode.h
+ * ----------------
+ * This file defines the Program class, a compiled form of a cell formula.
+ * A formula is parsed into an Expression tree once and then flattened into
+ * postfix bytecode, which a small stack machine evaluates on every
+ * recalculation without virtual calls or heap allocation.
+ */
+
+#ifndef _bytecode_
+#define _bytecode_
+
+#include <vector>
+#include "ssutil.h"
+#include "rangetable.h"
+
+/* Forward references */
+
+class Expression;
+class SSModel;
+
+/**
+ * Type: OpCode
+ * ------------
+ * The instructions understood by the evaluator.  OP_CONST, OP_LOAD and
+ * OP_RANGE push one value, taking their operand as an index into the
+ * program's constant, slot and range tables respectively.  The arithmetic
+ * instructions pop two values and push the result.  OP_RUN pushes the sum of
+ * a run of cells from the run table, and OP_ADDRUN adds the cells of a run
+ * to the value on top of the stack, one by one and in order.  OP_SHARED and
+ * OP_STORE enclose the code of a shared formula: OP_SHARED pushes its value
+ * and jumps to the OP_STORE its operand indexes, past which the program
+ * ends, if the value is already known for the current pass, and OP_STORE
+ * records the value the code left on top of the stack.
+ */
+
+enum OpCode { OP_CONST, OP_LOAD, OP_RANGE, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_RUN, OP_ADDRUN, OP_SHARED,
+              OP_STORE };
+
+/**
+ * Type: Instruction
+ * -----------------
+ * One bytecode instruction: an opcode and the index it operates on.
+ */
+
+struct Instruction {
+    OpCode op;
+    int operand;
+};
+
+/**
+ * Type: RangeRef
+ * --------------
+ * A range function call resolved at compile time: the function id, the
+ * corners and kind of the range it is applied to and the function's
+ * parameter, and the entry for the call in the model's RangeTable.
+ */
+
+struct RangeRef {
+    RangeFnId fn;
+    CellId startCell;
+    CellId endCell;
+    double parameter;
+    RangeKind kind;
+    RangeAggregate* aggregate;
+};
+
+/**
+ * Type: RunRef
+ * ------------
+ * A run of cells added in order: its first cell, its length and the step
+ * from one cell to the next, one row down or one column across.
+ */
+
+struct RunRef {
+    CellId startCell;
+    int length;
+    int rowStep;
+    int colStep;
+};
+
+/**
+ * Class: Program
+ * --------------
+ * This class holds the bytecode for one formula together with the constant,
+ * slot and range tables its instructions refer to.  Cell references are
+ * kept as the value slots they were bound to when the formula was parsed,
+ * and as cell ids for running the program on behalf of another cell.
+ */
+
+class Program {
+
+public:
+
+/**
+ * Constructor: Program
+ * Usage: Program *program = new Program(exp, table);
+ * --------------------------------------------------
+ * Compiles the expression tree into bytecode.  The tree is not referenced
+ * again once compilation is complete.  Each range function call is looked
+ * up in table, so that programs making the same call share its value, and
+ * so is the whole formula if it applies operators to such calls, keyed by
+ * its structure with its references as written.  Subexpressions inside it
+ * are not shared on their own.
+ */
+
+    Program(const Expression* exp, RangeTable* table);
+
+/**
+ * Destructor: ~Program
+ * --------------------
+ * Releases the program's entries in the range table.
+ */
+
+    ~Program();
+
+/**
+ * Method: hasRanges
+ * Usage: if (program->hasRanges()) ...
+ * ------------------------------------
+ * Returns true if the program calls any range function.
+ */
+
+    bool hasRanges() const;
+
+/**
+ * Methods: acquireRanges, releaseRanges
+ * Usage: program->acquireRanges(rowOffset, colOffset, aggregates);
+ *        program->releaseRanges(aggregates);
+ * ----------------------------------------------------------------
+ * acquireRanges fills aggregates with range table entries for the program's
+ * range calls moved by the given offsets, in the order of its range operands,
+ * so that a cell using a shared formula away from its anchor keeps its range
+ * values cached.  releaseRanges gives the entries back to the table.
+ */
+
+    void acquireRanges(int rowOffset, int colOffset, std::vector<RangeAggregate*>& aggregates) const;
+    void releaseRanges(const std::vector<RangeAggregate*>& aggregates) const;
+
+/**
+ * Method: run
+ * Usage: double value = program->run(model, rowOffset, colOffset, aggregates);
+ * ----------------------------------------------------------------------------
+ * Evaluates the program against the current cell values of the model, with
+ * every cell reference moved by the given offsets, as for a shared formula.
+ * With both offsets 0 the references are read through their bound slots.
+ * Moved range calls are read through aggregates, as filled by acquireRanges
+ * for the same offsets, or computed afresh if aggregates is NULL.  A shared
+ * formula is keyed by the references of the cell the program was compiled
+ * for, so only a run with both offsets 0 uses and records its value.
+ */
+
+    double run(SSModel* model, int rowOffset, int colOffset, RangeAggregate* const* aggregates) const;
+
+/**
+ * Method: canRunOnColumn
+ * Usage: if (program->canRunOnColumn(col)) ...
+ * --------------------------------------------
+ * Returns true if the program calls no range function and reads no cell of
+ * column col, by name or in a run, so that runColumn can evaluate it for a
+ * run of cells down column col at once.
+ */
+
+    bool canRunOnColumn(int col) const;
+
+/**
+ * Method: runColumn
+ * Usage: program->runColumn(model, rowOffset, colOffset, count, values);
+ * ----------------------------------------------------------------------
+ * Evaluates the program for count cells down a column, the first of them
+ * moved by the given offsets, storing their values in values.  Each
+ * instruction is applied to a whole column slice at a time.  The program
+ * must satisfy canRunOnColumn for the column of those cells.
+ */
+
+    void runColumn(SSModel* model, int rowOffset, int colOffset, int count, double* values) const;
+
+private:
+    std::vector<Instruction> code;      /* instructions in postfix order */
+    std::vector<double> constants;      /* operands of OP_CONST */
+    std::vector<const double*> slots;   /* operands of OP_LOAD */
+    std::vector<CellId> slotCells;      /* cells the slots belong to */
+    std::vector<RangeRef> ranges;       /* operands of OP_RANGE */
+    std::vector<RunRef> runs;           /* operands of OP_RUN and OP_ADDRUN */
+    SharedValue* shared;                /* entry for the value of the formula, NULL if not shared */
+    RangeTable* table;                  /* table holding the entries of ranges */
+    int maxDepth;                       /* deepest evaluation stack the code needs */
+
+/* Private helpers */
+
+    void compile(const Expression* exp, int depth);
+    void share(const Expression* exp);
+    void emit(OpCode op, int operand, int depth);
+    int addRun(const Expression* exp);
+
+/* Copying a program would release its range entries twice, so it is disallowed */
+
+    Program(const Program&);
+    Program& operator=(const Program&);
+
+};
+
+#endif
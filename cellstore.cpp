@@ -0,0 +1,498 @@
+/**
+ * File: cellstore.cpp
+ * -------------------
+ * This file implements the cellstore.h interface.
+ */
+
+#include "cellstore.h"
+#include <algorithm>
+#include <cstring>
+using namespace std;
+
+/**
+ * Implementation notes: chunk layout
+ * ----------------------------------
+ * Chunk number c * chunksPerCol + r / kChunkRows holds rows
+ * [r - r % kChunkRows, r - r % kChunkRows + kChunkRows) of column c, so the
+ * chunks of one column are adjacent in both chunk tables.  A value chunk is
+ * allocated when a cell in it is first written or bound, and is then kept
+ * until the store is cleared so that bound slots remain valid.  A formula
+ * chunk is allocated with its first occupied cell and freed with its last.
+ * occupiedChunks lists the formula chunks of each column in order, so that
+ * the occupied cells of a range are found without looking at its empty
+ * chunks; it only changes when cells are added or removed, never during a
+ * recalculation.
+ */
+
+/**
+ * Implementation notes: summary trees
+ * -----------------------------------
+ * Writing a value does not update the summary tree of its column; it only
+ * marks the chunk's leaf and its ancestors stale, stopping at the first one
+ * already marked.  The stale nodes are recomputed when a later summarize
+ * needs them, so a run of writes to one column costs a single refresh.
+ * summarize only refreshes nodes whose chunks lie wholly inside the range
+ * being summarized.  During a parallel recalculation every cell in such a
+ * range has already been evaluated, so no other thread can be writing under
+ * a node while it is refreshed; the column lock keeps two readers of the
+ * same column from refreshing the same node at once.
+ */
+
+CellStore::CellStore(int nRows, int nCols) {
+    this->nRows = nRows;
+    this->nCols = nCols;
+    chunksPerCol = (nRows + kChunkRows - 1) / kChunkRows;
+    valueChunks.assign(chunksPerCol * nCols, NULL);
+    formulaChunks.assign(chunksPerCol * nCols, NULL);
+    occupiedChunks.resize(nCols);
+    columnTrees = vector<atomic<ColumnTree*>>(nCols);
+    columnLocks = vector<mutex>(nCols);
+    columnVersions = vector<atomic<unsigned long>>(nCols);
+    chunkVersions = vector<atomic<unsigned long>>(chunksPerCol * nCols);
+    for (int col = 0; col < nCols; col++) {
+        columnTrees[col] = NULL;
+        columnVersions[col].store(0, memory_order_relaxed);
+    }
+    for (size_t i = 0; i < chunkVersions.size(); i++) {
+        chunkVersions[i].store(0, memory_order_relaxed);
+    }
+}
+
+CellStore::~CellStore() {
+    clear();
+}
+
+int CellStore::chunkIndex(CellId id) const {
+    return cellIdCol(id) * chunksPerCol + cellIdRow(id) / kChunkRows;
+}
+
+bool CellStore::isOccupied(const FormulaChunk* chunk, int offset) {
+    return (chunk->occupied[offset / 64] >> (offset % 64)) & 1;
+}
+
+/**
+ * @brief CellStore::getOrCreateValueChunk
+ * @param index: chunk number
+ * Allocates the value chunk if it does not exist yet.  Fresh value chunks are
+ * zero-filled so that unwritten cells read as 0.0.
+ */
+double* CellStore::getOrCreateValueChunk(int index) {
+    if (valueChunks[index] == NULL) {
+        valueChunks[index] = new double[kChunkRows]();
+    }
+    return valueChunks[index];
+}
+
+/**
+ * @brief CellStore::getOrCreateFormulaChunk
+ * @param index: chunk number
+ * Allocates the formula chunk, with no occupied cells, if it does not exist yet,
+ * and enters it in its column's list of occupied chunks.
+ */
+CellStore::FormulaChunk* CellStore::getOrCreateFormulaChunk(int index) {
+    if (formulaChunks[index] == NULL) {
+        FormulaChunk* chunk = new FormulaChunk;
+        for (int i = 0; i < kChunkRows; i++) {
+            chunk->formulas[i] = NULL;
+        }
+        for (int i = 0; i < kChunkRows / 64; i++) {
+            chunk->occupied[i] = 0;
+        }
+        chunk->count = 0;
+        formulaChunks[index] = chunk;
+        vector<int>& chunks = occupiedChunks[index / chunksPerCol];
+        int position = index % chunksPerCol;
+        chunks.insert(lower_bound(chunks.begin(), chunks.end(), position), position);
+    }
+    return formulaChunks[index];
+}
+
+bool CellStore::contains(CellId id) const {
+    const FormulaChunk* chunk = formulaChunks[chunkIndex(id)];
+    return chunk != NULL && isOccupied(chunk, cellIdRow(id) % kChunkRows);
+}
+
+double CellStore::getValue(CellId id) const {
+    const double* values = valueChunks[chunkIndex(id)];
+    return (values == NULL) ? 0.0 : values[cellIdRow(id) % kChunkRows];
+}
+
+const double* CellStore::getValueSlot(CellId id) {
+    return getOrCreateValueChunk(chunkIndex(id)) + cellIdRow(id) % kChunkRows;
+}
+
+Formula* CellStore::getFormula(CellId id) const {
+    const FormulaChunk* chunk = formulaChunks[chunkIndex(id)];
+    return (chunk == NULL) ? NULL : chunk->formulas[cellIdRow(id) % kChunkRows];
+}
+
+void CellStore::setCell(CellId id, Formula* formula, double value) {
+    int index = chunkIndex(id);
+    FormulaChunk* chunk = getOrCreateFormulaChunk(index);
+    int offset = cellIdRow(id) % kChunkRows;
+    if (!isOccupied(chunk, offset)) {
+        chunk->occupied[offset / 64] |= uint64_t(1) << (offset % 64);
+        chunk->count++;
+    }
+    chunk->formulas[offset] = formula;
+    getOrCreateValueChunk(index)[offset] = value;
+    markChanged(id);
+}
+
+bool CellStore::setValue(CellId id, double value) {
+    double* slot = valueChunks[chunkIndex(id)] + cellIdRow(id) % kChunkRows;
+    if (memcmp(slot, &value, sizeof(double)) == 0) return false;
+    *slot = value;
+    markChanged(id);
+    return true;
+}
+
+void CellStore::getColumnValues(CellId id, int count, double* values) const {
+    int row = cellIdRow(id);
+    int index = chunkIndex(id);
+    while (count > 0) {
+        int offset = row % kChunkRows;
+        int n = min(kChunkRows - offset, count);
+        const double* chunk = valueChunks[index];
+        if (chunk != NULL) {
+            copy(chunk + offset, chunk + offset + n, values);
+        } else {
+            fill(values, values + n, 0.0);
+        }
+        values += n;
+        count -= n;
+        row += n;
+        index++;
+    }
+}
+
+bool CellStore::setColumnValues(CellId id, int count, const double* values) {
+    bool changed = false;
+    int row = cellIdRow(id);
+    int index = chunkIndex(id);
+    while (count > 0) {
+        int offset = row % kChunkRows;
+        int n = min(kChunkRows - offset, count);
+        double* chunk = valueChunks[index] + offset;
+        if (memcmp(chunk, values, n * sizeof(double)) != 0) {
+            copy(values, values + n, chunk);
+            markChanged(packCellId(row, cellIdCol(id)));
+            changed = true;
+        }
+        values += n;
+        count -= n;
+        row += n;
+        index++;
+    }
+    return changed;
+}
+
+/**
+ * @brief CellStore::removeCell
+ * @param id: cell to be emptied
+ * Clears the cell's slot in its chunks.  A formula chunk whose last occupied
+ * cell is removed is freed again; the value chunk stays, since formulas
+ * elsewhere may still be bound to its slots.
+ */
+void CellStore::removeCell(CellId id) {
+    int index = chunkIndex(id);
+    FormulaChunk* chunk = formulaChunks[index];
+    int offset = cellIdRow(id) % kChunkRows;
+    if (chunk == NULL || !isOccupied(chunk, offset)) return;
+    chunk->occupied[offset / 64] &= ~(uint64_t(1) << (offset % 64));
+    chunk->formulas[offset] = NULL;
+    valueChunks[index][offset] = 0.0;
+    markChanged(id);
+    if (--chunk->count == 0) {
+        delete chunk;
+        formulaChunks[index] = NULL;
+        vector<int>& chunks = occupiedChunks[index / chunksPerCol];
+        chunks.erase(lower_bound(chunks.begin(), chunks.end(), index % chunksPerCol));
+    }
+}
+
+/**
+ * @brief CellStore::visitCells
+ * Calls visit(row, col, index, offset) for each occupied cell in the rectangle
+ * from startId to endId, in column-major order, where index is the cell's
+ * chunk number and offset its row within the chunk.  The chunks of each
+ * column are found in occupiedChunks by binary search, and the cells of a
+ * chunk are read off its bitmap a set bit at a time.
+ */
+template <typename Visitor>
+void CellStore::visitCells(CellId startId, CellId endId, Visitor visit) const {
+    int firstRow = cellIdRow(startId);
+    int lastRow = cellIdRow(endId);
+    for (int col = cellIdCol(startId); col <= cellIdCol(endId); col++) {
+        const vector<int>& chunks = occupiedChunks[col];
+        auto it = lower_bound(chunks.begin(), chunks.end(), firstRow / kChunkRows);
+        for (; it != chunks.end() && *it <= lastRow / kChunkRows; ++it) {
+            int index = col * chunksPerCol + *it;
+            const FormulaChunk* chunk = formulaChunks[index];
+            for (int word = 0; word < kChunkRows / 64; word++) {
+                uint64_t bits = chunk->occupied[word];
+                while (bits != 0) {
+                    int offset = word * 64 + __builtin_ctzll(bits);
+                    int row = *it * kChunkRows + offset;
+                    bits &= bits - 1;
+                    if (row >= firstRow && row <= lastRow) visit(row, col, index, offset);
+                }
+            }
+        }
+    }
+}
+
+void CellStore::getCells(Vector<CellId>& ids) const {
+    getCells(ids, packCellId(0, 0), packCellId(nRows - 1, nCols - 1));
+}
+
+void CellStore::getCells(Vector<CellId>& ids, CellId startId, CellId endId) const {
+    visitCells(startId, endId, [&](int row, int col, int, int) {
+        ids.add(packCellId(row, col));
+    });
+}
+
+long CellStore::collectValues(vector<double>& values, CellId startId, CellId endId) const {
+    long area = long(cellIdCol(endId) - cellIdCol(startId) + 1) * (cellIdRow(endId) - cellIdRow(startId) + 1);
+    size_t before = values.size();
+    visitCells(startId, endId, [&](int, int, int index, int offset) {
+        values.push_back(valueChunks[index][offset]);
+    });
+    return area - long(values.size() - before);
+}
+
+bool CellStore::occupiedExtent(CellId& startId, CellId& endId) const {
+    int firstRow = cellIdRow(endId) + 1;
+    int lastRow = -1;
+    int firstCol = -1;
+    int lastCol = -1;
+    for (int col = cellIdCol(startId); col <= cellIdCol(endId); col++) {
+        int top = cellIdRow(startId);
+        int bottom = cellIdRow(endId);
+        if (!occupiedRows(col, top, bottom)) continue;
+        if (firstCol < 0) firstCol = col;
+        lastCol = col;
+        firstRow = min(firstRow, top);
+        lastRow = max(lastRow, bottom);
+    }
+    if (firstCol < 0) return false;
+    startId = packCellId(firstRow, firstCol);
+    endId = packCellId(lastRow, lastCol);
+    return true;
+}
+
+/**
+ * @brief CellStore::occupiedRows
+ * @param col: column to search
+ * @param firstRow, lastRow: rows to search, narrowed to the first and last occupied one
+ * Searches down from firstRow and up from lastRow through the column's occupied
+ * chunks, returning false if no row in between is occupied.  Every listed chunk
+ * holds a cell, so each search ends within the first chunks it reaches that
+ * overlap the rows.
+ */
+bool CellStore::occupiedRows(int col, int& firstRow, int& lastRow) const {
+    const vector<int>& chunks = occupiedChunks[col];
+    vector<int>::const_iterator begin = lower_bound(chunks.begin(), chunks.end(), firstRow / kChunkRows);
+    vector<int>::const_iterator end = upper_bound(begin, chunks.end(), lastRow / kChunkRows);
+    int first = -1;
+    for (vector<int>::const_iterator it = begin; it != end && first < 0; ++it) {
+        const FormulaChunk* chunk = formulaChunks[col * chunksPerCol + *it];
+        int top = max(firstRow, *it * kChunkRows);
+        int bottom = min(lastRow, *it * kChunkRows + kChunkRows - 1);
+        for (int row = top; row <= bottom && first < 0; row++) {
+            if (isOccupied(chunk, row % kChunkRows)) first = row;
+        }
+    }
+    if (first < 0) return false;
+    for (vector<int>::const_iterator it = end; it != begin; ) {
+        --it;
+        const FormulaChunk* chunk = formulaChunks[col * chunksPerCol + *it];
+        int top = max(firstRow, *it * kChunkRows);
+        int bottom = min(lastRow, *it * kChunkRows + kChunkRows - 1);
+        for (int row = bottom; row >= top; row--) {
+            if (isOccupied(chunk, row % kChunkRows)) {
+                firstRow = first;
+                lastRow = row;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief CellStore::summarize
+ * Rows of a partial chunk at either end of the range are added one by one;
+ * the whole chunks in between are covered by the canonical nodes of the
+ * column's tree, merged from the left and right edges inwards.
+ */
+void CellStore::summarize(RangeSummary& summary, CellId startId, CellId endId) {
+    int firstRow = cellIdRow(startId);
+    int lastRow = cellIdRow(endId);
+    int firstChunk = (firstRow + kChunkRows - 1) / kChunkRows;
+    int lastChunk = (lastRow + 1) / kChunkRows - 1;
+    for (int col = cellIdCol(startId); col <= cellIdCol(endId); col++) {
+        if (firstChunk > lastChunk) {
+            summarizeRows(summary, col, firstRow, lastRow);
+            continue;
+        }
+        summarizeRows(summary, col, firstRow, firstChunk * kChunkRows - 1);
+        lock_guard<mutex> guard(columnLocks[col]);
+        ColumnTree* tree = getOrCreateTree(col);
+        vector<int> rightNodes;
+        int left = tree->leafCount + firstChunk;
+        int right = tree->leafCount + lastChunk + 1;
+        while (left < right) {
+            if (left & 1) {
+                refreshNode(tree, col, left);
+                mergeSummary(summary, tree->nodes[left++]);
+            }
+            if (right & 1) {
+                rightNodes.push_back(--right);
+            }
+            left /= 2;
+            right /= 2;
+        }
+        for (int i = rightNodes.size() - 1; i >= 0; i--) {
+            refreshNode(tree, col, rightNodes[i]);
+            mergeSummary(summary, tree->nodes[rightNodes[i]]);
+        }
+        summarizeRows(summary, col, (lastChunk + 1) * kChunkRows, lastRow);
+    }
+}
+
+/**
+ * @brief CellStore::summarizeRows
+ * Adds the values of rows firstRow to lastRow of one column to summary, one
+ * chunk at a time.  The rows of an allocated chunk are handed to the block
+ * kernels straight from its value array; those of an unallocated chunk are
+ * all zero and are summarized without being read.
+ */
+void CellStore::summarizeRows(RangeSummary& summary, int col, int firstRow, int lastRow) const {
+    int row = firstRow;
+    while (row <= lastRow) {
+        int offset = row % kChunkRows;
+        int n = min(kChunkRows - offset, lastRow - row + 1);
+        const double* values = valueChunks[col * chunksPerCol + row / kChunkRows];
+        if (values != NULL) {
+            summarizeValues(summary, values + offset, n);
+        } else {
+            RangeSummary zeros;
+            clearSummary(zeros);
+            zeros.count = n;
+            zeros.product = 0;
+            mergeSummary(summary, zeros);
+        }
+        row += n;
+    }
+}
+
+/**
+ * @brief CellStore::getOrCreateTree
+ * Creates the column's tree with every node stale, so that nothing is
+ * computed until a range actually needs it.  Must be called with the
+ * column lock held.
+ */
+CellStore::ColumnTree* CellStore::getOrCreateTree(int col) {
+    ColumnTree* tree = columnTrees[col];
+    if (tree == NULL) {
+        int leafCount = 1;
+        while (leafCount < chunksPerCol) leafCount *= 2;
+        tree = new ColumnTree(leafCount);
+        for (int node = 1; node < 2 * leafCount; node++) {
+            tree->stale[node] = true;
+        }
+        columnTrees[col] = tree;
+    }
+    return tree;
+}
+
+/**
+ * @brief CellStore::refreshNode
+ * Recomputes a stale node from its chunk or, for an inner node, from its
+ * children after refreshing them.  Leaves past the last chunk of the column
+ * summarize no values.
+ */
+void CellStore::refreshNode(ColumnTree* tree, int col, int node) {
+    if (!tree->stale[node].load(memory_order_relaxed)) return;
+    tree->stale[node].store(false, memory_order_relaxed);
+    RangeSummary& summary = tree->nodes[node];
+    clearSummary(summary);
+    if (node >= tree->leafCount) {
+        int chunk = node - tree->leafCount;
+        if (chunk < chunksPerCol) {
+            int firstRow = chunk * kChunkRows;
+            summarizeRows(summary, col, firstRow, min(firstRow + kChunkRows, nRows) - 1);
+        }
+    } else {
+        refreshNode(tree, col, 2 * node);
+        refreshNode(tree, col, 2 * node + 1);
+        summary = tree->nodes[2 * node];
+        mergeSummary(summary, tree->nodes[2 * node + 1]);
+    }
+}
+
+/**
+ * @brief CellStore::markChanged
+ * Bumps the version counters of the cell's column and chunk, and marks the
+ * leaf of the cell's chunk and its ancestors stale.  Since the
+ * ancestors of a stale node are already stale, the walk ends at the first
+ * node found marked.
+ */
+void CellStore::markChanged(CellId id) {
+    columnVersions[cellIdCol(id)].fetch_add(1, memory_order_relaxed);
+    chunkVersions[chunkIndex(id)].fetch_add(1, memory_order_relaxed);
+    ColumnTree* tree = columnTrees[cellIdCol(id)];
+    if (tree == NULL) return;
+    int node = tree->leafCount + cellIdRow(id) / kChunkRows;
+    while (node >= 1 && !tree->stale[node].load(memory_order_relaxed)) {
+        tree->stale[node].store(true, memory_order_relaxed);
+        node /= 2;
+    }
+}
+
+/**
+ * @brief CellStore::columnVersion
+ * The counters are bumped with relaxed atomic adds: a reader on another
+ * thread sees a write to a cell it reads, and the bump made with it, through
+ * whatever ordered the write before the read, such as the thread pool.
+ */
+unsigned long CellStore::columnVersion(CellId startId, CellId endId) const {
+    unsigned long version = 0;
+    for (int col = cellIdCol(startId); col <= cellIdCol(endId); col++) {
+        version += columnVersions[col].load(memory_order_relaxed);
+    }
+    return version;
+}
+
+unsigned long CellStore::rangeVersion(CellId startId, CellId endId) const {
+    unsigned long version = 0;
+    int firstChunk = cellIdRow(startId) / kChunkRows;
+    int lastChunk = cellIdRow(endId) / kChunkRows;
+    for (int col = cellIdCol(startId); col <= cellIdCol(endId); col++) {
+        for (int chunk = firstChunk; chunk <= lastChunk; chunk++) {
+            version += chunkVersions[col * chunksPerCol + chunk].load(memory_order_relaxed);
+        }
+    }
+    return version;
+}
+
+void CellStore::clear() {
+    for (size_t i = 0; i < formulaChunks.size(); i++) {
+        delete formulaChunks[i];
+        delete[] valueChunks[i];
+        formulaChunks[i] = NULL;
+        valueChunks[i] = NULL;
+    }
+    for (int col = 0; col < nCols; col++) {
+        occupiedChunks[col].clear();
+    }
+    for (int col = 0; col < nCols; col++) {
+        delete columnTrees[col].load();
+        columnTrees[col] = NULL;
+        columnVersions[col].fetch_add(1, memory_order_relaxed);
+    }
+    for (size_t i = 0; i < chunkVersions.size(); i++) {
+        chunkVersions[i].fetch_add(1, memory_order_relaxed);
+    }
+}
@@ -0,0 +1,301 @@
+/**
+ * File: cellstore.h
+ * -----------------
+ * This file defines the CellStore class, the backing store for the contents
+ * of spreadsheet cells.  Cells are addressed by CellId rather than by name,
+ * and storage is organized column-major in fixed-size chunks of rows.
+ * Chunks are allocated only when a cell inside them is first written or
+ * referenced, so a sparse sheet costs little more than the cells it actually
+ * holds.
+ */
+
+#ifndef _cellstore_
+#define _cellstore_
+
+#include <vector>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include "vector.h"
+#include "ssutil.h"
+
+/* Forward reference */
+
+class Formula;
+
+/**
+ * Class: CellStore
+ * ----------------
+ * Each column is split into chunks of kChunkRows rows.  A chunk keeps the
+ * numeric values of its cells in one contiguous array of doubles and the
+ * formulas in a separate allocation, so that reading values during
+ * recalculation never touches formula data.  Cells sharing a formula hold
+ * the same Formula pointer.  Empty cells always hold the value 0.0.
+ */
+
+class CellStore {
+
+public:
+
+/**
+ * Constant: kChunkRows
+ * --------------------
+ * Number of rows covered by one chunk of a column.
+ */
+
+    static const int kChunkRows = 256;
+
+/**
+ * Constructor: CellStore
+ * Usage: CellStore store(nRows, nCols);
+ * -------------------------------------
+ * Creates an empty store for a sheet with the given number of rows and columns.
+ * No chunks are allocated until cells are written.
+ */
+
+    CellStore(int nRows, int nCols);
+
+/**
+ * Destructor: ~CellStore
+ * ----------------------
+ * Frees every allocated chunk.  Formulas are owned by the model and are
+ * not deleted here.
+ */
+
+    ~CellStore();
+
+/**
+ * Member function: contains
+ * Usage: if (store.contains(id)) ...
+ * ----------------------------------
+ * Returns true if the cell holds a formula or string, false if it is empty.
+ */
+
+    bool contains(CellId id) const;
+
+/**
+ * Member function: getValue
+ * Usage: double value = store.getValue(id);
+ * -----------------------------------------
+ * Returns the cached numeric value of the cell, 0.0 if the cell is empty.
+ */
+
+    double getValue(CellId id) const;
+
+/**
+ * Member function: getValueSlot
+ * Usage: const double* slot = store.getValueSlot(id);
+ * ---------------------------------------------------
+ * Returns the address at which the value of the cell is kept, allocating
+ * its value chunk if necessary.  The address stays valid, and keeps
+ * reflecting the current value of the cell as it is set and emptied, until
+ * the store is cleared.  Formulas bind their references to these slots.
+ */
+
+    const double* getValueSlot(CellId id);
+
+/**
+ * Member function: getFormula
+ * Usage: Formula* formula = store.getFormula(id);
+ * -----------------------------------------------
+ * Returns the formula of the cell, or NULL if the cell is empty.
+ */
+
+    Formula* getFormula(CellId id) const;
+
+/**
+ * Member function: setCell
+ * Usage: store.setCell(id, formula, value);
+ * -----------------------------------------
+ * Stores the contents of a cell, allocating its chunks if needed.
+ */
+
+    void setCell(CellId id, Formula* formula, double value);
+
+/**
+ * Member function: setValue
+ * Usage: bool changed = store.setValue(id, value);
+ * ------------------------------------------------
+ * Updates only the cached value of an occupied cell, leaving its formula
+ * unchanged.  Returns true if the value changed, comparing bit for bit; an
+ * unchanged value leaves the cell's versions alone.
+ */
+
+    bool setValue(CellId id, double value);
+
+/**
+ * Member functions: getColumnValues, setColumnValues
+ * Usage: store.getColumnValues(id, count, values);
+ *        bool changed = store.setColumnValues(id, count, values);
+ * -------------------------------------------------------------
+ * Copy the values of the count cells from id down its column out of or into
+ * values, a chunk at a time.  Empty cells read as 0.0; the cells written
+ * must all be occupied.  setColumnValues returns true if any value changed,
+ * comparing bit for bit.
+ */
+
+    void getColumnValues(CellId id, int count, double* values) const;
+    bool setColumnValues(CellId id, int count, const double* values);
+
+/**
+ * Member function: removeCell
+ * Usage: store.removeCell(id);
+ * ----------------------------
+ * Empties the cell.  Its value reads as 0.0 afterwards, including through
+ * any slot bound to it.
+ */
+
+    void removeCell(CellId id);
+
+/**
+ * Member function: getCells
+ * Usage: store.getCells(ids);
+ * ---------------------------
+ * Appends the ids of all occupied cells to ids, in column-major order.
+ * Chunks that were never allocated are skipped without being scanned.
+ */
+
+    void getCells(Vector<CellId>& ids) const;
+
+/**
+ * Member function: getCells
+ * Usage: store.getCells(ids, startId, endId);
+ * -------------------------------------------
+ * Appends the ids of the occupied cells in the rectangle from startId to
+ * endId to ids, in column-major order.  Only the occupied chunks of each
+ * column are visited, so the cost follows the number of cells in the
+ * rectangle rather than its area.
+ */
+
+    void getCells(Vector<CellId>& ids, CellId startId, CellId endId) const;
+
+/**
+ * Member function: collectValues
+ * Usage: long empty = store.collectValues(values, startId, endId);
+ * ----------------------------------------------------------------
+ * Appends the values of the occupied cells in the rectangle from startId to
+ * endId, in column-major order, to values, and returns the number of empty
+ * cells in the rectangle, each of which stands for a value of 0.0.  Like
+ * getCells, it visits occupied cells only.
+ */
+
+    long collectValues(std::vector<double>& values, CellId startId, CellId endId) const;
+
+/**
+ * Member function: occupiedExtent
+ * Usage: if (store.occupiedExtent(startId, endId)) ...
+ * ----------------------------------------------------
+ * Shrinks the rectangle from startId to endId to the smallest one holding
+ * all its occupied cells and returns true, or returns false, leaving the
+ * rectangle as it is, if none of its cells is occupied.  The cost depends on
+ * the number of columns in the rectangle, not on its height.
+ */
+
+    bool occupiedExtent(CellId& startId, CellId& endId) const;
+
+/**
+ * Member function: summarize
+ * Usage: store.summarize(summary, startId, endId);
+ * ------------------------------------------------
+ * Merges the values of every cell in the rectangle from startId to endId
+ * into summary, empty cells contributing 0.0.  Whole chunks are taken from
+ * a summary tree kept for each column, so a tall range costs a logarithmic
+ * number of merges plus a scan of the partial chunks at its ends, which
+ * reads the chunks' value arrays directly with vector instructions.  Several
+ * threads may call summarize at once, and cells outside the rectangle may
+ * be written meanwhile.
+ */
+
+    void summarize(RangeSummary& summary, CellId startId, CellId endId);
+
+/**
+ * Member functions: columnVersion, rangeVersion
+ * Usage: if (store.rangeVersion(startId, endId) == version) ...
+ * -------------------------------------------------------------
+ * Every column and every chunk of a column has a version counter, which
+ * goes up whenever a cell in it is set, emptied or given a different value.
+ * columnVersion returns the sum of the counters of the columns from
+ * startId to endId, and rangeVersion the sum of the counters of the chunks
+ * the rectangle from startId to endId touches.  Counters only ever go up,
+ * so while either sum stays the same no cell in the rectangle has changed.
+ * columnVersion costs one load per column and rangeVersion one per chunk.
+ * Both may be called while other threads write cells.
+ */
+
+    unsigned long columnVersion(CellId startId, CellId endId) const;
+    unsigned long rangeVersion(CellId startId, CellId endId) const;
+
+/**
+ * Member function: clear
+ * Usage: store.clear();
+ * ---------------------
+ * Empties every cell and frees all chunks.  Slots handed out before the
+ * call are no longer valid.
+ */
+
+    void clear();
+
+private:
+
+/**
+ * Type: FormulaChunk
+ * ------------------
+ * Formulas of kChunkRows cells of one column, together with a bitmap
+ * recording which of those cells are occupied.
+ */
+
+    struct FormulaChunk {
+        Formula* formulas[kChunkRows];
+        uint64_t occupied[kChunkRows / 64];
+        int count;
+    };
+
+/**
+ * Type: ColumnTree
+ * ----------------
+ * A segment tree over the chunks of one column, stored as an array with the
+ * root at 1, the children of node i at 2i and 2i + 1, and the leaf for
+ * chunk c at leafCount + c.  A node marked stale may not match its chunks;
+ * whenever a node is stale, so are all its ancestors.
+ */
+
+    struct ColumnTree {
+        int leafCount;
+        std::vector<RangeSummary> nodes;
+        std::vector<std::atomic<bool>> stale;
+        ColumnTree(int leafCount) : leafCount(leafCount), nodes(2 * leafCount), stale(2 * leafCount) {}
+    };
+
+    int nRows;                                  /* number of rows in the sheet */
+    int nCols;                                  /* number of columns in the sheet */
+    int chunksPerCol;                           /* number of chunks covering one column */
+    std::vector<double*> valueChunks;           /* value arrays indexed by chunk number, NULL if unallocated */
+    std::vector<FormulaChunk*> formulaChunks;   /* formula data indexed by chunk number, NULL if unallocated */
+    std::vector<std::vector<int>> occupiedChunks;   /* positions down each column of its formula chunks, ascending */
+    std::vector<std::atomic<ColumnTree*>> columnTrees;  /* summary tree of each column, NULL until first summarized */
+    std::vector<std::mutex> columnLocks;        /* guard the refreshing of each column's tree */
+    std::vector<std::atomic<unsigned long>> columnVersions; /* version counter of each column */
+    std::vector<std::atomic<unsigned long>> chunkVersions;  /* version counter of each chunk, by chunk number */
+
+/* Private helpers */
+
+    int chunkIndex(CellId id) const;
+    double* getOrCreateValueChunk(int index);
+    FormulaChunk* getOrCreateFormulaChunk(int index);
+    static bool isOccupied(const FormulaChunk* chunk, int offset);
+    bool occupiedRows(int col, int& firstRow, int& lastRow) const;
+    template <typename Visitor>
+    void visitCells(CellId startId, CellId endId, Visitor visit) const;
+    void markChanged(CellId id);
+    void summarizeRows(RangeSummary& summary, int col, int firstRow, int lastRow) const;
+    ColumnTree* getOrCreateTree(int col);
+    void refreshNode(ColumnTree* tree, int col, int node);
+
+/* Copying a store would share its chunks, so it is disallowed */
+
+    CellStore(const CellStore&);
+    CellStore& operator=(const CellStore&);
+
+};
+
+#endif
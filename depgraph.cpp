@@ -0,0 +1,183 @@
+/**
+ * File: depgraph.cpp
+ * ------------------
+ * This file implements the depgraph.h interface.
+ */
+
+#include "depgraph.h"
+#include <algorithm>
+using namespace std;
+
+/* Abandoned slots tolerated before compacting, beyond twice the live arcs */
+
+static const int kCompactionSlack = 4096;
+
+/* Capacity of a node's first forward slice */
+
+static const int kMinForwardCapacity = 4;
+
+DepGraph::DepGraph() {
+    liveArcs = 0;
+    epoch = 1;
+}
+
+int DepGraph::getOrAddNode(CellId cell) {
+    unordered_map<CellId, int>::const_iterator it = nodeIndex.find(cell);
+    if (it != nodeIndex.end()) return it->second;
+    int node = nodeCells.size();
+    nodeIndex[cell] = node;
+    nodeCells.push_back(cell);
+    generation.push_back(0);
+    forwardStart.push_back(0);
+    forwardCount.push_back(0);
+    forwardCapacity.push_back(0);
+    reverseStart.push_back(0);
+    reverseCount.push_back(0);
+    visitEpoch.push_back(0);
+    return node;
+}
+
+bool DepGraph::isLive(const ForwardArc& arc) const {
+    return generation[arc.node] == arc.gen;
+}
+
+/**
+ * @brief DepGraph::setDependencies
+ * @param cell: cell whose formula changed
+ * @param dependencies: cells the new formula refers to
+ * Bumping the generation of the cell invalidates all forward arcs into it
+ * without visiting them; the old reverse slice is simply abandoned.
+ */
+void DepGraph::setDependencies(CellId cell, const Vector<CellId>& dependencies) {
+    int node = getOrAddNode(cell);
+    liveArcs -= reverseCount[node];
+    generation[node]++;
+    vector<int> targets;
+    for (CellId dep : dependencies) {
+        targets.push_back(getOrAddNode(dep));
+    }
+    sort(targets.begin(), targets.end());
+    targets.erase(unique(targets.begin(), targets.end()), targets.end());
+    reverseStart[node] = reverseArcs.size();
+    reverseCount[node] = targets.size();
+    for (int target : targets) {
+        reverseArcs.push_back(target);
+        addForwardArc(target, node);
+    }
+    liveArcs += targets.size();
+    int abandoned = forwardArcs.size() + reverseArcs.size() - 2 * liveArcs;
+    if (abandoned > 2 * liveArcs + kCompactionSlack) {
+        compact();
+    }
+}
+
+/**
+ * @brief DepGraph::addForwardArc
+ * Appends an arc to the forward slice of from.  A full slice is moved to the
+ * end of the array with doubled capacity, keeping only its live arcs.
+ */
+void DepGraph::addForwardArc(int from, int to) {
+    if (forwardCount[from] == forwardCapacity[from]) {
+        int oldStart = forwardStart[from];
+        int oldCount = forwardCount[from];
+        int newCapacity = max(kMinForwardCapacity, 2 * forwardCapacity[from]);
+        forwardStart[from] = forwardArcs.size();
+        forwardCount[from] = 0;
+        forwardCapacity[from] = newCapacity;
+        for (int i = 0; i < oldCount; i++) {
+            ForwardArc arc = forwardArcs[oldStart + i];
+            if (isLive(arc)) {
+                forwardArcs.push_back(arc);
+                forwardCount[from]++;
+            }
+        }
+        forwardArcs.resize(forwardStart[from] + newCapacity);
+    }
+    ForwardArc arc;
+    arc.node = to;
+    arc.gen = generation[to];
+    forwardArcs[forwardStart[from] + forwardCount[from]++] = arc;
+}
+
+/**
+ * @brief DepGraph::compact
+ * Rebuilds both arc arrays in node order with no tombstones or spare
+ * capacity, so that each node's arcs are contiguous again.
+ */
+void DepGraph::compact() {
+    vector<ForwardArc> newForward;
+    vector<int> newReverse;
+    newForward.reserve(liveArcs);
+    newReverse.reserve(liveArcs);
+    for (size_t node = 0; node < nodeCells.size(); node++) {
+        int start = newForward.size();
+        for (int i = 0; i < forwardCount[node]; i++) {
+            const ForwardArc& arc = forwardArcs[forwardStart[node] + i];
+            if (isLive(arc)) newForward.push_back(arc);
+        }
+        forwardStart[node] = start;
+        forwardCount[node] = newForward.size() - start;
+        forwardCapacity[node] = forwardCount[node];
+        start = newReverse.size();
+        for (int i = 0; i < reverseCount[node]; i++) {
+            newReverse.push_back(reverseArcs[reverseStart[node] + i]);
+        }
+        reverseStart[node] = start;
+    }
+    forwardArcs.swap(newForward);
+    reverseArcs.swap(newReverse);
+}
+
+void DepGraph::getDependencies(CellId cell, Vector<CellId>& dependencies) const {
+    unordered_map<CellId, int>::const_iterator it = nodeIndex.find(cell);
+    if (it == nodeIndex.end()) return;
+    int node = it->second;
+    for (int i = 0; i < reverseCount[node]; i++) {
+        dependencies.add(nodeCells[reverseArcs[reverseStart[node] + i]]);
+    }
+}
+
+void DepGraph::getDependents(CellId cell, Vector<CellId>& dependents) const {
+    unordered_map<CellId, int>::const_iterator it = nodeIndex.find(cell);
+    if (it == nodeIndex.end()) return;
+    int node = it->second;
+    for (int i = 0; i < forwardCount[node]; i++) {
+        const ForwardArc& arc = forwardArcs[forwardStart[node] + i];
+        if (isLive(arc)) dependents.add(nodeCells[arc.node]);
+    }
+}
+
+/**
+ * @brief DepGraph::startTraversal
+ * Moving to the next epoch unmarks every node at once.  Only when the
+ * counter wraps around are the marks actually cleared.
+ */
+void DepGraph::startTraversal() {
+    epoch++;
+    if (epoch == 0) {
+        fill(visitEpoch.begin(), visitEpoch.end(), 0);
+        epoch = 1;
+    }
+}
+
+bool DepGraph::markVisited(CellId cell) {
+    int node = getOrAddNode(cell);
+    if (visitEpoch[node] == epoch) return false;
+    visitEpoch[node] = epoch;
+    return true;
+}
+
+void DepGraph::clear() {
+    nodeIndex.clear();
+    nodeCells.clear();
+    generation.clear();
+    forwardStart.clear();
+    forwardCount.clear();
+    forwardCapacity.clear();
+    forwardArcs.clear();
+    reverseStart.clear();
+    reverseCount.clear();
+    reverseArcs.clear();
+    visitEpoch.clear();
+    liveArcs = 0;
+}
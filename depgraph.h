@@ -0,0 +1,151 @@
+/**
+ * File: depgraph.h
+ * ----------------
+ * This file defines the DepGraph class, the dependency graph between
+ * spreadsheet cells.  An arc runs from a cell to each cell whose formula
+ * refers to it by name.  Ranges read by range functions are not arcs in this
+ * graph; they are kept by RangeIndex.
+ */
+
+#ifndef _depgraph_
+#define _depgraph_
+
+#include <vector>
+#include <unordered_map>
+#include "vector.h"
+#include "ssutil.h"
+
+/**
+ * Class: DepGraph
+ * ---------------
+ * Cells that take part in a dependency are numbered densely as nodes, and
+ * both directions of adjacency live in flat arrays of node numbers, each
+ * node owning one contiguous slice.
+ *
+ * Edits are cheap because nothing is ever erased in place:
+ *
+ *  - Replacing the dependencies of a cell appends a fresh slice of reverse
+ *    arcs and abandons the old one.
+ *  - Each forward arc is stamped with the generation of the cell it points
+ *    to.  Replacing a cell's dependencies bumps its generation, which turns
+ *    every forward arc into it into a tombstone at once, however many
+ *    cells it depends on.
+ *  - A forward slice that fills up is moved to the end of the array with
+ *    twice the capacity, dropping its tombstones on the way.
+ *
+ * Once the abandoned space outgrows the live arcs, both arrays are
+ * compacted back into tight CSR form.
+ *
+ * Traversals over the graph mark the cells they visit with an epoch number
+ * rather than a flag, so starting a new traversal never has to clear the
+ * marks left by the previous one.
+ */
+
+class DepGraph {
+
+public:
+
+/**
+ * Constructor: DepGraph
+ * Usage: DepGraph graph;
+ * ----------------------
+ * Creates an empty graph.
+ */
+
+    DepGraph();
+
+/**
+ * Member function: setDependencies
+ * Usage: graph.setDependencies(A1, {B1, C2});
+ * -------------------------------------------
+ * Makes dependencies the complete set of cells that cell refers to,
+ * replacing any it referred to before.  Duplicates are ignored.
+ */
+
+    void setDependencies(CellId cell, const Vector<CellId>& dependencies);
+
+/**
+ * Member function: getDependencies
+ * Usage: graph.getDependencies(A1, cellsA1RefersTo);
+ * --------------------------------------------------
+ * Appends the cells that cell refers to.
+ */
+
+    void getDependencies(CellId cell, Vector<CellId>& dependencies) const;
+
+/**
+ * Member function: getDependents
+ * Usage: graph.getDependents(A1, cellsReferringToA1);
+ * ---------------------------------------------------
+ * Appends the cells whose formulas refer to cell, each once.
+ */
+
+    void getDependents(CellId cell, Vector<CellId>& dependents) const;
+
+/**
+ * Member function: startTraversal
+ * Usage: graph.startTraversal();
+ * ------------------------------
+ * Begins a new traversal, in which no cell has been visited yet.  Only one
+ * traversal is in progress at a time; starting one ends the previous one.
+ */
+
+    void startTraversal();
+
+/**
+ * Member function: markVisited
+ * Usage: if (graph.markVisited(cell)) ...
+ * ---------------------------------------
+ * Marks cell as visited by the current traversal.  Returns true if it was
+ * not visited before, false if it already was.  A cell that is not yet in
+ * the graph is added to it.
+ */
+
+    bool markVisited(CellId cell);
+
+/**
+ * Member function: clear
+ * Usage: graph.clear();
+ * ---------------------
+ * Removes every node and arc.
+ */
+
+    void clear();
+
+private:
+
+/**
+ * Type: ForwardArc
+ * ----------------
+ * A forward arc to node, valid only while node's generation still equals gen.
+ */
+
+    struct ForwardArc {
+        int node;
+        unsigned int gen;
+    };
+
+    std::unordered_map<CellId, int> nodeIndex;  /* node number of each cell in the graph */
+    std::vector<CellId> nodeCells;              /* cell of each node number */
+    std::vector<unsigned int> generation;       /* bumped when a node's dependencies are replaced */
+    std::vector<int> forwardStart;              /* first slot of each node's forward slice */
+    std::vector<int> forwardCount;              /* slots in use in each node's forward slice */
+    std::vector<int> forwardCapacity;           /* slots reserved for each node's forward slice */
+    std::vector<ForwardArc> forwardArcs;        /* forward slices: arcs to dependent nodes */
+    std::vector<int> reverseStart;              /* first slot of each node's reverse slice */
+    std::vector<int> reverseCount;              /* length of each node's reverse slice */
+    std::vector<int> reverseArcs;               /* reverse slices: nodes each node refers to */
+    int liveArcs;                               /* number of arcs currently in the graph */
+    std::vector<unsigned int> visitEpoch;       /* epoch of the traversal that last visited each node */
+    unsigned int epoch;                         /* epoch of the current traversal, never 0 */
+
+/* Private helpers */
+
+    int getOrAddNode(CellId cell);
+    bool isLive(const ForwardArc& arc) const;
+    void addForwardArc(int from, int to);
+    void compact();
+
+};
+
+#endif
@@ -5,6 +5,7 @@
  */
 
 #include <string>
+#include <algorithm>
 #include "exp.h"
 #include "strlib.h"
 #include "error.h"
@@ -48,7 +49,7 @@ ExpressionType DoubleExp::getType() const {
    return DOUBLE;
 }
 
-void DoubleExp::getDependent(Vector<string>& dependents, SSModel* model) const {
+void DoubleExp::getDependent(Vector<CellId>& dependents, Vector<range>& rangeDependents) const {
     return;
 }
 
@@ -79,7 +80,7 @@ ExpressionType TextStringExp::getType() const {
     return TEXTSTRING;
 }
 
-void TextStringExp::getDependent(Vector<string>& dependents, SSModel* model) const {
+void TextStringExp::getDependent(Vector<CellId>& dependents, Vector<range>& rangeDependents) const {
     return;
 }
 
@@ -90,20 +91,22 @@ string TextStringExp::getTextStringValue() const {
 /**
  * Implementation notes: IdentifierExp
  * -----------------------------------
- * The IdentifierExp subclass represents a spreadsheet cell name.  The
- * implementation of eval looks up that name in the spreadsheet model.
+ * The IdentifierExp subclass represents a spreadsheet cell reference.  The
+ * reference is bound to the cell's value slot when it is parsed, so the
+ * implementation of eval simply reads that slot.
  */
 
-IdentifierExp::IdentifierExp(const string& name) {
-   this->name = name;
+IdentifierExp::IdentifierExp(CellId id, const double* slot) {
+   this->id = id;
+   this->slot = slot;
 }
 
 double IdentifierExp::eval(SSModel* model) const {
-   return model->getCellData(name);
+   return *slot;
 }
 
 string IdentifierExp::toString() const {
-   return name;
+   return cellIdToString(id);
 }
 
 ExpressionType IdentifierExp::getType() const {
@@ -111,14 +114,22 @@ ExpressionType IdentifierExp::getType() const {
 }
 
 /**
- * Adds cell name to vector of dependents
+ * Adds cell id to vector of dependents
  */
-void IdentifierExp::getDependent(Vector<string>& dependents, SSModel* model) const {
-    dependents.add(name);
+void IdentifierExp::getDependent(Vector<CellId>& dependents, Vector<range>& rangeDependents) const {
+    dependents.add(id);
 }
 
 string IdentifierExp::getIdentifierName() const {
-   return name;
+   return cellIdToString(id);
+}
+
+CellId IdentifierExp::getCellId() const {
+   return id;
+}
+
+const double* IdentifierExp::getSlot() const {
+   return slot;
 }
 
 /**
@@ -135,11 +146,6 @@ CompoundExp::CompoundExp(const string& op, const Expression *lhs, const Expressi
    this->rhs = rhs;
 }
 
-CompoundExp::~CompoundExp() {
-   delete lhs;
-   delete rhs;
-}
-
 double CompoundExp::eval(SSModel* model) const {
    double right = rhs->eval(model);
    double left = lhs->eval(model);
@@ -160,9 +166,9 @@ ExpressionType CompoundExp::getType() const {
    return COMPOUND;
 }
 
-void CompoundExp::getDependent(Vector<string>& dependents, SSModel* model) const {
-    lhs->getDependent(dependents, model);
-    rhs->getDependent(dependents, model);
+void CompoundExp::getDependent(Vector<CellId>& dependents, Vector<range>& rangeDependents) const {
+    lhs->getDependent(dependents, rangeDependents);
+    rhs->getDependent(dependents, rangeDependents);
 }
 
 string CompoundExp::getOperator() const {
@@ -177,6 +183,121 @@ const Expression *CompoundExp::getRHS() const {
    return rhs;
 }
 
+/**
+ * Implementation notes: NaryExp
+ * -----------------------------
+ * The operands are combined from left to right, so a chain gives exactly
+ * the value of the left-grouped binary tree it replaces, with no recursion
+ * along the chain.  toString prints the chain in one pair of parentheses,
+ * which reads back as that same tree.
+ */
+
+NaryExp::NaryExp(const string& op, const vector<const Expression *>& operands) {
+   this->op = op;
+   this->operands = operands;
+}
+
+double NaryExp::eval(SSModel* model) const {
+   double value = operands[0]->eval(model);
+   for (size_t i = 1; i < operands.size(); i++) {
+      if (op == "+") value += operands[i]->eval(model);
+      else if (op == "-") value -= operands[i]->eval(model);
+      else if (op == "*") value *= operands[i]->eval(model);
+      else if (op == "/") value /= operands[i]->eval(model); // divide by 0.0 gives ±INF
+      else error("Illegal operator in expression.");
+   }
+   return value;
+}
+
+string NaryExp::toString() const {
+   string text = "(";
+   for (size_t i = 0; i < operands.size(); i++) {
+      if (i > 0) text += ' ' + op + ' ';
+      text += operands[i]->toString();
+   }
+   return text + ')';
+}
+
+ExpressionType NaryExp::getType() const {
+   return NARY;
+}
+
+void NaryExp::getDependent(Vector<CellId>& dependents, Vector<range>& rangeDependents) const {
+   for (const Expression *operand : operands) {
+      operand->getDependent(dependents, rangeDependents);
+   }
+}
+
+string NaryExp::getOperator() const {
+   return op;
+}
+
+int NaryExp::getOperandCount() const {
+   return operands.size();
+}
+
+const Expression *NaryExp::getOperand(int index) const {
+   return operands[index];
+}
+
+/**
+ * Implementation notes: CellRunExp
+ * --------------------------------
+ * A run goes down a column when its ends share a column and along a row
+ * otherwise.  eval adds the cells in order, starting from the first, as the
+ * chain of + it stands for would; toString joins them in the same way, so
+ * that the chain it is an operand of prints as it was written.
+ */
+
+CellRunExp::CellRunExp(CellId startCell, CellId endCell) {
+   this->startCell = startCell;
+   this->endCell = endCell;
+}
+
+double CellRunExp::eval(SSModel* model) const {
+   double value = model->cellValue(startCell);
+   for (int i = 1; i < getLength(); i++) {
+      value += model->cellValue(getCell(i));
+   }
+   return value;
+}
+
+string CellRunExp::toString() const {
+   string text = cellIdToString(startCell);
+   for (int i = 1; i < getLength(); i++) {
+      text += " + " + cellIdToString(getCell(i));
+   }
+   return text;
+}
+
+ExpressionType CellRunExp::getType() const {
+   return CELLRUN;
+}
+
+void CellRunExp::getDependent(Vector<CellId>& dependents, Vector<range>& rangeDependents) const {
+   range r;
+   r.startCell = startCell;
+   r.stopCell = endCell;
+   rangeDependents.add(r);
+}
+
+CellId CellRunExp::getStartCell() const {
+   return startCell;
+}
+
+CellId CellRunExp::getEndCell() const {
+   return endCell;
+}
+
+int CellRunExp::getLength() const {
+   return cellIdRow(endCell) - cellIdRow(startCell) + cellIdCol(endCell) - cellIdCol(startCell) + 1;
+}
+
+CellId CellRunExp::getCell(int index) const {
+   if (cellIdCol(startCell) == cellIdCol(endCell)) return shiftCellId(startCell, index, 0);
+   return shiftCellId(startCell, 0, index);
+}
+
 /**
  * Implementation notes: RangeExp
  * ---------------------------------
@@ -184,10 +305,14 @@ const Expression *CompoundExp::getRHS() const {
  * model->applyRangeFunction() which applies range function on vector of values from start to end cell range.
  */
 
-RangeExp::RangeExp(const string rangeFunctionName, const string startCellLocation, const string endCellLocation) {
+RangeExp::RangeExp(const string rangeFunctionName, RangeFnId fn, CellId startCell, CellId endCell, double parameter,
+                   RangeKind kind) {
     this->rangeFunctionName = rangeFunctionName;
-    this->startCellLocation = startCellLocation;
-    this->endCellLocation = endCellLocation;
+    this->fn = fn;
+    this->startCell = startCell;
+    this->endCell = endCell;
+    this->parameter = parameter;
+    this->kind = kind;
 }
 
 RangeExp::~RangeExp() {
@@ -195,11 +320,13 @@ RangeExp::~RangeExp() {
 }
 
 double RangeExp::eval(SSModel* model) const {
-    return model->applyRangeFunction(rangeFunctionName, startCellLocation, endCellLocation);
+    return model->applyRangeFunction(fn, startCell, endCell, parameter, kind);
 }
 
 string RangeExp::toString() const {
-   return rangeFunctionName + '(' + startCellLocation + ':' + endCellLocation + ')';
+   string rangeName = rangeToString(startCell, endCell, kind);
+   if (hasParameter(fn)) rangeName += ", " + realToString(parameter);
+   return rangeFunctionName + '(' + rangeName + ')';
 }
 
 ExpressionType RangeExp::getType() const {
@@ -207,23 +334,98 @@ ExpressionType RangeExp::getType() const {
 }
 
 /**
- * Collects all cell names from start to end cell range using
- * model->collectCellRef() and adds it to vector of dependents
+ * Adds the range from start to end cell to vector of range dependents as a single entry
+ * A whole-column or whole-row range is one entry too, covering the sheet along its length
  */
-void RangeExp::getDependent(Vector<string>& dependents, SSModel* model) const {
-    model->collectCellRef(dependents, startCellLocation, endCellLocation);
+void RangeExp::getDependent(Vector<CellId>& dependents, Vector<range>& rangeDependents) const {
+    range r;
+    r.startCell = startCell;
+    r.stopCell = endCell;
+    r.kind = kind;
+    rangeDependents.add(r);
 }
 
 string RangeExp::getRangeFunction() const {
     return rangeFunctionName;
 }
 
+RangeFnId RangeExp::getRangeFnId() const {
+    return fn;
+}
+
 string RangeExp::getStartCellName() const {
-    return startCellLocation;
+    return cellIdToString(startCell);
 }
 
 string RangeExp::getEndCellName() const {
-    return endCellLocation;
+    return cellIdToString(endCell);
+}
+
+CellId RangeExp::getStartCell() const {
+    return startCell;
+}
+
+double RangeExp::getParameter() const {
+    return parameter;
+}
+
+CellId RangeExp::getEndCell() const {
+    return endCell;
+}
+
+RangeKind RangeExp::getRangeKind() const {
+    return kind;
+}
+
+/**
+ * Implementation notes: ExpArena
+ * ------------------------------
+ * Every allocation is rounded up to the strictest alignment, so each node
+ * header, and the node right after it, starts suitably aligned.  Blocks
+ * after the first double in size, up to kMaxBlockBytes, so a formula costs
+ * a logarithmic number of heap allocations however large it is.
+ */
+
+static const size_t kAlignment = alignof(std::max_align_t);
+static const size_t kMaxBlockBytes = 64 * 1024;
+
+static size_t roundUp(size_t bytes) {
+   return (bytes + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+ExpArena::ExpArena() {
+   next = firstBlock;
+   limit = firstBlock + kFirstBlockBytes;
+   blockBytes = kFirstBlockBytes;
+   blocks = NULL;
+   lastNode = NULL;
+}
+
+ExpArena::~ExpArena() {
+   for (Node *node = lastNode; node != NULL; node = node->previous) {
+      node->exp->~Expression();
+   }
+   while (blocks != NULL) {
+      Block *previous = blocks->previous;
+      ::operator delete(blocks);
+      blocks = previous;
+   }
+}
+
+void *ExpArena::allocate(size_t bytes) {
+   bytes = roundUp(bytes);
+   if ((size_t) (limit - next) < bytes) {
+      blockBytes = max(min(2 * blockBytes, kMaxBlockBytes), bytes);
+      size_t headerBytes = roundUp(sizeof(Block));
+      Block *block = (Block *) ::operator new(headerBytes + blockBytes);
+      block->previous = blocks;
+      blocks = block;
+      next = (char *) block + headerBytes;
+      limit = next + blockBytes;
+   }
+   void *result = next;
+   next += bytes;
+   return result;
 }
 
 /**
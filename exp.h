@@ -8,6 +8,10 @@
 #define _exp_
 
 #include <string>
+#include <vector>
+#include <cstddef>
+#include <new>
+#include <utility>
 #include "map.h"
 #include "tokenscanner.h"
 #include "ssmodel.h"
@@ -19,11 +23,11 @@ class EvaluationContext;
 /*
  * Type: ExpressionType
  * --------------------
- * This enumerated type is used to differentiate the four different
- * expression types: DOUBLE, TEXTSTRING, IDENTIFIER, and COMPOUND.
+ * This enumerated type is used to differentiate the different expression
+ * types: DOUBLE, TEXTSTRING, IDENTIFIER, COMPOUND, RANGE, NARY and CELLRUN.
  */
 
-enum ExpressionType { DOUBLE, TEXTSTRING, IDENTIFIER, COMPOUND, RANGE};
+enum ExpressionType { DOUBLE, TEXTSTRING, IDENTIFIER, COMPOUND, RANGE, NARY, CELLRUN};
 
 /**
  * Class: Expression
@@ -37,6 +41,9 @@ enum ExpressionType { DOUBLE, TEXTSTRING, IDENTIFIER, COMPOUND, RANGE};
  *  2. TextStringExp -- a text string constant
  *  3. IdentifierExp -- a string representing an identifier
  *  4. CompoundExp   -- two expressions combined by an operator
+ *  5. RangeExp      -- a range function applied to a range of cells
+ *  6. NaryExp       -- a chain of expressions combined by + or *
+ *  7. CellRunExp    -- a run of consecutive cells in a sum
  *
  * The Expression class defines the interface common to all expressions;
  * each subclass provides its own implementation of the common interface.
@@ -57,11 +64,11 @@ public:
 
 /**
  * Destructor: ~Expression
- * Usage: delete exp;
  * ------------------
- * The destructor deallocates the storage for this expression.  This method
- * must be declared virtual to ensure that the correct subclass destructor
- * is called when deleting an expression.
+ * The destructor releases what this expression holds apart from its
+ * subexpressions.  Expressions are made and freed by an ExpArena, which
+ * calls it when the arena is deleted; it must be declared virtual to ensure
+ * that the correct subclass destructor is called.
  */
 
    virtual ~Expression();
@@ -97,12 +104,13 @@ public:
 
 /**
  * Method: getDependent
- * Usage: exp->getDependent(dependents, model);
- * --------------------------------------------
+ * Usage: exp->getDependent(dependents, rangeDependents);
+ * ------------------------------------------------------
  * Traverses expression tree to get cell references on which lhs cell of expression is directly dependent
- * Returns vector of dependent cell name in expression
+ * Returns vector of dependent cell ids in expression, and vector of ranges read by range functions
+ * Ranges are reported whole, not expanded into their cells
  */
-   virtual void getDependent(Vector<string>& dependents, SSModel* model) const = 0;
+   virtual void getDependent(Vector<CellId>& dependents, Vector<range>& rangeDependents) const = 0;
 
 };
 
@@ -130,7 +138,7 @@ public:
    double eval(SSModel* model) const;
    std::string toString() const;
    ExpressionType getType() const;
-   void getDependent(Vector<string>& dependents, SSModel* model) const;
+   void getDependent(Vector<CellId>& dependents, Vector<range>& rangeDependents) const;
     
 /* Prototypes of methods specific to this class */
    double getDoubleValue() const;
@@ -163,7 +171,7 @@ public:
     double eval(SSModel* model) const;
     std::string toString() const;
     ExpressionType getType() const;
-    void getDependent(Vector<string>& dependents, SSModel* model) const;
+    void getDependent(Vector<CellId>& dependents, Vector<range>& rangeDependents) const;
 
 /* Prototypes of methods specific to this class */
     std::string getTextStringValue() const;
@@ -175,7 +183,7 @@ private:
 /**
  * Subclass: IdentifierExp
  * -----------------------
- * This subclass represents an identifier used as a variable name.
+ * This subclass represents a reference to a spreadsheet cell.
  */
 
 class IdentifierExp : public Expression {
@@ -184,25 +192,30 @@ public:
 
 /**
  * Constructor: IdentifierExp
- * Usage: Expression *exp = new IdentifierExp(name);
- * -------------------------------------------------
- * The constructor creates an identifier expression with the specified name.
+ * Usage: Expression *exp = new IdentifierExp(id, model->bindCell(id));
+ * --------------------------------------------------------------------
+ * The constructor creates an identifier expression referring to the specified cell.
+ * slot is the address in the model's cell store where that cell's value is kept,
+ * so evaluating the reference is a single load.
  */
 
-   IdentifierExp(const std::string& name);
+   IdentifierExp(CellId id, const double* slot);
 
 /* Prototypes for the virtual methods overridden by this class */
 
    double eval(SSModel* model) const;
    std::string toString() const;
    ExpressionType getType() const;
-   void getDependent(Vector<string>& dependents, SSModel* model) const;
+   void getDependent(Vector<CellId>& dependents, Vector<range>& rangeDependents) const;
 
 /* Prototypes of methods specific to this class */
    std::string getIdentifierName() const;
+   CellId getCellId() const;
+   const double* getSlot() const;
 
 private:
-   std::string name;            /* The name of the identifier */
+   CellId id;                   /* The cell the identifier refers to */
+   const double* slot;          /* Where the model keeps that cell's value */
 };
 
 /**
@@ -228,11 +241,10 @@ public:
 
 /* Prototypes for the virtual methods overridden by this class */
 
-   virtual ~CompoundExp();
    virtual double eval(SSModel* model) const;
    virtual std::string toString() const;
    virtual ExpressionType getType() const;
-   void getDependent(Vector<string>& dependents, SSModel* model) const;
+   void getDependent(Vector<CellId>& dependents, Vector<range>& rangeDependents) const;
 
 /* Prototypes of methods specific to this class */
    std::string getOperator() const;
@@ -244,19 +256,104 @@ private:
    const Expression *lhs, *rhs; /* The left and right subexpression  */
 };
 
+/**
+ * Subclass: NaryExp
+ * -----------------
+ * This subclass represents a chain of two or more subexpressions joined by
+ * the same operator.  It is made by optimizeExp in place of the strictly
+ * binary tree the parser builds for such a chain, and applies the operator
+ * from left to right, just as that tree does.
+ */
+
+class NaryExp : public Expression {
+
+public:
+
+/**
+ * Constructor: NaryExp
+ * Usage: Expression *exp = arena.make<NaryExp>(op, operands);
+ * -----------------------------------------------------------
+ * The constructor initializes a new chain applying the operator (op) to the
+ * operands in order.
+ */
+
+   NaryExp(const std::string& op, const std::vector<const Expression *>& operands);
+
+/* Prototypes for the virtual methods overridden by this class */
+
+   virtual double eval(SSModel* model) const;
+   virtual std::string toString() const;
+   virtual ExpressionType getType() const;
+   void getDependent(Vector<CellId>& dependents, Vector<range>& rangeDependents) const;
+
+/* Prototypes of methods specific to this class */
+   std::string getOperator() const;
+   int getOperandCount() const;
+   const Expression *getOperand(int index) const;
+
+private:
+   std::string op;                            /* The operator string (+, -, *, /) */
+   std::vector<const Expression *> operands;  /* The subexpressions, in order */
+};
+
+/**
+ * Subclass: CellRunExp
+ * --------------------
+ * This subclass represents a run of cells, each one below or to the right
+ * of the one before, such as A1 + A2 + ... + A20.  It is made by optimizeExp
+ * in place of those operands of a sum, and is always an operand of a + chain.
+ * The formula depends on the run as on a range, but the cells are still
+ * added one by one from the first, to the sum of the operands before them,
+ * and the run prints as the cells it stands for.
+ */
+
+class CellRunExp : public Expression {
+
+public:
+
+/**
+ * Constructor: CellRunExp
+ * Usage: Expression *exp = arena.make<CellRunExp>(startCell, endCell);
+ * --------------------------------------------------------------------
+ * The constructor initializes a new run from startCell to endCell, which
+ * must lie in the same column or the same row.
+ */
+
+   CellRunExp(CellId startCell, CellId endCell);
+
+/* Prototypes for the virtual methods overridden by this class */
+
+   virtual double eval(SSModel* model) const;
+   virtual std::string toString() const;
+   virtual ExpressionType getType() const;
+   void getDependent(Vector<CellId>& dependents, Vector<range>& rangeDependents) const;
+
+/* Prototypes of methods specific to this class */
+   CellId getStartCell() const;
+   CellId getEndCell() const;
+   int getLength() const;                   /*returns the number of cells in the run*/
+   CellId getCell(int index) const;         /*returns the cell index places from the start*/
+
+private:
+   CellId startCell, endCell;               /*first and last cell of the run*/
+};
+
 class RangeExp : public Expression {
 
 public:
 
 /**
  * Constructor: RangeExp
- * Usage: Expression *exp = new RangeExp(rangeFunctionName, startCellLocationName, endCellLocationName);
+ * Usage: Expression *exp = new RangeExp(rangeFunctionName, fn, startCell, endCell, parameter, kind);
  * -------------------------------------------------------
  * The constructor initializes a new range expression composed of
- * range function and range start and range end cell names
+ * range function name and id, range start and range end cell ids,
+ * the parameter of functions such as percentile (0 for the others)
+ * and the kind of the range reference, which for A:A or 3:3 spans the sheet
  */
 
-   RangeExp(const std::string rangeFunctionName, const std::string startCellLocation, const std::string endCellLocation);
+   RangeExp(const std::string rangeFunctionName, RangeFnId fn, CellId startCell, CellId endCell, double parameter,
+            RangeKind kind);
 
 /* Prototypes for the virtual methods overridden by this class */
 
@@ -264,16 +361,110 @@ public:
    virtual double eval(SSModel* model) const;
    virtual std::string toString() const;
    virtual ExpressionType getType() const;
-   void getDependent(Vector<string>& dependents, SSModel* model) const;
+   void getDependent(Vector<CellId>& dependents, Vector<range>& rangeDependents) const;
 
 /* Prototypes of methods specific to this class */
    std::string getRangeFunction() const;    /*returns name of range function in lower case*/
+   RangeFnId getRangeFnId() const;          /*returns id of range function*/
    std::string getStartCellName() const;    /*returns name of range start cell in upper case*/
    std::string getEndCellName() const;      /*returns name of range end cell in upper case*/
+   CellId getStartCell() const;
+   CellId getEndCell() const;
+   double getParameter() const;             /*returns parameter following the range, 0 if none*/
+   RangeKind getRangeKind() const;          /*returns whether the range is bounded or whole columns or rows*/
+
+private:
+   std::string rangeFunctionName;           /*name of range function in lower case*/
+   RangeFnId fn;                            /*id of range function*/
+   CellId startCell, endCell;               /*start and end cell of the range*/
+   double parameter;                        /*parameter following the range, 0 if none*/
+   RangeKind kind;                          /*how the range reference was written*/
+};
+
+/**
+ * Class: ExpArena
+ * ---------------
+ * This class owns the nodes of expression trees.  Nodes are carved out of
+ * blocks of memory one after the other, so making a node costs a pointer
+ * bump rather than a call to the heap, and deleting the arena destroys
+ * every node made in it and frees the blocks in one go.  Nodes are never
+ * freed one at a time: a tree lives exactly as long as its arena, which is
+ * why a subexpression never deletes its children.
+ */
+
+class ExpArena {
+
+public:
+
+/**
+ * Constructor: ExpArena
+ * Usage: ExpArena *arena = new ExpArena;
+ * --------------------------------------
+ * Creates an empty arena.  Its first block is part of the arena object, so
+ * a small formula needs no further allocation.
+ */
+
+   ExpArena();
+
+/**
+ * Destructor: ~ExpArena
+ * Usage: delete arena;
+ * --------------------
+ * Destroys every node made in the arena, newest first, and frees its
+ * blocks.
+ */
+
+   ~ExpArena();
+
+/**
+ * Method: make
+ * Usage: Expression *exp = arena->make<DoubleExp>(1.5);
+ * -----------------------------------------------------
+ * Constructs a node of type T in the arena from the given arguments and
+ * returns it.  The node stays valid until the arena is deleted.
+ */
+
+   template <typename T, typename... Args>
+   T *make(Args&&... args) {
+      Node *node = (Node *) allocate(sizeof(Node) + sizeof(T));
+      T *exp = new (node + 1) T(std::forward<Args>(args)...);
+      node->exp = exp;
+      node->previous = lastNode;
+      lastNode = node;
+      return exp;
+   }
 
 private:
-   std::string rangeFunctionName;                   /*name of range function in lower case*/
-   std::string startCellLocation, endCellLocation;  /*name of start and end cell name in upper case*/
+
+/* Header kept in front of each node, linking the nodes for destruction */
+
+   struct Node {
+      Node *previous;
+      Expression *exp;
+   };
+
+/* Header of each block allocated after the first */
+
+   struct Block {
+      Block *previous;
+   };
+
+   static const size_t kFirstBlockBytes = 256;
+
+   alignas(std::max_align_t) char firstBlock[kFirstBlockBytes];
+   char *next;                  /* first free byte of the current block */
+   char *limit;                 /* end of the current block */
+   size_t blockBytes;           /* size of the block allocated last */
+   Block *blocks;               /* blocks allocated after the first, newest first */
+   Node *lastNode;              /* node made last */
+
+   void *allocate(size_t bytes);
+
+/* Copying an arena would destroy its nodes twice, so it is disallowed */
+
+   ExpArena(const ExpArena&);
+   ExpArena& operator=(const ExpArena&);
+
 };
 
 /**
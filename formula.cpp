@@ -0,0 +1,288 @@
+/**
+ * File: formula.cpp
+ * -----------------
+ * This file implements the formula.h interface.
+ */
+
+#include "formula.h"
+#include "exp.h"
+#include "bytecode.h"
+#include <functional>
+#include "strlib.h"
+using namespace std;
+
+/**
+ * Implementation notes: offsets
+ * -----------------------------
+ * A cell holding the formula sees every reference moved by the row and
+ * column distance from the anchor to the cell.  The tree itself is never
+ * copied or rewritten; the walks below apply the offset as they go, the way
+ * Program::compile walks a tree by its node types.
+ */
+
+static string shiftedString(const Expression* exp, int rowOffset, int colOffset);
+static bool sameShape(const Expression* exp, const Expression* other, int rowOffset, int colOffset);
+static size_t hashShape(const Expression* exp, int row, int col);
+
+Formula::Formula(Expression* exp, ExpArena* arena, CellId anchor, RangeTable* table) {
+    this->exp = exp;
+    this->arena = arena;
+    this->anchor = anchor;
+    shape = shapeHash(exp, anchor);
+    program = new Program(exp, table);
+    columnwise = program->canRunOnColumn(cellIdCol(anchor));
+    users = 0;
+}
+
+Formula::~Formula() {
+    delete program;
+    delete arena;
+}
+
+/**
+ * @brief Formula::addUser
+ * @param id: cell holding the formula, or saved copy of it
+ * Only a formula with range calls keeps its moved users; other references
+ * are read straight from the cell store and need nothing per cell.
+ */
+void Formula::addUser(CellId id) {
+    users++;
+    if (id != anchor && program->hasRanges()) {
+        MovedUser& user = movedUsers[id];
+        if (user.users++ == 0) {
+            program->acquireRanges(cellIdRow(id) - cellIdRow(anchor), cellIdCol(id) - cellIdCol(anchor),
+                                   user.aggregates);
+        }
+    }
+}
+
+bool Formula::removeUser(CellId id) {
+    if (id != anchor && program->hasRanges()) {
+        auto it = movedUsers.find(id);
+        if (it != movedUsers.end() && --it->second.users == 0) {
+            program->releaseRanges(it->second.aggregates);
+            movedUsers.erase(it);
+        }
+    }
+    return --users == 0;
+}
+
+CellId Formula::getAnchor() const {
+    return anchor;
+}
+
+const Expression* Formula::getExpression() const {
+    return exp;
+}
+
+bool Formula::isText() const {
+    return exp->getType() == TEXTSTRING;
+}
+
+string Formula::getText() const {
+    return ((const TextStringExp*) exp)->getTextStringValue();
+}
+
+/**
+ * @brief Formula::run
+ * A cell that is not a registered user, such as one being tried out before
+ * it is set, computes its moved range calls afresh.
+ */
+double Formula::run(SSModel* model, CellId id) const {
+    RangeAggregate* const* aggregates = NULL;
+    if (id != anchor && !movedUsers.empty()) {
+        auto it = movedUsers.find(id);
+        if (it != movedUsers.end()) aggregates = it->second.aggregates.data();
+    }
+    return program->run(model, cellIdRow(id) - cellIdRow(anchor), cellIdCol(id) - cellIdCol(anchor), aggregates);
+}
+
+bool Formula::canRunOnColumn() const {
+    return columnwise;
+}
+
+void Formula::runColumn(SSModel* model, CellId id, int count, double* values) const {
+    program->runColumn(model, cellIdRow(id) - cellIdRow(anchor), cellIdCol(id) - cellIdCol(anchor), count, values);
+}
+
+string Formula::toString(CellId id) const {
+    return shiftedString(exp, cellIdRow(id) - cellIdRow(anchor), cellIdCol(id) - cellIdCol(anchor));
+}
+
+bool Formula::matches(const Expression* other, CellId id) const {
+    return sameShape(exp, other, cellIdRow(id) - cellIdRow(anchor), cellIdCol(id) - cellIdCol(anchor));
+}
+
+size_t Formula::getShapeHash() const {
+    return shape;
+}
+
+size_t Formula::shapeHash(const Expression* exp, CellId id) {
+    return hashShape(exp, cellIdRow(id), cellIdCol(id));
+}
+
+/**
+ * Returns true if cell other is cell id moved by the offsets.  The
+ * arithmetic is done on the row and column numbers, so a reference that
+ * would move off the sheet simply fails to match.
+ */
+static bool sameCell(CellId id, CellId other, int rowOffset, int colOffset) {
+    return cellIdRow(id) + rowOffset == cellIdRow(other) && cellIdCol(id) + colOffset == cellIdCol(other);
+}
+
+/**
+ * Returns exp->toString() as it reads with every reference moved by the
+ * offsets.
+ */
+static string shiftedString(const Expression* exp, int rowOffset, int colOffset) {
+    switch (exp->getType()) {
+    case IDENTIFIER:
+        return cellIdToString(shiftCellId(((const IdentifierExp*) exp)->getCellId(), rowOffset, colOffset));
+    case COMPOUND: {
+        const CompoundExp* compound = (const CompoundExp*) exp;
+        return '(' + shiftedString(compound->getLHS(), rowOffset, colOffset) + ' ' + compound->getOperator()
+                + ' ' + shiftedString(compound->getRHS(), rowOffset, colOffset) + ')';
+    }
+    case NARY: {
+        const NaryExp* nary = (const NaryExp*) exp;
+        string text = "(";
+        for (int i = 0; i < nary->getOperandCount(); i++) {
+            if (i > 0) text += ' ' + nary->getOperator() + ' ';
+            text += shiftedString(nary->getOperand(i), rowOffset, colOffset);
+        }
+        return text + ')';
+    }
+    case RANGE: {
+        const RangeExp* rangeExp = (const RangeExp*) exp;
+        RangeKind kind = rangeExp->getRangeKind();
+        string rangeName = rangeToString(shiftRangeCorner(rangeExp->getStartCell(), kind, rowOffset, colOffset),
+                                         shiftRangeCorner(rangeExp->getEndCell(), kind, rowOffset, colOffset), kind);
+        if (hasParameter(rangeExp->getRangeFnId())) rangeName += ", " + realToString(rangeExp->getParameter());
+        return rangeExp->getRangeFunction() + '(' + rangeName + ')';
+    }
+    case CELLRUN: {
+        const CellRunExp* run = (const CellRunExp*) exp;
+        string text = cellIdToString(shiftCellId(run->getStartCell(), rowOffset, colOffset));
+        for (int i = 1; i < run->getLength(); i++) {
+            text += " + " + cellIdToString(shiftCellId(run->getCell(i), rowOffset, colOffset));
+        }
+        return text;
+    }
+    default:
+        return exp->toString();
+    }
+}
+
+/**
+ * Returns true if other is exp with every reference moved by the offsets,
+ * a whole-column range moving across only and a whole-row range down only.
+ */
+static bool sameShape(const Expression* exp, const Expression* other, int rowOffset, int colOffset) {
+    if (exp->getType() != other->getType()) return false;
+    switch (exp->getType()) {
+    case DOUBLE:
+        return ((const DoubleExp*) exp)->getDoubleValue() == ((const DoubleExp*) other)->getDoubleValue();
+    case TEXTSTRING:
+        return ((const TextStringExp*) exp)->getTextStringValue() == ((const TextStringExp*) other)->getTextStringValue();
+    case IDENTIFIER:
+        return sameCell(((const IdentifierExp*) exp)->getCellId(), ((const IdentifierExp*) other)->getCellId(),
+                        rowOffset, colOffset);
+    case COMPOUND: {
+        const CompoundExp* compound = (const CompoundExp*) exp;
+        const CompoundExp* otherCompound = (const CompoundExp*) other;
+        return compound->getOperator() == otherCompound->getOperator()
+                && sameShape(compound->getLHS(), otherCompound->getLHS(), rowOffset, colOffset)
+                && sameShape(compound->getRHS(), otherCompound->getRHS(), rowOffset, colOffset);
+    }
+    case NARY: {
+        const NaryExp* nary = (const NaryExp*) exp;
+        const NaryExp* otherNary = (const NaryExp*) other;
+        if (nary->getOperator() != otherNary->getOperator()
+                || nary->getOperandCount() != otherNary->getOperandCount()) return false;
+        for (int i = 0; i < nary->getOperandCount(); i++) {
+            if (!sameShape(nary->getOperand(i), otherNary->getOperand(i), rowOffset, colOffset)) return false;
+        }
+        return true;
+    }
+    case RANGE: {
+        const RangeExp* rangeExp = (const RangeExp*) exp;
+        const RangeExp* otherRange = (const RangeExp*) other;
+        RangeKind kind = rangeExp->getRangeKind();
+        if (kind == COLUMN_RANGE) rowOffset = 0;
+        if (kind == ROW_RANGE) colOffset = 0;
+        return rangeExp->getRangeFnId() == otherRange->getRangeFnId()
+                && rangeExp->getRangeFunction() == otherRange->getRangeFunction()
+                && rangeExp->getParameter() == otherRange->getParameter()
+                && kind == otherRange->getRangeKind()
+                && sameCell(rangeExp->getStartCell(), otherRange->getStartCell(), rowOffset, colOffset)
+                && sameCell(rangeExp->getEndCell(), otherRange->getEndCell(), rowOffset, colOffset);
+    }
+    case CELLRUN: {
+        const CellRunExp* run = (const CellRunExp*) exp;
+        const CellRunExp* otherRun = (const CellRunExp*) other;
+        return sameCell(run->getStartCell(), otherRun->getStartCell(), rowOffset, colOffset)
+                && sameCell(run->getEndCell(), otherRun->getEndCell(), rowOffset, colOffset);
+    }
+    }
+    return false;
+}
+
+/**
+ * Mixes value into the hash h, with the multiplier of a 64-bit FNV hash.
+ */
+static size_t mix(size_t h, size_t value) {
+    return h * 1099511628211ULL ^ value;
+}
+
+/**
+ * Returns a hash of exp in which each cell reference counts by its distance
+ * from the cell at row and col, so that expressions sameShape accepts hash
+ * alike.  Operators are hashed by their first character, which is all a
+ * CompoundExp or NaryExp operator has.  The rows of a whole-column range and
+ * the columns of a whole-row range do not move with the cell, so they count
+ * as they are.
+ */
+static size_t hashShape(const Expression* exp, int row, int col) {
+    size_t h = exp->getType();
+    switch (exp->getType()) {
+    case DOUBLE:
+        return mix(h, hash<double>()(((const DoubleExp*) exp)->getDoubleValue()));
+    case TEXTSTRING:
+        return mix(h, hash<string>()(((const TextStringExp*) exp)->getTextStringValue()));
+    case IDENTIFIER: {
+        CellId id = ((const IdentifierExp*) exp)->getCellId();
+        return mix(mix(h, cellIdRow(id) - row), cellIdCol(id) - col);
+    }
+    case COMPOUND: {
+        const CompoundExp* compound = (const CompoundExp*) exp;
+        h = mix(h, compound->getOperator()[0]);
+        h = mix(h, hashShape(compound->getLHS(), row, col));
+        return mix(h, hashShape(compound->getRHS(), row, col));
+    }
+    case NARY: {
+        const NaryExp* nary = (const NaryExp*) exp;
+        h = mix(h, nary->getOperator()[0]);
+        for (int i = 0; i < nary->getOperandCount(); i++) {
+            h = mix(h, hashShape(nary->getOperand(i), row, col));
+        }
+        return h;
+    }
+    case RANGE: {
+        const RangeExp* rangeExp = (const RangeExp*) exp;
+        RangeKind kind = rangeExp->getRangeKind();
+        if (kind == COLUMN_RANGE) row = 0;
+        if (kind == ROW_RANGE) col = 0;
+        h = mix(h, rangeExp->getRangeFnId());
+        h = mix(h, hash<double>()(rangeExp->getParameter()));
+        h = mix(h, kind);
+        h = mix(mix(h, cellIdRow(rangeExp->getStartCell()) - row), cellIdCol(rangeExp->getStartCell()) - col);
+        return mix(mix(h, cellIdRow(rangeExp->getEndCell()) - row), cellIdCol(rangeExp->getEndCell()) - col);
+    }
+    case CELLRUN: {
+        const CellRunExp* run = (const CellRunExp*) exp;
+        h = mix(mix(h, cellIdRow(run->getStartCell()) - row), cellIdCol(run->getStartCell()) - col);
+        return mix(mix(h, cellIdRow(run->getEndCell()) - row), cellIdCol(run->getEndCell()) - col);
+    }
+    }
+    return h;
+}
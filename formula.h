@@ -0,0 +1,188 @@
+/**
+ * File: formula.h
+ * ---------------
+ * This file defines the Formula class, the contents of a spreadsheet cell
+ * as stored in the model.  A formula is written once in terms of one cell,
+ * its anchor, and can be shared by any number of cells: a cell holding a
+ * shared formula reads every cell reference moved by its own offset from
+ * the anchor, in the way a formula filled down a column refers to the row
+ * it is on.  A column of identical relative formulas therefore costs one
+ * expression tree and one compiled program, however long it is.
+ */
+
+#ifndef _formula_
+#define _formula_
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "ssutil.h"
+
+/* Forward references */
+
+class Expression;
+class ExpArena;
+class Program;
+class RangeTable;
+struct RangeAggregate;
+class SSModel;
+
+/**
+ * Class: Formula
+ * --------------
+ * A parsed formula and its compiled program, written for the anchor cell,
+ * together with a count of its users.  Cells holding the formula and saved
+ * copies of cells kept for rolling back a transaction each count as a user;
+ * the model frees the formula when the last one lets go of it.  A user away
+ * from the anchor holds its own range table entries for the moved range
+ * calls, so their values stay cached as they do for the anchor.
+ */
+
+class Formula {
+
+public:
+
+/**
+ * Constructor: Formula
+ * Usage: Formula *formula = new Formula(exp, arena, anchor, table);
+ * -----------------------------------------------------------------
+ * Creates a formula with no users from an expression parsed for the anchor
+ * cell, compiling it to bytecode with its range function calls entered in
+ * table.  The formula takes ownership of arena, the arena holding exp.
+ */
+
+    Formula(Expression* exp, ExpArena* arena, CellId anchor, RangeTable* table);
+
+/**
+ * Destructor: ~Formula
+ * --------------------
+ * Frees the compiled program, and the expression tree with its arena.
+ */
+
+    ~Formula();
+
+/**
+ * Methods: addUser, removeUser
+ * Usage: if (formula->removeUser(id)) delete formula;
+ * ---------------------------------------------------
+ * Count one more or one fewer user of the formula at cell id.  The first
+ * user at a cell away from the anchor acquires the moved range calls, and
+ * the last one there releases them.  removeUser returns true once the
+ * formula has no users left.
+ */
+
+    void addUser(CellId id);
+    bool removeUser(CellId id);
+
+/**
+ * Method: getAnchor
+ * Usage: CellId anchor = formula->getAnchor();
+ * --------------------------------------------
+ * Returns the cell the formula was written for.
+ */
+
+    CellId getAnchor() const;
+
+/**
+ * Method: getExpression
+ * Usage: const Expression *exp = formula->getExpression();
+ * --------------------------------------------------------
+ * Returns the expression tree, as written for the anchor cell.
+ */
+
+    const Expression* getExpression() const;
+
+/**
+ * Methods: isText, getText
+ * Usage: if (formula->isText()) display = formula->getText();
+ * -----------------------------------------------------------
+ * isText returns true if the formula is a text string, whose text getText
+ * returns.  A text string evaluates to 0.0.
+ */
+
+    bool isText() const;
+    std::string getText() const;
+
+/**
+ * Method: run
+ * Usage: double value = formula->run(model, id);
+ * ----------------------------------------------
+ * Evaluates the formula for cell id against the current cell values of the
+ * model.  Safe to call from several threads at once.
+ */
+
+    double run(SSModel* model, CellId id) const;
+
+/**
+ * Methods: canRunOnColumn, runColumn
+ * Usage: if (formula->canRunOnColumn()) formula->runColumn(model, id, count, values);
+ * -----------------------------------------------------------------------------------
+ * canRunOnColumn returns true if the formula reads single cells outside its
+ * own column only, in which case runColumn evaluates it for each of the
+ * count cells from cell id down, storing their values in values, with a few
+ * vector instructions per operator.  Safe to call from several threads at
+ * once.
+ */
+
+    bool canRunOnColumn() const;
+    void runColumn(SSModel* model, CellId id, int count, double* values) const;
+
+/**
+ * Method: toString
+ * Usage: string text = formula->toString(id);
+ * -------------------------------------------
+ * Returns the formula as it reads in cell id, with its cell references
+ * moved accordingly.
+ */
+
+    std::string toString(CellId id) const;
+
+/**
+ * Method: matches
+ * Usage: if (formula->matches(exp, id)) ...
+ * -----------------------------------------
+ * Returns true if exp, parsed for cell id, is this formula as it reads in
+ * cell id, so that cell id can share the formula instead of keeping exp.
+ */
+
+    bool matches(const Expression* exp, CellId id) const;
+
+/**
+ * Methods: getShapeHash, shapeHash
+ * Usage: if (formula->getShapeHash() == Formula::shapeHash(exp, id)) ...
+ * ----------------------------------------------------------------------
+ * shapeHash returns a hash of exp, parsed for cell id, that depends only on
+ * its shape: cell references count by their distance from id.  Any
+ * expression that matches a formula has the formula's hash, which
+ * getShapeHash returns, so a model can keep all its formulas in a hash
+ * table and find the one a new expression matches anywhere in the sheet.
+ */
+
+    size_t getShapeHash() const;
+    static size_t shapeHash(const Expression* exp, CellId id);
+
+private:
+    Expression* exp;            /* parsed formula, written for the anchor */
+    ExpArena* arena;            /* owns the nodes of exp */
+    Program* program;           /* exp compiled to bytecode */
+    CellId anchor;              /* cell the formula was written for */
+    size_t shape;               /* shapeHash of exp for the anchor */
+    bool columnwise;            /* whether runColumn may be used */
+    int users;                  /* cells and saved cells holding the formula */
+
+/* Range table entries of the users away from the anchor, by cell */
+
+    struct MovedUser {
+        int users;                                  /* users at this cell */
+        std::vector<RangeAggregate*> aggregates;    /* moved range calls, see Program::acquireRanges */
+    };
+    std::unordered_map<CellId, MovedUser> movedUsers;
+
+/* Copying a formula would share its expression tree, so it is disallowed */
+
+    Formula(const Formula&);
+    Formula& operator=(const Formula&);
+
+};
+
+#endif
@@ -0,0 +1,98 @@
+/**
+ * File: lexer.cpp
+ * ---------------
+ * This file implements the lexer.h interface.
+ */
+
+#include "lexer.h"
+#include "error.h"
+#include <cctype>
+#include <charconv>
+using namespace std;
+
+FormulaLexer::FormulaLexer(string_view text) {
+    this->text = text;
+    position = 0;
+}
+
+bool FormulaLexer::hasMoreTokens() {
+    skipWhitespace();
+    return position < text.length();
+}
+
+void FormulaLexer::skipWhitespace() {
+    while (position < text.length() && isspace((unsigned char) text[position])) {
+        position++;
+    }
+}
+
+/**
+ * @brief FormulaLexer::nextToken
+ * Words are read while the characters are letters or digits, so "2A" is the
+ * number 2 followed by the word A, as TokenScanner reads it.  A backslash
+ * inside a string keeps the character after it from closing the string.
+ */
+FormulaToken FormulaLexer::nextToken() {
+    skipWhitespace();
+    FormulaToken token;
+    token.number = 0;
+    size_t start = position;
+    if (start == text.length()) {
+        token.kind = FormulaToken::END;
+        token.text = text.substr(start, 0);
+        return token;
+    }
+    char ch = text[start];
+    if (isalpha((unsigned char) ch)) {
+        position++;
+        while (position < text.length() && isalnum((unsigned char) text[position])) {
+            position++;
+        }
+        token.kind = FormulaToken::WORD;
+    } else if (isdigit((unsigned char) ch)) {
+        position = scanNumber(start);
+        token.kind = FormulaToken::NUMBER;
+        from_chars(text.data() + start, text.data() + position, token.number);
+    } else if (ch == '"' || ch == '\'') {
+        position++;
+        while (position < text.length() && text[position] != ch) {
+            if (text[position] == '\\') position++;
+            position++;
+        }
+        if (position >= text.length()) {
+            error("Unterminated string " + string(text.substr(start)));
+        }
+        position++;
+        token.kind = FormulaToken::STRING;
+    } else {
+        position++;
+        token.kind = FormulaToken::OPERATOR;
+    }
+    token.text = text.substr(start, position - start);
+    return token;
+}
+
+/**
+ * @brief FormulaLexer::scanNumber
+ * @param start: index of the first digit of the number
+ * Returns the index just past the number: digits, then optionally a point
+ * and more digits, then optionally an exponent.  An e not followed by
+ * digits, with or without a sign, is left for the next token.
+ */
+size_t FormulaLexer::scanNumber(size_t start) const {
+    size_t end = start;
+    while (end < text.length() && isdigit((unsigned char) text[end])) end++;
+    if (end < text.length() && text[end] == '.') {
+        end++;
+        while (end < text.length() && isdigit((unsigned char) text[end])) end++;
+    }
+    if (end < text.length() && (text[end] == 'e' || text[end] == 'E')) {
+        size_t exponent = end + 1;
+        if (exponent < text.length() && (text[exponent] == '+' || text[exponent] == '-')) exponent++;
+        if (exponent < text.length() && isdigit((unsigned char) text[exponent])) {
+            end = exponent;
+            while (end < text.length() && isdigit((unsigned char) text[end])) end++;
+        }
+    }
+    return end;
+}
@@ -0,0 +1,108 @@
+/**
+ * File: lexer.h
+ * -------------
+ * This file defines the FormulaLexer class, which splits the text of a
+ * cell formula into tokens.  It is written for the small token language
+ * of the spreadsheet alone: tokens are views into the text being scanned,
+ * so scanning a formula allocates nothing.
+ */
+
+#ifndef _lexer_
+#define _lexer_
+
+#include <string>
+#include <string_view>
+
+/**
+ * Type: FormulaToken
+ * ------------------
+ * One token of a formula.  A WORD is a letter followed by letters and
+ * digits, such as a cell name or a range function; a NUMBER is a
+ * decimal number with an optional fraction and exponent, whose value is
+ * kept in number; a STRING is text between matching single or double
+ * quotes, quotes included; an OPERATOR is any other single character.
+ * END is returned once the text is used up.  The text of a token stays
+ * valid as long as the text given to the lexer does.
+ */
+
+struct FormulaToken {
+    enum Kind { END, WORD, NUMBER, STRING, OPERATOR };
+    Kind kind;
+    std::string_view text;
+    double number;
+
+/**
+ * Method: is
+ * Usage: if (token.is('(')) ...
+ * -----------------------------
+ * Returns true if the token is the operator character ch.
+ */
+
+    bool is(char ch) const {
+        return kind == OPERATOR && text[0] == ch;
+    }
+
+/**
+ * Method: toString
+ * Usage: string text = token.toString();
+ * --------------------------------------
+ * Returns a copy of the token's text, for error messages and names.
+ */
+
+    std::string toString() const {
+        return std::string(text);
+    }
+};
+
+/**
+ * Class: FormulaLexer
+ * -------------------
+ * Reads the tokens of a formula from left to right, skipping whitespace.
+ * It tokenizes the way the controller's TokenScanner does with numbers and
+ * strings enabled, so a formula means the same whichever path it arrives
+ * by.
+ */
+
+class FormulaLexer {
+
+public:
+
+/**
+ * Constructor: FormulaLexer
+ * Usage: FormulaLexer lexer(text);
+ * --------------------------------
+ * Creates a lexer reading text, which is not copied and must outlive the
+ * lexer and its tokens.
+ */
+
+    FormulaLexer(std::string_view text);
+
+/**
+ * Method: nextToken
+ * Usage: FormulaToken token = lexer.nextToken();
+ * ----------------------------------------------
+ * Returns the next token, or an END token if there are none left.  Raises
+ * an error for a string with no closing quote.
+ */
+
+    FormulaToken nextToken();
+
+/**
+ * Method: hasMoreTokens
+ * Usage: if (lexer.hasMoreTokens()) ...
+ * -------------------------------------
+ * Returns true if anything but whitespace is left to read.
+ */
+
+    bool hasMoreTokens();
+
+private:
+    std::string_view text;          /* formula being read */
+    size_t position;                /* index of the next character to read */
+
+    void skipWhitespace();
+    size_t scanNumber(size_t start) const;
+
+};
+
+#endif
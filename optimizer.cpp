@@ -0,0 +1,185 @@
+/*
+ * File: optimizer.cpp
+ * -------------------
+ * This file implements the optimizer.h interface.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include "exp.h"
+#include "optimizer.h"
+#include "strlib.h"
+using namespace std;
+
+/* Runs of at least this many cells in a sum are read as a run */
+
+static const int kMinRunCells = 8;
+
+static const Expression *optimize(const Expression *exp, ExpArena& arena);
+static const Expression *optimizeChain(const CompoundExp *exp, ExpArena& arena);
+static void foldConstants(const string& op, vector<const Expression *>& operands, ExpArena& arena);
+static void mergeCellRuns(vector<const Expression *>& operands, ExpArena& arena);
+static int cellRun(const vector<const Expression *>& operands, int start, int rowStep, int colStep);
+static double apply(const string& op, double lhs, double rhs);
+static bool canFold(double value);
+
+/**
+ * Implementation notes: optimizeExp
+ * ---------------------------------
+ * Only compound expressions change.  Nodes that do are replaced by new
+ * ones rather than modified, which is why the walk works on constant
+ * expressions; every node belongs to arena either way.
+ */
+
+Expression *optimizeExp(Expression *exp, ExpArena& arena) {
+   return const_cast<Expression *>(optimize(exp, arena));
+}
+
+/**
+ * Implementation notes: optimize
+ * ------------------------------
+ * Every compound node heads a chain of its operator, which optimizeChain
+ * handles as a whole.  The walk recurses only into the operands of chains,
+ * so it goes as deep as the formula nests parentheses and changes operator,
+ * however long its chains are.
+ */
+
+const Expression *optimize(const Expression *exp, ExpArena& arena) {
+   if (exp->getType() != COMPOUND) return exp;
+   return optimizeChain((const CompoundExp *) exp, arena);
+}
+
+/**
+ * Implementation notes: optimizeChain
+ * -----------------------------------
+ * The parser groups a chain of one operator from the left, so its operands
+ * are the right operands down the left spine of the tree, read bottom up.
+ * The spine is walked with a loop, however long the chain is.  Only the
+ * left spine is flattened: a parenthesized chain on the right keeps its
+ * parentheses, as the formula was written with them.  Because the chain is
+ * still applied from left to right, flattening changes no result, for - and
+ * / as much as for + and *.  A sum made of a single run of cells stays a
+ * NaryExp, so that the run is always the operand of a chain and prints
+ * inside its parentheses.
+ */
+
+const Expression *optimizeChain(const CompoundExp *exp, ExpArena& arena) {
+   string op = exp->getOperator();
+   vector<const Expression *> operands;
+   const Expression *spine = exp;
+   while (spine->getType() == COMPOUND && ((const CompoundExp *) spine)->getOperator() == op) {
+      operands.push_back(((const CompoundExp *) spine)->getRHS());
+      spine = ((const CompoundExp *) spine)->getLHS();
+   }
+   operands.push_back(spine);
+   reverse(operands.begin(), operands.end());
+   for (const Expression *& operand : operands) {
+      operand = optimize(operand, arena);
+   }
+   foldConstants(op, operands, arena);
+   if (op == "+") mergeCellRuns(operands, arena);
+   if (operands.size() == 1 && operands[0]->getType() != CELLRUN) return operands[0];
+   return arena.make<NaryExp>(op, operands);
+}
+
+/**
+ * Implementation notes: foldConstants
+ * -----------------------------------
+ * Folds the constants at the start of the chain into one.  Constants
+ * further along are left alone: the operands before them come first, so
+ * folding them would change the order of the rounding.
+ */
+
+void foldConstants(const string& op, vector<const Expression *>& operands, ExpArena& arena) {
+   size_t count = 0;
+   while (count < operands.size() && operands[count]->getType() == DOUBLE) {
+      count++;
+   }
+   if (count < 2) return;
+   double value = ((const DoubleExp *) operands[0])->getDoubleValue();
+   for (size_t i = 1; i < count; i++) {
+      value = apply(op, value, ((const DoubleExp *) operands[i])->getDoubleValue());
+   }
+   if (!canFold(value)) return;
+   operands.erase(operands.begin() + 1, operands.begin() + count);
+   operands[0] = arena.make<DoubleExp>(value);
+}
+
+/**
+ * Implementation notes: mergeCellRuns
+ * -----------------------------------
+ * Scans the operands of a sum for runs of cell references, each one cell
+ * below or to the right of the one before, and replaces every run of at
+ * least kMinRunCells cells by a CellRunExp.  The run is still added cell by
+ * cell in the same order, so the sum is the same to the last bit, but the
+ * formula depends on it as on one range rather than on every cell.
+ */
+
+void mergeCellRuns(vector<const Expression *>& operands, ExpArena& arena) {
+   vector<const Expression *> merged;
+   int count = operands.size();
+   int i = 0;
+   while (i < count) {
+      int length = max(cellRun(operands, i, 1, 0), cellRun(operands, i, 0, 1));
+      if (length >= kMinRunCells) {
+         CellId startCell = ((const IdentifierExp *) operands[i])->getCellId();
+         CellId endCell = ((const IdentifierExp *) operands[i + length - 1])->getCellId();
+         merged.push_back(arena.make<CellRunExp>(startCell, endCell));
+         i += length;
+      } else {
+         merged.push_back(operands[i]);
+         i++;
+      }
+   }
+   operands.swap(merged);
+}
+
+/**
+ * Implementation notes: cellRun
+ * -----------------------------
+ * Returns the number of operands from start on that are cell references,
+ * each moved by rowStep rows and colStep columns from the one before, or 0
+ * if the operand at start is not a cell reference.
+ */
+
+int cellRun(const vector<const Expression *>& operands, int start, int rowStep, int colStep) {
+   if (operands[start]->getType() != IDENTIFIER) return 0;
+   CellId first = ((const IdentifierExp *) operands[start])->getCellId();
+   int length = 1;
+   while (start + length < (int) operands.size() && operands[start + length]->getType() == IDENTIFIER) {
+      CellId id = ((const IdentifierExp *) operands[start + length])->getCellId();
+      if (cellIdRow(id) != cellIdRow(first) + length * rowStep
+            || cellIdCol(id) != cellIdCol(first) + length * colStep) break;
+      length++;
+   }
+   return length;
+}
+
+/**
+ * Implementation notes: apply
+ * ---------------------------
+ * Applies an arithmetic operator, as CompoundExp::eval does.
+ */
+
+double apply(const string& op, double lhs, double rhs) {
+   if (op == "+") return lhs + rhs;
+   if (op == "-") return lhs - rhs;
+   if (op == "*") return lhs * rhs;
+   return lhs / rhs;
+}
+
+/**
+ * Implementation notes: canFold
+ * -----------------------------
+ * A folded constant is saved as its printed text, so a value may only be
+ * folded if that text reads back as a number, and as the same number.  The
+ * grammar has no negative numbers, infinities or NaNs, and realToString
+ * prints few enough digits that, for example, 1 / 3 stays as written.
+ */
+
+bool canFold(double value) {
+   if (!isfinite(value) || signbit(value)) return false;
+   return stringToReal(realToString(value)) == value;
+}
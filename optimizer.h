@@ -0,0 +1,38 @@
+/**
+ * File: optimizer.h
+ * -----------------
+ * This file acts as the interface to the optimizer, a pass over a freshly
+ * parsed formula that makes its tree smaller and shallower without changing
+ * what the formula means.
+ */
+
+#ifndef _optimizer_
+#define _optimizer_
+
+#include "exp.h"
+
+/**
+ * Function: optimizeExp
+ * Usage: Expression *exp = optimizeExp(parseExp(lexer, model, arena), arena);
+ * ---------------------------------------------------------------------------
+ * Returns an expression with the same value as exp, built from the nodes of
+ * exp and new nodes made in arena.  The optimizer
+ *
+ *  1. flattens chains of one operator into NaryExp nodes, so that a long
+ *     sum or difference is one node rather than a tree as deep as it is
+ *     long,
+ *  2. folds operators applied to numeric constants into a single constant,
+ *  3. replaces a run of consecutive cells down a column or along a row in a
+ *     sum, such as A1 + A2 + ... + A20, by a CellRunExp, which the formula
+ *     depends on as on the range A1:A20.
+ *
+ * Operands are still applied from left to right, the cells of a run one by
+ * one, so every result is the same to the last bit.
+ *
+ * The result prints as a formula that parses and optimizes back to the same
+ * tree, so a saved formula keeps its meaning.
+ */
+
+Expression *optimizeExp(Expression *exp, ExpArena& arena);
+
+#endif
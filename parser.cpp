@@ -4,121 +4,284 @@
  * This file implements the parser.h interface.
  */
 
-#include <iostream>
+#include <algorithm>
+#include <cctype>
 #include <string>
+#include <vector>
 #include "error.h"
 #include "exp.h"
 #include "parser.h"
 #include "strlib.h"
-#include "tokenscanner.h"
 using namespace std;
 
-static Expression *readE(TokenScanner& scanner, SSModel* model, int prec = 0);
-static Expression *readT(TokenScanner& scanner, SSModel* model);
-static int precedence(const std::string& token);
+/* Deepest nesting of operator chains a formula may have, see parseExp */
+
+static const int kMaxNesting = 1000;
+
+static Expression *readT(const FormulaToken& token, FormulaLexer& lexer, SSModel* model, ExpArena& arena);
+static RangeKind readRange(FormulaLexer& lexer, SSModel* model, const string& name, CellId& startId, CellId& endId);
+static RangeKind rangeKind(const FormulaToken& token);
+static CellId readCell(const FormulaToken& token, SSModel* model, const string& message);
+static int readLine(const FormulaToken& token, RangeKind kind, SSModel* model, const string& message);
+static void reduce(vector<Expression *>& operands, vector<int>& depths, vector<char>& operators, ExpArena& arena);
+static int precedence(const FormulaToken& token);
+static int precedence(char op);
 
 /**
  * Implementation notes: parseExp
  * ------------------------------
- * This code just reads an expression and then checks for extra tokens.
+ * The parser uses precedence to resolve the ambiguity in the grammar, with
+ * two explicit stacks in place of recursion: one of operands and one of
+ * operators still waiting for their right operand, where '(' marks an open
+ * parenthesis.  After each term the parser closes any parentheses that
+ * follow it, and then reads an operator.  Before the operator is pushed,
+ * every waiting operator of the same or higher precedence is applied, so
+ * operators of equal precedence group from the left and the trees come out
+ * exactly as a recursive descent would build them.  Every node is made in
+ * arena, so nothing needs to be freed here when an error cuts the parse
+ * short.
+ *
+ * The parse itself needs no recursion, but the optimizer, the compiler and
+ * the printer walk the tree recursively.  optimizeExp turns each chain of
+ * one operator into a single node, so the parser keeps, beside each
+ * operand, how deeply that operand will nest chains, and rejects a formula
+ * nesting them more than kMaxNesting deep, however it is written: with
+ * parentheses, as in A1 + (A1 + (A1 + ...)), or by changing operator, as in
+ * A1 + A1 - A1 + ....  A long chain of one operator counts as one level.
  */
 
-Expression *parseExp(TokenScanner& scanner, SSModel* model) {
-   Expression *exp = readE(scanner, model);
-   if (scanner.hasMoreTokens()) {
-      error("Unexpected token \"" + scanner.nextToken() + "\"");
+Expression *parseExp(FormulaLexer& lexer, SSModel* model, ExpArena& arena) {
+   vector<Expression *> operands;
+   vector<int> depths;
+   vector<char> operators;
+   int openParens = 0;
+   FormulaToken token;
+   while (true) {
+      token = lexer.nextToken();
+      if (token.is('(')) {
+         operators.push_back('(');
+         openParens++;
+         continue;
+      }
+      operands.push_back(readT(token, lexer, model, arena));
+      depths.push_back(0);
+      token = lexer.nextToken();
+      while (token.is(')') && openParens > 0) {
+         while (operators.back() != '(') {
+            reduce(operands, depths, operators, arena);
+         }
+         operators.pop_back();
+         openParens--;
+         token = lexer.nextToken();
+      }
+      int tprec = precedence(token);
+      if (tprec == 0) break;
+      while (!operators.empty() && precedence(operators.back()) >= tprec) {
+         reduce(operands, depths, operators, arena);
+      }
+      operators.push_back(token.text[0]);
    }
-   return exp;
+   if (openParens > 0) {
+      error("Unbalanced parentheses");
+   }
+   while (!operators.empty()) {
+      reduce(operands, depths, operators, arena);
+   }
+   if (token.kind != FormulaToken::END) {
+      error("Unexpected token \"" + token.toString() + "\"");
+   }
+   return operands.back();
 }
 
 /**
- * Implementation notes: readE
- * Usage: exp = readE(scanner, prec);
- * ----------------------------------
- * The implementation of readE uses precedence to resolve the ambiguity in
- * the grammar.  At each level, the parser reads operators and subexpressions
- * until it finds an operator whose precedence is greater than the prevailing
- * one.  When a higher-precedence operator is found, readE calls itself
- * recursively to read that subexpression as a unit.
+ * Implementation notes: reduce
+ * ----------------------------
+ * Applies the operator on top of the operator stack to the top two
+ * operands, replacing them with the compound expression, and their depths
+ * with its depth.  A left operand with the same operator is the chain the
+ * node continues, so the node is one level deeper only than its right
+ * operand.
  */
 
-Expression *readE(TokenScanner& scanner, SSModel* model, int prec) {
-   Expression *exp = readT(scanner, model);
-   string token;
-   while (true) {
-      token = scanner.nextToken();
-      int tprec = precedence(token);
-      if (tprec <= prec) break;
-      Expression *rhs = readE(scanner, model, tprec);
-      exp = new CompoundExp(token, exp, rhs);
+void reduce(vector<Expression *>& operands, vector<int>& depths, vector<char>& operators, ExpArena& arena) {
+   Expression *rhs = operands.back();
+   int rhsDepth = depths.back();
+   operands.pop_back();
+   depths.pop_back();
+   Expression *lhs = operands.back();
+   string op(1, operators.back());
+   operators.pop_back();
+   bool continues = lhs->getType() == COMPOUND && ((CompoundExp *) lhs)->getOperator() == op;
+   int depth = max(continues ? depths.back() : depths.back() + 1, rhsDepth + 1);
+   if (depth > kMaxNesting) {
+      error("Formula nests operators more than " + integerToString(kMaxNesting) + " deep");
    }
-   scanner.saveToken(token);
-   return exp;
+   operands.back() = arena.make<CompoundExp>(op, lhs, rhs);
+   depths.back() = depth;
 }
 
 /**
  * Implementation notes: readT
  * ---------------------------
- * This function scans a term, which is either an integer, an identifier,
- * or a parenthesized subexpression.
- * If token type is WORD: (1) if token is valid spreadsheet cell name, then Identifier expression is created.
- *                        (2) if token is valid range function, then it checks the cell references following range function and
+ * This function reads a term starting with token, which is either a
+ * number, a text string, an identifier or a range function call;
+ * parenthesized subexpressions are handled by parseExp itself.
+ * If token type is WORD: (1) if token is valid spreadsheet cell name, then it is parsed straight into a CellId
+ *                            and Identifier expression is created, bound to the cell's value slot in the model
+ *                        (2) if token is valid range function, then it checks the range following range function,
+ *                            and the number after them for functions that take a parameter, and
  *                            if it is correct, then RangeExp is created.
  * Error is thrown for any malformed function
  */
-Expression *readT(TokenScanner& scanner, SSModel* model) {
-   string token = scanner.nextToken();
-   TokenType type = scanner.getTokenType(token);
-   if (type == WORD) {
-      if (model->nameIsValid(token)) {
-          return new IdentifierExp(toUpperCase(token));
-      } else if (model->rangeFnIsValid(token)) {
-          string rangeToken = scanner.nextToken();
-          if (rangeToken != "(") {
-             error("Unexpected token \"" + rangeToken + "\" following range function \"" + token + "\"");
-          }
-          string startCell = scanner.nextToken();
-          if (scanner.getTokenType(startCell) != WORD || !model->nameIsValid(startCell)) {
-              error("Missing valid spreadsheet start cell refernce");
-          }
-          rangeToken = scanner.nextToken();
-          if (rangeToken != ":") {
-             error("Unexpected token \"" + rangeToken + "\" following range function \"" + token + "\"");
+Expression *readT(const FormulaToken& token, FormulaLexer& lexer, SSModel* model, ExpArena& arena) {
+   if (token.kind == FormulaToken::WORD) {
+      CellId id;
+      if (stringToCellId(token.text.data(), token.text.length(), id) && model->cellIdIsValid(id)) {
+          return arena.make<IdentifierExp>(id, model->bindCell(id));
+      }
+      string name = token.toString();
+      if (model->rangeFnIsValid(name)) {
+          FormulaToken rangeToken = lexer.nextToken();
+          if (!rangeToken.is('(')) {
+             error("Unexpected token \"" + rangeToken.toString() + "\" following range function \"" + name + "\"");
           }
-          string endCell = scanner.nextToken();
-          if (scanner.getTokenType(endCell) != WORD || !model->nameIsValid(endCell)) {
-              error("Missing valid spreadsheet end cell refernce");
+          CellId startId = 0, endId = 0;
+          RangeKind kind = readRange(lexer, model, name, startId, endId);
+          RangeFnId fn = model->getRangeFnId(name);
+          double parameter = 0;
+          rangeToken = lexer.nextToken();
+          if (hasParameter(fn)) {
+              if (!rangeToken.is(',')) {
+                 error("Missing parameter following range of function \"" + name + "\"");
+              }
+              rangeToken = lexer.nextToken();
+              if (rangeToken.kind != FormulaToken::NUMBER || !validParameter(fn, rangeToken.number)) {
+                 error("Invalid parameter \"" + rangeToken.toString() + "\" for range function \"" + name + "\"");
+              }
+              parameter = rangeToken.number;
+              rangeToken = lexer.nextToken();
           }
-          rangeToken = scanner.nextToken();
-          if (rangeToken != ")") {
+          if (!rangeToken.is(')')) {
              error("Unbalanced parentheses following range function");
           }
-          if (!model->validRange(startCell, endCell)) {
-              error("Invalid spreadsheet range input from " + startCell + " to " + endCell);
+          if (!model->validRange(startId, endId)) {
+              error("Invalid spreadsheet range input from " + cellIdToString(startId) + " to " + cellIdToString(endId));
           }
-          return new RangeExp(toLowerCase(token), toUpperCase(startCell), toUpperCase(endCell));
-      } else {
-          error("Unexpected token \"" + token + "\"");
+          return arena.make<RangeExp>(toLowerCase(name), fn, startId, endId, parameter, kind);
       }
    }
-   if (type == NUMBER) return new DoubleExp(stringToReal(token));
-   if (type == STRING) return new TextStringExp(token.substr(1, token.length() - 2));
-   if (token != "(") error("Unexpected token \"" + token + "\"");
-   Expression *exp = readE(scanner, model, 0);
-   if (scanner.nextToken() != ")") {
-      error("Unbalanced parentheses");
+   if (token.kind == FormulaToken::NUMBER) return arena.make<DoubleExp>(token.number);
+   if (token.kind == FormulaToken::STRING) return arena.make<TextStringExp>(string(token.text.substr(1, token.text.length() - 2)));
+   error("Unexpected token \"" + token.toString() + "\"");
+   return NULL;
+}
+
+/**
+ * Implementation notes: readRange
+ * -------------------------------
+ * Reads the range inside a range function call: two cell names, as in
+ * A1:B10, two column letters, as in A:B, or two row numbers, as in 1:10.
+ * The first token decides the kind of the range, and the second must be of
+ * the same kind and come no earlier, which is checked here so that the
+ * error names the columns or rows as written.  Whole columns and rows are
+ * widened by the model to the rectangle spanning the sheet along them.
+ */
+
+RangeKind readRange(FormulaLexer& lexer, SSModel* model, const string& name, CellId& startId, CellId& endId) {
+   FormulaToken first = lexer.nextToken();
+   RangeKind kind = rangeKind(first);
+   if (kind == BOUNDED_RANGE) {
+      startId = readCell(first, model, "Missing valid spreadsheet start cell refernce");
+   }
+   FormulaToken token = lexer.nextToken();
+   if (!token.is(':')) {
+      error("Unexpected token \"" + token.toString() + "\" following range function \"" + name + "\"");
+   }
+   token = lexer.nextToken();
+   if (kind == BOUNDED_RANGE) {
+      endId = readCell(token, model, "Missing valid spreadsheet end cell refernce");
+   } else {
+      string line = (kind == COLUMN_RANGE) ? "column" : "row";
+      int firstLine = readLine(first, kind, model, "Missing valid spreadsheet start " + line);
+      int lastLine = readLine(token, kind, model, "Missing valid spreadsheet end " + line);
+      if (lastLine < firstLine) {
+         error("Invalid spreadsheet range input from " + line + " " + toUpperCase(first.toString()) + " to "
+               + line + " " + toUpperCase(token.toString()));
+      }
+      range r = model->openRange(kind, firstLine, lastLine);
+      startId = r.startCell;
+      endId = r.stopCell;
    }
-   return exp;
+   return kind;
+}
+
+/**
+ * Implementation notes: rangeKind
+ * -------------------------------
+ * A single letter starts a whole-column range and a number a whole-row
+ * range; anything else is read as the start cell of a bounded range.
+ */
+
+RangeKind rangeKind(const FormulaToken& token) {
+   if (token.kind == FormulaToken::WORD && token.text.length() == 1) return COLUMN_RANGE;
+   if (token.kind == FormulaToken::NUMBER) return ROW_RANGE;
+   return BOUNDED_RANGE;
+}
+
+/**
+ * Implementation notes: readCell
+ * ------------------------------
+ * Reads a cell reference inside a range function call, raising an error
+ * with the given message if token is not a valid cell name.
+ */
+
+CellId readCell(const FormulaToken& token, SSModel* model, const string& message) {
+   CellId id;
+   if (token.kind != FormulaToken::WORD || !stringToCellId(token.text.data(), token.text.length(), id)
+         || !model->cellIdIsValid(id)) {
+      error(message);
+   }
+   return id;
+}
+
+/**
+ * Implementation notes: readLine
+ * ------------------------------
+ * Reads the column letter or row number at either end of a whole-column or
+ * whole-row range, returning the column index or row number, and raising an
+ * error with the given message if token is not a column or row of the
+ * sheet.  Row numbers must be written as plain digits.
+ */
+
+int readLine(const FormulaToken& token, RangeKind kind, SSModel* model, const string& message) {
+   if (kind == COLUMN_RANGE && token.kind == FormulaToken::WORD && token.text.length() == 1) {
+      int col = toupper(token.text[0]) - 'A';
+      if (model->cellIdIsValid(packCellId(0, col))) return col;
+   }
+   if (kind == ROW_RANGE && token.kind == FormulaToken::NUMBER
+         && token.text.find_first_not_of("0123456789") == string_view::npos
+         && token.number <= kMaxCellIdRow) {
+      int row = (int) token.number;
+      if (model->cellIdIsValid(packCellId(row, 0))) return row;
+   }
+   error(message);
+   return 0;
 }
 
 /**
  * Implementation notes: precedence
  * --------------------------------
- * This function checks the token against each of the defined operators
- * and returns the appropriate precedence value.
+ * These functions check the token or operator against each of the defined
+ * operators and return the appropriate precedence value.  Anything else,
+ * including the '(' marking an open parenthesis, has precedence 0.
  */
-int precedence(const string& token) {
-   if (token == "+" || token == "-") return 1;
-   if (token == "*" || token == "/") return 2;
+
+int precedence(const FormulaToken& token) {
+   return (token.kind == FormulaToken::OPERATOR) ? precedence(token.text[0]) : 0;
+}
+
+int precedence(char op) {
+   if (op == '+' || op == '-') return 1;
+   if (op == '*' || op == '/') return 2;
    return 0;
 }
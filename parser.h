@@ -10,17 +10,24 @@
 
 #include <string>
 #include "exp.h"
-#include "tokenscanner.h"
+#include "lexer.h"
 #include "ssmodel.h"
 
 /**
  * Function: parseExp
- * Usage: Expression *exp = parseExp(scanner, model);
- * -------------------------------------------
- * Parses a complete expression from the specified TokenScanner object,
- * making sure that there are no tokens left in the scanner at the end.
+ * Usage: Expression *exp = parseExp(lexer, model, arena);
+ * -------------------------------------------------------
+ * Parses a complete expression from the specified FormulaLexer object,
+ * making sure that there are no tokens left in the lexer at the end.
+ * The nodes of the expression are made in arena, which owns them, also
+ * when the parse fails with an error.  The parse is iterative, so a formula
+ * of any length is read without recursion.  Chains of one operator may be
+ * any length, but a formula nesting chains more than a fixed depth, with
+ * parentheses or by changing operator, is rejected with an error, so that
+ * the trees handed on to the optimizer and compiler stay shallow enough to
+ * walk recursively.
  */
 
-Expression *parseExp(TokenScanner& scanner, SSModel* model);
+Expression *parseExp(FormulaLexer& lexer, SSModel* model, ExpArena& arena);
 
 #endif
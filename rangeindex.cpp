@@ -0,0 +1,198 @@
+/**
+ * File: rangeindex.cpp
+ * --------------------
+ * This file implements the rangeindex.h interface.
+ */
+
+#include "rangeindex.h"
+#include <algorithm>
+using namespace std;
+
+/**
+ * Implementation notes: tree layout
+ * ---------------------------------
+ * The segment tree of a column uses the usual implicit numbering: node 1 is
+ * the root, the children of node n are 2n and 2n + 1, and the leaf for row
+ * r is node leafCount + r.  Only nodes that hold at least one owner appear
+ * in a column's map, and only nodes with a positioned cell below them in a
+ * column's positions.
+ */
+
+RangeIndex::RangeIndex(int nRows, int nCols) {
+    leafCount = 1;
+    while (leafCount < nRows) {
+        leafCount *= 2;
+    }
+    columns.resize(nCols);
+    positions.resize(nCols);
+}
+
+void RangeIndex::add(CellId owner, const range& r) {
+    update(owner, r, true);
+}
+
+void RangeIndex::remove(CellId owner, const range& r) {
+    update(owner, r, false);
+}
+
+/**
+ * @brief RangeIndex::update
+ * @param owner: cell whose formula reads the range
+ * @param r: range being added or removed
+ * @param adding: true to add the owner to the nodes tiling r, false to remove it
+ * Walks the row interval bottom-up: whenever the left edge is a right child,
+ * or the right edge a left child, that node lies wholly inside the interval
+ * and is one of the tiles.
+ */
+void RangeIndex::update(CellId owner, const range& r, bool adding) {
+    for (int col = cellIdCol(r.startCell); col <= cellIdCol(r.stopCell); col++) {
+        unordered_map<int, vector<CellId>>& nodes = columns[col];
+        int lo = leafCount + cellIdRow(r.startCell);
+        int hi = leafCount + cellIdRow(r.stopCell) + 1;
+        while (lo < hi) {
+            int tiles[2];
+            int nTiles = 0;
+            if (lo & 1) tiles[nTiles++] = lo++;
+            if (hi & 1) tiles[nTiles++] = --hi;
+            for (int i = 0; i < nTiles; i++) {
+                if (adding) {
+                    nodes[tiles[i]].push_back(owner);
+                } else {
+                    vector<CellId>& owners = nodes[tiles[i]];
+                    for (size_t j = 0; j < owners.size(); j++) {
+                        if (owners[j] == owner) {
+                            owners[j] = owners.back();
+                            owners.pop_back();
+                            break;
+                        }
+                    }
+                    if (owners.empty()) nodes.erase(tiles[i]);
+                }
+            }
+            lo /= 2;
+            hi /= 2;
+        }
+    }
+}
+
+void RangeIndex::getOwners(CellId cell, Vector<CellId>& owners) const {
+    const unordered_map<int, vector<CellId>>& nodes = columns[cellIdCol(cell)];
+    if (nodes.empty()) return;
+    for (int node = leafCount + cellIdRow(cell); node >= 1; node /= 2) {
+        unordered_map<int, vector<CellId>>::const_iterator it = nodes.find(node);
+        if (it == nodes.end()) continue;
+        for (CellId owner : it->second) {
+            owners.add(owner);
+        }
+    }
+}
+
+/**
+ * @brief RangeIndex::setPosition
+ * @param cell: cell whose position changed
+ * @param position: its new position, or -1 to remove it
+ * Each ancestor of the leaf is recomputed from its two children; the walk
+ * stops at the first one whose value does not change, since none above it
+ * can change either.
+ */
+void RangeIndex::setPosition(CellId cell, long long position) {
+    unordered_map<int, long long>& nodes = positions[cellIdCol(cell)];
+    int node = leafCount + cellIdRow(cell);
+    if (position < 0) {
+        nodes.erase(node);
+    } else {
+        nodes[node] = position;
+    }
+    for (node /= 2; node >= 1; node /= 2) {
+        long long latest = -1;
+        for (int child = 2 * node; child <= 2 * node + 1; child++) {
+            unordered_map<int, long long>::const_iterator it = nodes.find(child);
+            if (it != nodes.end()) latest = max(latest, it->second);
+        }
+        unordered_map<int, long long>::iterator it = nodes.find(node);
+        long long current = (it == nodes.end()) ? -1 : it->second;
+        if (latest == current) break;
+        if (latest < 0) {
+            nodes.erase(it);
+        } else {
+            nodes[node] = latest;
+        }
+    }
+}
+
+/**
+ * @brief RangeIndex::latestPosition
+ * @param r: range whose cells are asked about
+ * Tiles the rows of r in each column as update does, and takes the maximum
+ * over the tiles present.
+ */
+long long RangeIndex::latestPosition(const range& r) const {
+    long long latest = -1;
+    for (int col = cellIdCol(r.startCell); col <= cellIdCol(r.stopCell); col++) {
+        const unordered_map<int, long long>& nodes = positions[col];
+        if (nodes.empty()) continue;
+        int lo = leafCount + cellIdRow(r.startCell);
+        int hi = leafCount + cellIdRow(r.stopCell) + 1;
+        while (lo < hi) {
+            int tiles[2];
+            int nTiles = 0;
+            if (lo & 1) tiles[nTiles++] = lo++;
+            if (hi & 1) tiles[nTiles++] = --hi;
+            for (int i = 0; i < nTiles; i++) {
+                unordered_map<int, long long>::const_iterator it = nodes.find(tiles[i]);
+                if (it != nodes.end()) latest = max(latest, it->second);
+            }
+            lo /= 2;
+            hi /= 2;
+        }
+    }
+    return latest;
+}
+
+/**
+ * @brief RangeIndex::getPositionedAfter
+ * @param r: range whose cells are asked about
+ * @param position: position the cells must come after
+ * @param cells: receives the cells found
+ * Tiles the rows of r in each column as latestPosition does, and descends
+ * from each tile by collectAfter.
+ */
+void RangeIndex::getPositionedAfter(const range& r, long long position, Vector<CellId>& cells) const {
+    for (int col = cellIdCol(r.startCell); col <= cellIdCol(r.stopCell); col++) {
+        const unordered_map<int, long long>& nodes = positions[col];
+        if (nodes.empty()) continue;
+        int lo = leafCount + cellIdRow(r.startCell);
+        int hi = leafCount + cellIdRow(r.stopCell) + 1;
+        while (lo < hi) {
+            if (lo & 1) collectAfter(nodes, lo++, col, position, cells);
+            if (hi & 1) collectAfter(nodes, --hi, col, position, cells);
+            lo /= 2;
+            hi /= 2;
+        }
+    }
+}
+
+/**
+ * @brief RangeIndex::collectAfter
+ * A node is entered only if the latest position below it is later than
+ * position, so each cell found costs O(log rows) and the subtrees holding
+ * none cost nothing.
+ */
+void RangeIndex::collectAfter(const unordered_map<int, long long>& nodes, int node, int col, long long position,
+                              Vector<CellId>& cells) const {
+    unordered_map<int, long long>::const_iterator it = nodes.find(node);
+    if (it == nodes.end() || it->second <= position) return;
+    if (node >= leafCount) {
+        cells.add(packCellId(node - leafCount, col));
+        return;
+    }
+    collectAfter(nodes, 2 * node, col, position, cells);
+    collectAfter(nodes, 2 * node + 1, col, position, cells);
+}
+
+void RangeIndex::clear() {
+    for (size_t col = 0; col < columns.size(); col++) {
+        columns[col].clear();
+        positions[col].clear();
+    }
+}
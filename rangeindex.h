@@ -0,0 +1,132 @@
+/**
+ * File: rangeindex.h
+ * ------------------
+ * This file defines the RangeIndex class, which records the ranges that
+ * formulas read (e.g. the A1:T10000 in sum(A1:T10000)) as rectangles rather
+ * than as one dependency per cell.  The question "which formulas read cell X
+ * through a range" is answered with a stabbing query against the index.
+ * The index also keeps the position of each cell in the model's evaluation
+ * order, so that the latest position inside a range is found without
+ * visiting the cells of the range.
+ */
+
+#ifndef _rangeindex_
+#define _rangeindex_
+
+#include <vector>
+#include <unordered_map>
+#include "vector.h"
+#include "ssutil.h"
+
+/**
+ * Class: RangeIndex
+ * -----------------
+ * Each column keeps a segment tree over its rows.  A range is split into
+ * the columns it spans, and in each column its row interval is stored on
+ * the O(log rows) tree nodes whose spans exactly tile it.  A stabbing query
+ * for a cell walks from the cell's leaf up to the root, collecting the
+ * owners stored along the way.  Tree nodes are created only when a range is
+ * stored on them, so an empty sheet costs nothing.
+ *
+ * A second tree per column, laid out the same way, holds on each node the
+ * latest position of any cell below it.  A range query takes the maximum
+ * over the O(log rows) nodes tiling its rows in each of its columns, and
+ * the cells placed after a given position are found by descending only
+ * into nodes whose latest position is later still.
+ */
+
+class RangeIndex {
+
+public:
+
+/**
+ * Constructor: RangeIndex
+ * Usage: RangeIndex index(nRows, nCols);
+ * --------------------------------------
+ * Creates an empty index for a sheet with the given number of rows and columns.
+ */
+
+    RangeIndex(int nRows, int nCols);
+
+/**
+ * Member function: add
+ * Usage: index.add(owner, r);
+ * ---------------------------
+ * Records that the formula in cell owner reads the range r.  The same owner
+ * may add the same range more than once; each addition is kept separately.
+ */
+
+    void add(CellId owner, const range& r);
+
+/**
+ * Member function: remove
+ * Usage: index.remove(owner, r);
+ * ------------------------------
+ * Removes one record previously made by add(owner, r).
+ */
+
+    void remove(CellId owner, const range& r);
+
+/**
+ * Member function: getOwners
+ * Usage: index.getOwners(cell, owners);
+ * -------------------------------------
+ * Appends to owners every cell whose formula reads a range containing cell,
+ * once for each such range.
+ */
+
+    void getOwners(CellId cell, Vector<CellId>& owners) const;
+
+/**
+ * Member function: setPosition
+ * Usage: index.setPosition(cell, position);
+ * -----------------------------------------
+ * Records the position of cell in the evaluation order, replacing the one
+ * recorded before.  A position of -1 removes the cell.
+ */
+
+    void setPosition(CellId cell, long long position);
+
+/**
+ * Member function: latestPosition
+ * Usage: long long latest = index.latestPosition(r);
+ * --------------------------------------------------
+ * Returns the latest position recorded for a cell inside r, or -1 if no
+ * cell inside r has one.
+ */
+
+    long long latestPosition(const range& r) const;
+
+/**
+ * Member function: getPositionedAfter
+ * Usage: index.getPositionedAfter(r, position, cells);
+ * ----------------------------------------------------
+ * Appends to cells every cell inside r whose recorded position is later
+ * than position.
+ */
+
+    void getPositionedAfter(const range& r, long long position, Vector<CellId>& cells) const;
+
+/**
+ * Member function: clear
+ * Usage: index.clear();
+ * ---------------------
+ * Removes every range and every position from the index.
+ */
+
+    void clear();
+
+private:
+    int leafCount;                                              /* rows covered by each tree, a power of two */
+    std::vector<std::unordered_map<int, std::vector<CellId>>> columns;  /* owners stored on each tree node, per column */
+    std::vector<std::unordered_map<int, long long>> positions;          /* latest position below each tree node, per column */
+
+/* Private helpers */
+
+    void update(CellId owner, const range& r, bool adding);
+    void collectAfter(const std::unordered_map<int, long long>& nodes, int node, int col, long long position,
+                      Vector<CellId>& cells) const;
+
+};
+
+#endif
@@ -0,0 +1,116 @@
+/**
+ * File: rangetable.cpp
+ * --------------------
+ * This file implements the rangetable.h interface.
+ */
+
+#include <functional>
+#include "rangetable.h"
+using namespace std;
+
+/**
+ * Implementation notes: passes
+ * ----------------------------
+ * Passes are numbered from 1, so an entry whose pass is 0 has never been
+ * computed.  Starting a new pass makes the model check each entry against
+ * the versions of its range the first time the entry is used in the pass,
+ * without visiting the entries that are not used.
+ */
+
+RangeTable::RangeTable() {
+    pass = 1;
+}
+
+RangeTable::~RangeTable() {
+    for (const pair<const Key, RangeAggregate*>& entry : entries) {
+        delete entry.second;
+    }
+    for (const pair<const string, SharedValue*>& entry : sharedValues) {
+        delete entry.second;
+    }
+}
+
+RangeAggregate* RangeTable::acquire(RangeFnId fn, CellId startCell, CellId endCell, double parameter,
+                                    RangeKind kind) {
+    Key key;
+    key.fn = fn;
+    key.startCell = startCell;
+    key.endCell = endCell;
+    key.parameter = parameter;
+    key.kind = kind;
+    RangeAggregate*& aggregate = entries[key];
+    if (aggregate == NULL) {
+        aggregate = new RangeAggregate;
+        aggregate->fn = fn;
+        aggregate->startCell = startCell;
+        aggregate->endCell = endCell;
+        aggregate->parameter = parameter;
+        aggregate->kind = kind;
+        aggregate->pass.store(0, memory_order_relaxed);
+        aggregate->columnVersion.store(kNoVersion, memory_order_relaxed);
+        aggregate->rangeVersion.store(kNoVersion, memory_order_relaxed);
+        aggregate->value.store(0.0, memory_order_relaxed);
+        aggregate->users = 0;
+    }
+    aggregate->users++;
+    return aggregate;
+}
+
+void RangeTable::release(RangeAggregate* aggregate) {
+    if (--aggregate->users > 0) return;
+    Key key;
+    key.fn = aggregate->fn;
+    key.startCell = aggregate->startCell;
+    key.endCell = aggregate->endCell;
+    key.parameter = aggregate->parameter;
+    key.kind = aggregate->kind;
+    entries.erase(key);
+    delete aggregate;
+}
+
+SharedValue* RangeTable::acquireShared(const string& key) {
+    SharedValue*& shared = sharedValues[key];
+    if (shared == NULL) {
+        shared = new SharedValue;
+        shared->key = key;
+        shared->pass.store(0, memory_order_relaxed);
+        shared->value.store(0.0, memory_order_relaxed);
+        shared->users = 0;
+    }
+    shared->users++;
+    return shared;
+}
+
+void RangeTable::releaseShared(SharedValue* shared) {
+    if (--shared->users > 0) return;
+    sharedValues.erase(shared->key);
+    delete shared;
+}
+
+void RangeTable::startPass() {
+    pass++;
+}
+
+unsigned long RangeTable::currentPass() const {
+    return pass;
+}
+
+bool RangeTable::Key::operator==(const Key& other) const {
+    return fn == other.fn && startCell == other.startCell && endCell == other.endCell
+            && parameter == other.parameter && kind == other.kind;
+}
+
+/**
+ * Implementation notes: KeyHash
+ * -----------------------------
+ * Mixes the parts of the key with the multiplier of a 64-bit FNV hash.
+ */
+
+size_t RangeTable::KeyHash::operator()(const Key& key) const {
+    size_t h = key.fn;
+    h = h * 1099511628211ULL ^ key.startCell;
+    h = h * 1099511628211ULL ^ key.endCell;
+    h = h * 1099511628211ULL ^ hash<double>()(key.parameter);
+    h = h * 1099511628211ULL ^ key.kind;
+    return h;
+}
@@ -0,0 +1,176 @@
+/**
+ * File: rangetable.h
+ * ------------------
+ * This file defines the RangeTable class, which hash-conses the range
+ * function calls of all formulas in a model.  Every formula calling the
+ * same function on the same range, such as the sum(B1:B5000) in a column
+ * of report cells each dividing it by something else, shares one entry,
+ * and the entry keeps the value last computed for it, so the range is read
+ * at most once per evaluation pass and not at all while it is unchanged.
+ * The table also hash-conses the formulas built on range calls, such as
+ * sum(B1:B5000) / C1 written out in several cells, so that each is
+ * evaluated at most once per pass.
+ */
+
+#ifndef _rangetable_
+#define _rangetable_
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include "ssutil.h"
+
+/**
+ * Type: RangeAggregate
+ * --------------------
+ * One range function call shared by the formulas in the table: the
+ * function id, the corners and kind of the range and the function's
+ * parameter, with the value last found for it.  The value is known to hold in pass
+ * number pass, and as long as the cell store's columnVersion or
+ * rangeVersion of the range is still the one recorded with it.  The state
+ * is atomic so that several threads may evaluate the call at once; they
+ * all find the same value.
+ */
+
+struct RangeAggregate {
+    RangeFnId fn;
+    CellId startCell;
+    CellId endCell;
+    double parameter;
+    RangeKind kind;
+    std::atomic<unsigned long> pass;            /* pass value was last known to hold in, 0 if none */
+    std::atomic<unsigned long> columnVersion;   /* columnVersion of the range value was last known to hold at */
+    std::atomic<unsigned long> rangeVersion;    /* rangeVersion of the range value was computed at */
+    std::atomic<double> value;                  /* value of the call */
+    int users;                                  /* compiled formulas using the entry */
+};
+
+/**
+ * Type: SharedValue
+ * -----------------
+ * One formula applying operators to range function calls, shared by the
+ * cells in the table written with the same formula and the same
+ * references, together with the value it was last found to have.  The
+ * value holds for the rest of pass number pass: cells are evaluated in
+ * topological order within a pass, so no cell the formula reads changes
+ * later in the pass.
+ */
+
+struct SharedValue {
+    std::string key;                            /* structure of the formula, see Program */
+    std::atomic<unsigned long> pass;            /* pass value was computed in, 0 if none */
+    std::atomic<double> value;                  /* value of the formula */
+    int users;                                  /* compiled formulas using the entry */
+};
+
+/**
+ * Constant: kNoVersion
+ * --------------------
+ * Version recorded for an entry that has no value yet.  Version sums start
+ * at 0 and go up by one per change, so they never reach it.
+ */
+
+static const unsigned long kNoVersion = ~0UL;
+
+/**
+ * Class: RangeTable
+ * -----------------
+ * The range function calls of all compiled formulas in a model, keyed by
+ * their function, range, kind of range and parameter, together with the number of the
+ * current evaluation pass.  Entries are acquired and released while
+ * formulas are stored and freed, and only read while cells are evaluated.
+ */
+
+class RangeTable {
+
+public:
+
+/**
+ * Constructor: RangeTable
+ * Usage: RangeTable table;
+ * ------------------------
+ * Creates an empty table.
+ */
+
+    RangeTable();
+
+/**
+ * Destructor: ~RangeTable
+ * -----------------------
+ * Frees every entry left in the table.
+ */
+
+    ~RangeTable();
+
+/**
+ * Member function: acquire
+ * Usage: RangeAggregate* aggregate = table.acquire(FN_SUM, startCell, endCell, 0, BOUNDED_RANGE);
+ * -----------------------------------------------------------------------------------------------
+ * Returns the entry for the given call, adding it if it is not in the table
+ * yet, and counts one more user of it.
+ */
+
+    RangeAggregate* acquire(RangeFnId fn, CellId startCell, CellId endCell, double parameter, RangeKind kind);
+
+/**
+ * Member function: release
+ * Usage: table.release(aggregate);
+ * --------------------------------
+ * Counts one user less of an entry returned by acquire, removing it once it
+ * has no users left.
+ */
+
+    void release(RangeAggregate* aggregate);
+
+/**
+ * Member functions: acquireShared, releaseShared
+ * Usage: SharedValue* shared = table.acquireShared(key);
+ *        table.releaseShared(shared);
+ * -----------------------------------------------------
+ * Work as acquire and release do, for the formula whose structure is key.
+ */
+
+    SharedValue* acquireShared(const std::string& key);
+    void releaseShared(SharedValue* shared);
+
+/**
+ * Member functions: startPass, currentPass
+ * Usage: table.startPass();
+ * -------------------------
+ * startPass begins a new evaluation pass, after which the value of an entry
+ * must be checked against the versions of its range before it is used
+ * again.  currentPass returns the number of the pass under way.
+ */
+
+    void startPass();
+    unsigned long currentPass() const;
+
+private:
+
+/* Key identifying a range function call */
+
+    struct Key {
+        RangeFnId fn;
+        CellId startCell;
+        CellId endCell;
+        double parameter;
+        RangeKind kind;
+        bool operator==(const Key& other) const;
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+
+    std::unordered_map<Key, RangeAggregate*, KeyHash> entries;
+    std::unordered_map<std::string, SharedValue*> sharedValues;
+    unsigned long pass;                 /* number of the current evaluation pass */
+
+/* Copying a table would free its entries twice, so it is disallowed */
+
+    RangeTable(const RangeTable&);
+    RangeTable& operator=(const RangeTable&);
+
+};
+
+#endif
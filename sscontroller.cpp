@@ -74,6 +74,8 @@ static void helpAction(TokenScanner& scanner, SSModel& model) {
          << "quit" << "Quit the program" << endl;
     cout << left << setw(kLeftColumnWidth)
          << "clear" << "Clear the spreadsheet" << endl;
+    cout << left << setw(kLeftColumnWidth)
+         << "lazy on|off" << "Evaluate cells only when shown or read, or always" << endl;
 	cout << endl;
 }
 
@@ -85,6 +87,22 @@ static void clearAction(TokenScanner& scanner, SSModel& model) {
     cout << "Cleared spreadsheet." << endl;
 }
 
+/**
+ * Switches the model between lazy and eager evaluation by calling model.setLazyEvaluation()
+ * With no argument, prints which mode is in use
+ */
+static void lazyAction(TokenScanner& scanner, SSModel& model) {
+    if (!scanner.hasMoreTokens()) {
+        cout << "Lazy evaluation is " << (model.isLazyEvaluation() ? "on" : "off") << "." << endl;
+        return;
+    }
+    string mode = toLowerCase(scanner.nextToken());
+    if (mode != "on" && mode != "off")
+        error("The lazy command takes on or off.");
+    model.setLazyEvaluation(mode == "on");
+    cout << "Lazy evaluation is " << mode << "." << endl;
+}
+
 static void loadAction(TokenScanner& scanner, SSModel& model) {
 	if (!scanner.hasMoreTokens()) 
         error("The load command requires a file name.");
@@ -121,7 +139,11 @@ static void setAction(TokenScanner& scanner, SSModel& model) {
         error("Invalid cell name " + cellname);
 	if (scanner.nextToken() != "=") 
         error("= expected.");
-	model.setCellFromScanner(cellname, scanner);
+	// the rest of the line is the formula, handed on as typed for the model's lexer
+	string formula;
+	for (int ch = scanner.getChar(); ch != EOF; ch = scanner.getChar())
+		formula += ch;
+	model.setCellFromText(cellname, formula);
 }
 
 static void getAction(TokenScanner& scanner, SSModel& model) {
@@ -156,6 +178,7 @@ static void setUpCommandTable(Map<string, cmdFnT>& table) {
     table["get"] = getAction;
     table["quit"] = quitAction;
     table["clear"] = clearAction;
+    table["lazy"] = lazyAction;
 }
 
 /**
@@ -261,6 +284,8 @@ static void processActionEvent(GActionEvent& actionEvent, Map<string, cmdFnT>& c
 static void interpretCommands(Map<string, cmdFnT>& cmdTable) {
 	SSView view;
 	SSModel model(kNumRowsDisplayed, kNumColsDisplayed, &view);
+	range shown = view.getVisibleRange();
+	model.setVisibleRange(shown.startCell, shown.stopCell);
 	TokenScanner scanner;
 	scanner.ignoreWhitespace();
 	scanner.scanNumbers();
@@ -274,6 +299,7 @@ static void interpretCommands(Map<string, cmdFnT>& cmdTable) {
     cout << "If a cell is selected in spreadsheet, it prints selected cell information." << endl;
     cout << "To edit a cell in spreadsheet, enter the right side(RHS) of expression(formula) directly into cell." << endl;
     cout << "Eg: A1 = sum(B1:C1) + 10; select cell A1 and type sum(B1:C1) + 10" << endl;
+    cout << "Range functions also take whole columns or rows, Eg: A1 = sum(B:C) or A1 = max(3:3)." << endl;
     cout << "For entering string value in spreadsheet cell, enter string in inverted comma." << endl;
     cout << "Eg: A1 = \"test\"; select A1 and type \"test\" in cell." << endl;
     cout << "To list menu of commands for spreadsheet, select \"help\" from chooser and execute." << endl;
@@ -15,48 +15,88 @@
 #include "ssmodel.h"
 #include "exp.h"
 #include "parser.h"
+#include "optimizer.h"
+#include "bytecode.h"
 #include "strlib.h"
 #include "filelib.h"
+#include "error.h"
 #include <cctype>
+#include <atomic>
+#include <queue>
+#include <algorithm>
+#include <climits>
 
 using namespace std;
 
+/* Number of cells a recalculation must have queued before the rest is scheduled in blocks over the thread pool */
+
+static const int kParallelThreshold = 2048;
+
+/* Distance between the positions handed out at either end of topoOrder, see nextOrder */
+
+static const long long kOrderGap = 1 << 16;
+
+/* Position of the first cell placed at the end of topoOrder; cells placed at the front count down from below it */
+
+static const long long kFirstOrder = 1LL << 61;
+
+
 /**
  * Initializes member variables and calls setUpRangeTable in ssutil to initialize rangeFunction map
  */
-SSModel::SSModel(int nRows, int nCols, SSView *view) {
+SSModel::SSModel(int nRows, int nCols, SSView *view) : cells(nRows, nCols), rangeIndex(nRows, nCols) {
     this->totalRows = nRows;
     this->totalCols = nCols;
     this->view = view;
+    this->nextOrder = kFirstOrder;
+    this->frontOrder = kFirstOrder - kOrderGap;
+    this->inTransaction = false;
+    this->savedNextOrder = nextOrder;
+    this->savedFrontOrder = frontOrder;
+    this->lazyEvaluation = false;
+    this->visibleRange.startCell = packCellId(0, 0);
+    this->visibleRange.stopCell = packCellId(min(nRows, kNumRowsDisplayed) - 1, min(nCols, kNumColsDisplayed) - 1);
     setUpRangeTable(fnTable);
 }
 
 /**
- * Empty; no new variables are created in this model
+ * Releases the formulas of all cells, including formulas kept for an unfinished transaction
  * Expression classes have their own destructor
  */
 SSModel::~SSModel() {
-
+    forgetSavedCells();
+    releaseFormulas();
 }
 
 /**
  * @brief SSModel::nameIsValid
  * @param cellname: spreadsheet cell name
  * returns true of name is valid cell name i.e. lies between the valid row and column range of spreadsheet; else returns false
- * calls stringToLocation in ssutil to do basic cell name check
+ * calls stringToCellId in ssutil to do basic cell name check
  */
 bool SSModel::nameIsValid(const string& cellname) const {
-    location loc;
-    if (!stringToLocation(cellname, loc)) {
-        return false;
-    }
-    if (loc.col < 'A' || loc.col >= 'A' + totalCols) {
-        return false;
-    }
-    if (loc.row < 0 || loc.row >= totalRows) {
-        return false;
-    }
-    return true;
+    CellId id;
+    return stringToCellId(cellname, id) && cellIdIsValid(id);
+}
+
+/**
+ * @brief SSModel::cellIdIsValid
+ * @param id: spreadsheet cell id
+ * returns true if the cell lies between the valid row and column range of spreadsheet; else returns false
+ */
+bool SSModel::cellIdIsValid(CellId id) const {
+    return cellIdCol(id) < totalCols && cellIdRow(id) < totalRows;
+}
+
+/**
+ * @brief SSModel::cellId
+ * @param cellname: valid spreadsheet cell name
+ * returns id of the named cell
+ */
+CellId SSModel::cellId(const string& cellname) const {
+    CellId id = 0;
+    stringToCellId(cellname, id);
+    return id;
 }
 
 /**
@@ -72,171 +112,780 @@ bool SSModel::rangeFnIsValid(const std::string& name) const {
     }
 }
 
+/**
+ * @brief SSModel::getRangeFnId
+ * @param name: valid range function name
+ * return id of the range function with the given name
+ */
+RangeFnId SSModel::getRangeFnId(const std::string& name) const {
+    return fnTable[toLowerCase(name)];
+}
+
 /**
  * @brief SSModel::validRange
- * @param startCellName
- * @param endCellName
+ * @param startCell
+ * @param endCell
  * return true if the range between start cell and end cell refernce is valid, else return false
- * Range is valid if:  (1) name of both start and end cell is valid
+ * Range is valid if:  (1) both start and end cell are valid
  *                     (2) endCell.row >= startCell.row
  *                     (3) endCell.col >= startCell.col
  */
-bool SSModel::validRange(const std::string& startCellName, const std::string& endCellName) const {
-    if (!nameIsValid(startCellName) || !nameIsValid(endCellName)) {
+bool SSModel::validRange(CellId startCell, CellId endCell) const {
+    if (!cellIdIsValid(startCell) || !cellIdIsValid(endCell)) {
         return false;
     }
-    location startLoc;
-    stringToLocation(startCellName, startLoc);
-    location endLoc;
-    stringToLocation(endCellName, endLoc);
-    if (endLoc.col < startLoc.col) {
+    if (cellIdCol(endCell) < cellIdCol(startCell)) {
         return false;
     }
-    if (endLoc.row < startLoc.row) {
+    if (cellIdRow(endCell) < cellIdRow(startCell)) {
         return false;
     }
     return true;
 }
 
 /**
- * @brief SSModel::setCellFromScanner
+ * @brief SSModel::openRange
+ * @param kind: COLUMN_RANGE or ROW_RANGE
+ * @param first, last: first and last column index, or first and last row number
+ * Whole columns run from row 0, which A0 and the like name as well, down to the last row
+ */
+range SSModel::openRange(RangeKind kind, int first, int last) const {
+    range r;
+    if (kind == COLUMN_RANGE) {
+        r.startCell = packCellId(0, first);
+        r.stopCell = packCellId(totalRows - 1, last);
+    } else {
+        r.startCell = packCellId(first, 0);
+        r.stopCell = packCellId(last, totalCols - 1);
+    }
+    r.kind = kind;
+    return r;
+}
+
+/**
+ * @brief SSModel::setCellFromText
  * @param cellname: lhs spreadsheet cell
- * @param scanner
- * Parses the input expression from token scanner by calling parseExp() on parser.cpp
- * Collect all parent cells on which this cell is directly dependent by calling getDependent() method on exp.cpp
+ * @param text: formula
+ * A single edit is a transaction of its own: the formula is stored by storeFormula() and committed at once
+ * Inside a transaction opened by the caller the formula is only stored
+ * If storing fails, the transaction is rolled back and the error passed on
+ * A transaction opened by the caller is ended too, and the message says so, since the caller's other edits are lost
+ */
+void SSModel::setCellFromText(const string& cellname, string_view text) {
+    bool singleEdit = !inTransaction;
+    if (singleEdit) {
+        beginTransaction();
+    }
+    try {
+        storeFormula(cellId(cellname), text);
+    } catch (ErrorException& ex) {
+        rollbackTransaction();
+        if (singleEdit) throw;
+        error(ex.getMessage() + " The transaction was rolled back.");
+    }
+    if (singleEdit) {
+        commitTransaction();
+    }
+}
+
+/**
+ * @brief SSModel::storeFormula
+ * @param id: lhs spreadsheet cell
+ * @param text: formula, read in place by FormulaLexer
+ * Parses the input expression by calling parseExp() on parser.cpp, into an arena of its own, and optimizes it
+ * Collect all parent cells and ranges on which this cell is directly dependent by calling getDependent() method on exp.cpp
  * Checks if evaluation of this expression would create a cycle in graph and if it does then throws error
- * Adds Data to graph i.e. cell vertices and dependency arcs by calling addDataToGraph
- * Calls evaluateExpression() method to evaluate value of expression from exp.cpp
- * Does topological sorting on graph starting from input cellname vertex and update all vertices dependent on this cell value
- * by evaluation their expression value again.
- */
-void SSModel::setCellFromScanner(const string& cellname, TokenScanner& scanner) {
-    Expression* exp = parseExp(scanner, this);
-    Vector<string> dependents;
-    exp->getDependent(dependents, this);
-    string cellNameUpper = toUpperCase(cellname);
-    if (checkForCycle(cellNameUpper, dependents)) {
-        error("Invalid action: Cell formula would introduce cycle.");
-    }
-    addDataToGraph(cellNameUpper, dependents);
-    celldata data;
-    evaluateExpression(cellNameUpper, exp);
-    Stack<string> topologicalOrder;
-    Vertex* startNode = graph.getVertex(cellNameUpper);
-    graph.resetData();
-    topologicalSort(startNode, topologicalOrder);
-    topologicalOrder.pop();
-    while (!topologicalOrder.isEmpty()) {
-        string nodeName = topologicalOrder.pop();
-        evaluateExpression(nodeName, spreadsheet[nodeName].exp);
-    }
-}
-
-/**
- * @brief SSModel::evaluateExpression
- * @param cellname: lhs spreadsheet cell
- * @param exp
- * Evaluates the value of cell expression by calling eval() method on exp.cpp
- * Also gets the evaluated value and string display value from exp.cpp and stores them in celldata struct
- * Adds the key and its value in spreadsheet model map
- * Updates the display in spreadsheet by calling displayCell() method on ssview
+ * Stores the formula by calling storeExpression(), or frees the arena if any of this fails
  */
-void SSModel::evaluateExpression(const string& cellname, Expression* exp) {
-    string cellNameUpper = toUpperCase(cellname);
-    double value = exp->eval(this);
-    celldata data;
-    data.value = value;
-    if (exp->getType() == TEXTSTRING) {
-        data.displayValue = ((TextStringExp*) exp)->getTextStringValue();
+void SSModel::storeFormula(CellId id, string_view text) {
+    FormulaLexer lexer(text);
+    ExpArena* arena = new ExpArena;
+    Expression* exp;
+    Vector<CellId> dependents;
+    Vector<range> rangeDependents;
+    try {
+        exp = optimizeExp(parseExp(lexer, this, *arena), *arena);
+        exp->getDependent(dependents, rangeDependents);
+        if (checkForCycle(id, dependents, rangeDependents)) {
+            error("Invalid action: Cell formula would introduce cycle.");
+        }
+    } catch (ErrorException&) {
+        delete arena;
+        throw;
+    }
+    storeExpression(id, exp, arena, dependents, rangeDependents);
+}
+
+/**
+ * @brief SSModel::storeExpression
+ * @param id: lhs spreadsheet cell
+ * @param exp: parsed formula of the cell
+ * @param arena: arena holding exp, handed over to the Formula or freed
+ * @param dependents: Vector of cells on which lhs is dependent
+ * @param rangeDependents: Vector of ranges read by range functions in lhs formula
+ * Shares the Formula of any cell if it matches, otherwise wraps exp in a new Formula, compiling it once, and enters
+ * it in formulaTable
+ * The cell is then given the formula by setFormula()
+ */
+void SSModel::storeExpression(CellId id, Expression* exp, ExpArena* arena, Vector<CellId>& dependents,
+                              Vector<range>& rangeDependents) {
+    Formula* formula = findSharedFormula(id, exp);
+    if (formula == NULL) {
+        formula = new Formula(exp, arena, id, &rangeTable);
+        formulaTable.insert(make_pair(formula->getShapeHash(), formula));
     } else {
-        data.displayValue = doubleToString(value);
+        delete arena;
     }
-    data.exp = exp;
-    if (spreadsheet.containsKey(cellNameUpper)) {
-        spreadsheet.remove(cellNameUpper);
+    setFormula(id, formula, dependents, rangeDependents);
+}
+
+/**
+ * @brief SSModel::setFormula
+ * @param id: lhs spreadsheet cell
+ * @param formula: formula the cell is to hold, possibly shared with other cells
+ * @param dependents: Vector of cells on which lhs is dependent
+ * @param rangeDependents: Vector of ranges read by range functions in lhs formula
+ * Adds Data to graph i.e. cell vertices and dependency arcs by calling addDataToGraph
+ * The cell keeps its old value until the transaction is committed
+ * The formula replaced stays alive for rollback through the saved cell, unless it was itself stored earlier in
+ * the same transaction and no other cell shares it
+ */
+void SSModel::setFormula(CellId id, Formula* formula, Vector<CellId>& dependents, Vector<range>& rangeDependents) {
+    saveCell(id);
+    addDataToGraph(id, dependents, rangeDependents);
+    formula->addUser(id);
+    releaseFormula(cells.getFormula(id), id);
+    cells.setCell(id, formula, cells.getValue(id));
+}
+
+/**
+ * @brief SSModel::findSharedFormula
+ * @param id: cell the expression was parsed for
+ * @param exp: parsed formula
+ * Only the formulas with the same shape hash are compared with exp, so the lookup costs one walk of exp whatever
+ * the number of formulas in the sheet
+ */
+Formula* SSModel::findSharedFormula(CellId id, const Expression* exp) const {
+    pair<unordered_multimap<size_t, Formula*>::const_iterator, unordered_multimap<size_t, Formula*>::const_iterator>
+            candidates = formulaTable.equal_range(Formula::shapeHash(exp, id));
+    for (unordered_multimap<size_t, Formula*>::const_iterator it = candidates.first; it != candidates.second; ++it) {
+        if (it->second->matches(exp, id)) {
+            return it->second;
+        }
     }
-    spreadsheet[cellNameUpper] = data;
-    view->displayCell(cellNameUpper, data.displayValue);
+    return NULL;
 }
 
 /**
- * @brief SSModel::addDataToGraph
- * @param cellname: input cellname vertex(i.e. lhs spreadsheet cell)
- * @param dependents: Vector of cell name on which lhs is dependent
- * Creates a new vertex for cell which are not present already
- * Removes existing dependencies for already existing vertex
- * Adds edges originating from vertices in vector of dependents to input cell vertex to represent dependencies
- * Also adds vertices from vector of dependents to incomingNeighbors map with key as input cellname to
- * represent incoming dependencies
- */
-void SSModel::addDataToGraph(const string& cellname, Vector<string>& dependents) {
-    if (!graph.containsVertex(cellname)) {
-        Vertex* lhs = new Vertex(cellname);
-        graph.addVertex(lhs);
+ * @brief SSModel::releaseFormula
+ * @param formula: formula a cell or saved cell stops using, or NULL
+ * @param id: the cell, or the cell the saved cell was saved from
+ */
+void SSModel::releaseFormula(Formula* formula, CellId id) {
+    if (formula != NULL && formula->removeUser(id)) {
+        pair<unordered_multimap<size_t, Formula*>::iterator, unordered_multimap<size_t, Formula*>::iterator>
+                entries = formulaTable.equal_range(formula->getShapeHash());
+        for (unordered_multimap<size_t, Formula*>::iterator it = entries.first; it != entries.second; ++it) {
+            if (it->second == formula) {
+                formulaTable.erase(it);
+                break;
+            }
+        }
+        delete formula;
+    }
+}
+
+/**
+ * @brief SSModel::beginTransaction
+ * Remembers where topoOrder ends so that positions handed out by the transaction can be taken back
+ */
+void SSModel::beginTransaction() {
+    if (inTransaction) {
+        error("A transaction is already in progress.");
+    }
+    inTransaction = true;
+    savedNextOrder = nextOrder;
+    savedFrontOrder = frontOrder;
+}
+
+/**
+ * @brief SSModel::commitTransaction
+ * Keeps the edits of the transaction and calls recalculate() once for all edited cells
+ * A cell the transaction added to a whole-column or whole-row range changes the range's extent, so the cells reading
+ * it are recalculated as well, even if the added cell's value leaves the recalculation nothing else to pass on
+ * In lazy mode the edited cells are only marked stale, and the visible ones refreshed
+ */
+void SSModel::commitTransaction() {
+    if (!inTransaction) {
+        error("No transaction in progress.");
+    }
+    Vector<CellId> changedCells = editedCells;
+    for (CellId id : editedCells) {
+        if (!savedCells[id].occupied) getOpenRangeReaders(id, changedCells);
+    }
+    forgetSavedCells();
+    if (lazyEvaluation) {
+        markStale(changedCells);
+        refreshVisibleCells();
     } else {
-        for (string neighbor : incomingNeighbors[cellname]) {
-            if (graph.containsEdge(neighbor, cellname)) {
-                graph.removeEdge(neighbor, cellname);
+        recalculate(changedCells);
+    }
+}
+
+/**
+ * Described in ssmodel.h
+ */
+void SSModel::setLazyEvaluation(bool lazy) {
+    if (lazyEvaluation && !lazy) {
+        rangeTable.startPass();
+        vector<pair<long long, CellId>> ordered;
+        for (CellId id : staleCells) {
+            ordered.push_back(make_pair(topoOrder[id], id));
+        }
+        sort(ordered.begin(), ordered.end());
+        for (size_t i = 0; i < ordered.size(); i++) {
+            evaluateCell(ordered[i].second);
+        }
+        staleCells.clear();
+    }
+    lazyEvaluation = lazy;
+}
+
+/**
+ * Described in ssmodel.h
+ */
+bool SSModel::isLazyEvaluation() const {
+    return lazyEvaluation;
+}
+
+/**
+ * Described in ssmodel.h
+ */
+void SSModel::setVisibleRange(CellId startCell, CellId endCell) {
+    if (!validRange(startCell, endCell)) {
+        error("Invalid visible range.");
+    }
+    visibleRange.startCell = startCell;
+    visibleRange.stopCell = endCell;
+    if (lazyEvaluation) {
+        refreshVisibleCells();
+    }
+}
+
+/**
+ * @brief SSModel::markStale
+ * @param changedCells: cells whose formula changed
+ * Walks the cells depending on the changed cells with an explicit stack
+ * A cell already stale is not walked again, since every cell depending on it is already stale
+ */
+void SSModel::markStale(const Vector<CellId>& changedCells) {
+    vector<CellId> pending;
+    for (CellId id : changedCells) {
+        if (staleCells.insert(id).second) {
+            pending.push_back(id);
+        }
+    }
+    Vector<CellId> dependentCells;
+    while (!pending.empty()) {
+        CellId node = pending.back();
+        pending.pop_back();
+        dependentCells.clear();
+        getDependentCells(node, dependentCells);
+        for (CellId neighbor : dependentCells) {
+            if (staleCells.insert(neighbor).second) {
+                pending.push_back(neighbor);
             }
         }
-        incomingNeighbors[cellname].clear();
     }
-    Vertex* lhsNode = graph.getVertex(cellname);
-    for (string depCell : dependents) {
-        Vertex* neighbor;
-        if (graph.containsVertex(depCell)) {
-            neighbor = graph.getVertex(depCell);
+}
+
+/**
+ * @brief SSModel::refreshCell
+ * @param id: spreadsheet cell whose value is needed
+ * Walks from the cell over the stale cells it reads, by name or through a range, with an explicit stack
+ * A cell that is not stale reads no stale cell, so the walk stops there
+ * The cells found are evaluated in topoOrder, so each one is evaluated once, after all the cells it reads
+ */
+void SSModel::refreshCell(CellId id) {
+    if (staleCells.count(id) == 0) return;
+    rangeTable.startPass();
+    graph.startTraversal();
+    graph.markVisited(id);
+    vector<CellId> pending(1, id);
+    vector<pair<long long, CellId>> due;
+    Vector<CellId> precedents;
+    while (!pending.empty()) {
+        CellId node = pending.back();
+        pending.pop_back();
+        due.push_back(make_pair(topoOrder[node], node));
+        precedents.clear();
+        graph.getDependencies(node, precedents);
+        if (rangeNeighbors.containsKey(node)) {
+            for (const range& r : rangeNeighbors[node]) {
+                getStaleCells(r, precedents);
+            }
+        }
+        for (CellId precedent : precedents) {
+            if (staleCells.count(precedent) > 0 && graph.markVisited(precedent)) {
+                pending.push_back(precedent);
+            }
+        }
+    }
+    sort(due.begin(), due.end());
+    for (size_t i = 0; i < due.size(); i++) {
+        evaluateCell(due[i].second);
+        staleCells.erase(due[i].second);
+    }
+}
+
+/**
+ * @brief SSModel::refreshVisibleCells
+ * Brings every cell shown by the view up to date
+ */
+void SSModel::refreshVisibleCells() {
+    Vector<CellId> visibleStale;
+    getStaleCells(visibleRange, visibleStale);
+    for (CellId id : visibleStale) {
+        refreshCell(id);
+    }
+}
+
+/**
+ * @brief SSModel::getStaleCells
+ * @param r: range of cells
+ * @param staleInRange: vector to add the stale cells inside r to
+ * Scans whichever is smaller, staleCells or the occupied cells of the range
+ */
+void SSModel::getStaleCells(const range& r, Vector<CellId>& staleInRange) const {
+    if (staleCells.empty()) return;
+    long long area = (long long) (cellIdRow(r.stopCell) - cellIdRow(r.startCell) + 1)
+                     * (cellIdCol(r.stopCell) - cellIdCol(r.startCell) + 1);
+    if ((long long) staleCells.size() < area) {
+        for (CellId id : staleCells) {
+            if (rangeContains(r, id)) staleInRange.add(id);
+        }
+    } else {
+        Vector<CellId> occupied;
+        cells.getCells(occupied, r.startCell, r.stopCell);
+        for (CellId id : occupied) {
+            if (staleCells.count(id) > 0) staleInRange.add(id);
+        }
+    }
+}
+
+/**
+ * @brief SSModel::rollbackTransaction
+ * Puts back the formula, value, dependencies and topoOrder position of every cell edited in the transaction
+ * Nothing was evaluated during the transaction, so no cell needs to be displayed again
+ */
+void SSModel::rollbackTransaction() {
+    if (!inTransaction) {
+        error("No transaction in progress.");
+    }
+    for (CellId id : editedCells) {
+        SavedCell& saved = savedCells[id];
+        releaseFormula(cells.getFormula(id), id);
+        if (saved.occupied) {
+            cells.setCell(id, saved.formula, saved.value);
+        } else {
+            cells.removeCell(id);
+        }
+        addDataToGraph(id, saved.dependencies, saved.ranges);
+    }
+    for (const pair<const CellId, long long>& entry : savedOrder) {
+        usedOrders.erase(topoOrder[entry.first]);
+    }
+    for (const pair<const CellId, long long>& entry : savedOrder) {
+        if (entry.second < 0) {
+            topoOrder.erase(entry.first);
         } else {
-            neighbor = new Vertex(depCell);
-            graph.addVertex(neighbor);
+            topoOrder[entry.first] = entry.second;
+            usedOrders.insert(entry.second);
+        }
+        rangeIndex.setPosition(entry.first, entry.second);
+    }
+    nextOrder = savedNextOrder;
+    frontOrder = savedFrontOrder;
+    savedCells.clear();
+    editedCells.clear();
+    savedOrder.clear();
+    inTransaction = false;
+}
+
+/**
+ * @brief SSModel::saveCell
+ * @param id: spreadsheet cell about to be edited
+ * Only the first edit of a cell in a transaction is recorded, later ones replace what the transaction stored itself
+ * The saved cell counts as a user of the cell's formula, which it hands back to the cell on rollback
+ */
+void SSModel::saveCell(CellId id) {
+    if (savedCells.count(id) > 0) return;
+    SavedCell& saved = savedCells[id];
+    saved.occupied = cells.contains(id);
+    saved.formula = cells.getFormula(id);
+    if (saved.formula != NULL) {
+        saved.formula->addUser(id);
+    }
+    saved.value = cells.getValue(id);
+    graph.getDependencies(id, saved.dependencies);
+    if (rangeNeighbors.containsKey(id)) {
+        saved.ranges = rangeNeighbors[id];
+    }
+    editedCells.add(id);
+}
+
+/**
+ * @brief SSModel::forgetSavedCells
+ * The formulas replaced by the transaction are no longer needed for rollback and are released
+ */
+void SSModel::forgetSavedCells() {
+    for (const pair<const CellId, SavedCell>& entry : savedCells) {
+        releaseFormula(entry.second.formula, entry.first);
+    }
+    savedCells.clear();
+    editedCells.clear();
+    savedOrder.clear();
+    inTransaction = false;
+}
+
+/**
+ * @brief SSModel::evaluateCell
+ * @param id: spreadsheet cell with a formula
+ * Evaluates the value of the cell by running its Formula, compiled to bytecode in bytecode.cpp
+ * Stores the value in the cell store
+ * Updates the display in spreadsheet by calling displayCell() method on ssview
+ * Returns whether the value changed, so callers can skip the cells depending on an unchanged cell
+ */
+bool SSModel::evaluateCell(CellId id) {
+    bool changed = computeCell(id);
+    view->displayCell(id, getDisplayValue(id));
+    return changed;
+}
+
+/**
+ * @brief SSModel::computeCell
+ * @param id: spreadsheet cell with a formula
+ * Evaluates and stores the value of the cell like evaluateCell(), leaving the view alone
+ * Values are compared bit for bit, so a NaN that stays the same NaN counts as unchanged
+ */
+bool SSModel::computeCell(CellId id) {
+    return cells.setValue(id, cells.getFormula(id)->run(this, id));
+}
+
+/**
+ * @brief SSModel::computeBlock
+ * @param id: first of a run of cells down a column sharing a formula
+ * @param count: number of cells in the run
+ * The run is evaluated and stored one chunk of the cell store at a time, so the values stay in cache in between
+ */
+bool SSModel::computeBlock(CellId id, int count) {
+    Formula* formula = cells.getFormula(id);
+    double values[CellStore::kChunkRows];
+    bool changed = false;
+    int row = cellIdRow(id);
+    int lastRow = row + count - 1;
+    while (row <= lastRow) {
+        int n = min(CellStore::kChunkRows - row % CellStore::kChunkRows, lastRow - row + 1);
+        CellId first = packCellId(row, cellIdCol(id));
+        formula->runColumn(this, first, n, values);
+        if (cells.setColumnValues(first, n, values)) changed = true;
+        row += n;
+    }
+    return changed;
+}
+
+/**
+ * @brief SSModel::getDisplayValue
+ * @param id: occupied spreadsheet cell
+ * The text is made only when the cell is displayed, so evaluation never formats numbers
+ */
+string SSModel::getDisplayValue(CellId id) const {
+    Formula* formula = cells.getFormula(id);
+    if (formula->isText()) {
+        return formula->getText();
+    }
+    return doubleToString(cells.getValue(id));
+}
+
+/**
+ * @brief SSModel::addDataToGraph
+ * @param id: input cell vertex(i.e. lhs spreadsheet cell)
+ * @param dependents: Vector of cells on which lhs is dependent
+ * @param rangeDependents: Vector of ranges read by range functions in lhs formula
+ * Replaces existing dependency arcs of the vertex in graph by arcs originating from cells in vector of
+ * dependents to input cell
+ * Removes existing ranges of the vertex from rangeIndex
+ * Each range is added to rangeIndex as one rectangle, whatever its size
+ */
+void SSModel::addDataToGraph(CellId id, Vector<CellId>& dependents, Vector<range>& rangeDependents) {
+    graph.setDependencies(id, dependents);
+    for (const range& r : rangeNeighbors[id]) {
+        rangeIndex.remove(id, r);
+    }
+    rangeNeighbors[id] = rangeDependents;
+    for (const range& r : rangeDependents) {
+        rangeIndex.add(id, r);
+    }
+}
+
+/**
+ * @brief SSModel::getDependentCells
+ * @param id: spreadsheet cell
+ * @param dependentCells: cells which directly depend on id
+ * Cells referring to id by name are read from graph
+ * Cells reading id through a range are found by a stabbing query on rangeIndex
+ * A cell may appear more than once if it reads id through several ranges
+ */
+void SSModel::getDependentCells(CellId id, Vector<CellId>& dependentCells) {
+    graph.getDependents(id, dependentCells);
+    rangeIndex.getOwners(id, dependentCells);
+}
+
+/**
+ * @brief SSModel::getOpenRangeReaders
+ * @param id: spreadsheet cell
+ * @param readers: cells reading id through a whole-column or whole-row range
+ * Such a range is evaluated over its populated extent, which a cell changes by becoming occupied even if its value
+ * stays 0.0
+ */
+void SSModel::getOpenRangeReaders(CellId id, Vector<CellId>& readers) {
+    Vector<CellId> owners;
+    rangeIndex.getOwners(id, owners);
+    for (CellId owner : owners) {
+        for (const range& r : rangeNeighbors[owner]) {
+            if (r.kind != BOUNDED_RANGE && rangeContains(r, id)) {
+                readers.add(owner);
+                break;
+            }
         }
-        Edge* e = new Edge(neighbor, lhsNode);
-        graph.addEdge(e, true);
-        incomingNeighbors[cellname].add(depCell);
     }
 }
 
 /**
  * @brief SSModel::checkForCycle
- * @param cellname: input cellname vertex(i.e. lhs spreadsheet cell)
- * @param dependents: Vector of cell name on which lhs is dependent
+ * @param id: input cell vertex(i.e. lhs spreadsheet cell)
+ * @param dependents: Vector of cells on which lhs is dependent
+ * @param rangeDependents: Vector of ranges read by range functions in lhs formula
  * return true if the expression creates a cycle in graph else false
- * DFS is done from each vertex in dependent vector to see if input cellname vertex can be reached
- * If it can be reached then cycle exists else not
- * Calls dfsRecursive() to do DFS
- */
-bool SSModel::checkForCycle(const string& cellname, const Vector<string>& dependents) {
-    graph.resetData();
-    for (string s : dependents) {
-        if (graph.containsVertex(s) && dfsRecursive(s, cellname)) {
-            return true;
+ * A formula reading the cell itself is a cycle straight away
+ * Otherwise, if every cell the new formula reads is already placed before input cell in topoOrder, no cycle
+ * can exist and nothing else is searched; a new cell which no other cell depends on is simply placed at the end
+ * The latest position inside each range comes from rangeIndex, so a range costs O(log rows) per column however
+ * many cells it holds
+ * Only when that does not hold is the order repaired, as in Pearce and Kelly's algorithm, within the region from
+ * input cell to the latest cell read, latest; a new cell is taken to sit just before the cells depending on it
+ * The cells read which are placed inside the region are found, those inside ranges from rangeIndex
+ * DFS is done from input cell vertex over the cells depending on it, never entering a cell placed after latest,
+ * since positions only grow along a dependency and such a cell cannot reach a cell read; if one of the cells
+ * read is reached then cycle exists else not
+ * A second DFS goes back from the cells read over the cells they read, staying inside the region
+ * The positions of both sets of cells are then handed out again, the cells found going back first, so only the
+ * cells between the two ends of the new dependency are searched and moved
+ * Calls searchDependents() and searchPrecedents() to do the DFS and reorderRegion() to move the cells
+ */
+bool SSModel::checkForCycle(CellId id, const Vector<CellId>& dependents, const Vector<range>& rangeDependents) {
+    for (CellId dep : dependents) {
+        if (dep == id) return true;
+    }
+    for (const range& r : rangeDependents) {
+        if (rangeContains(r, id)) return true;
+    }
+    long long latest = -1;
+    for (CellId cell : dependents) {
+        latest = max(latest, positionOf(cell));
+    }
+    for (const range& r : rangeDependents) {
+        latest = max(latest, rangeIndex.latestPosition(r));
+    }
+    long long self = positionOf(id);
+    if (self >= 0 && latest < self) {
+        return false;
+    }
+    long long lowerBound = self;
+    Vector<CellId> dependentCells;
+    if (self < 0) {
+        getDependentCells(id, dependentCells);
+        if (dependentCells.isEmpty()) {
+            moveToEndOfOrder(id);
+            return false;
+        }
+        long long earliest = LLONG_MAX;
+        for (CellId cell : dependentCells) {
+            earliest = min(earliest, positionOf(cell));
         }
+        lowerBound = earliest - 1;
+    }
+    Vector<CellId> precedents;
+    for (CellId cell : dependents) {
+        if (positionOf(cell) > lowerBound) precedents.add(cell);
+    }
+    for (const range& r : rangeDependents) {
+        rangeIndex.getPositionedAfter(r, lowerBound, precedents);
     }
-    //Special case of vertex directly depending on itself
-    if (dependents.size() == 1 && dependents[0] == cellname) {
+    Vector<CellId> forward;
+    if (searchDependents(id, latest, precedents, forward)) {
         return true;
     }
+    Vector<CellId> backward;
+    searchPrecedents(precedents, lowerBound, backward);
+    if (self < 0) {
+        forward.remove(0);
+    }
+    reorderRegion(backward, forward);
+    if (self < 0) {
+        placeNewCell(id, dependents, rangeDependents, dependentCells);
+    }
     return false;
 }
 
 /**
- * @brief SSModel::dfsRecursive
- * @param start: each vertex in dependent vector of vertices
- * @param end: input cellname vertex(i.e. lhs spreadsheet cell)
- * DFS is done recursively from each vertex in dependent vector to input cellname vertex
- * If end can be reached then it returns true which implies cycle will be created in graph
+ * @brief SSModel::placeNewCell
+ * @param id: spreadsheet cell without a position
+ * @param dependents, rangeDependents: cells and ranges its formula reads
+ * @param dependentCells: cells directly depending on it
+ * The cell has to go strictly between the latest cell it reads and the earliest cell depending on it
+ * A cell reading no placed cell goes to the front of topoOrder; otherwise the free position just after the
+ * latest cell read, or just before the earliest dependent, is taken
+ * When neither is free, the cell is placed at the end and every cell depending on it moved after it, in order
  */
-bool SSModel::dfsRecursive(const string& start, const string& end) {
-    Vertex* startNode = graph.getVertex(start);
-    if (start == end) {
-        return true;
+void SSModel::placeNewCell(CellId id, const Vector<CellId>& dependents, const Vector<range>& rangeDependents,
+                           const Vector<CellId>& dependentCells) {
+    long long after = -1;
+    for (CellId cell : dependents) {
+        after = max(after, positionOf(cell));
+    }
+    for (const range& r : rangeDependents) {
+        after = max(after, rangeIndex.latestPosition(r));
+    }
+    long long before = LLONG_MAX;
+    for (CellId cell : dependentCells) {
+        before = min(before, positionOf(cell));
+    }
+    long long position = -1;
+    if (after < 0) {
+        position = frontOrder;
+        frontOrder -= kOrderGap;
+    } else if (after + 1 < before && usedOrders.count(after + 1) == 0) {
+        position = after + 1;
+    } else if (before - 1 > after && usedOrders.count(before - 1) == 0) {
+        position = before - 1;
+    }
+    if (position >= 0) {
+        setOrder(id, position);
+        usedOrders.insert(position);
+        return;
+    }
+    Vector<CellId> reached;
+    searchDependents(id, LLONG_MAX, Vector<CellId>(), reached);
+    vector<pair<long long, CellId>> moved;
+    for (CellId cell : reached) {
+        if (cell != id) moved.push_back(make_pair(topoOrder[cell], cell));
+    }
+    sort(moved.begin(), moved.end());
+    moveToEndOfOrder(id);
+    for (size_t i = 0; i < moved.size(); i++) {
+        moveToEndOfOrder(moved[i].second);
+    }
+}
+
+/**
+ * @brief SSModel::reorderRegion
+ * @param backward: cells reached going back from the cells a new formula reads
+ * @param forward: cells reached going forward from the cell given the formula
+ * Every cell one of backward reads comes before it already, or is in backward too, and likewise every cell
+ * depending on one of forward comes after it or is in forward; so placing all of backward before all of forward
+ * on the same positions keeps every other dependency in order
+ */
+void SSModel::reorderRegion(const Vector<CellId>& backward, const Vector<CellId>& forward) {
+    vector<pair<long long, CellId>> first;
+    vector<pair<long long, CellId>> second;
+    vector<long long> positions;
+    for (CellId cell : backward) {
+        first.push_back(make_pair(topoOrder[cell], cell));
+        positions.push_back(topoOrder[cell]);
+    }
+    for (CellId cell : forward) {
+        second.push_back(make_pair(topoOrder[cell], cell));
+        positions.push_back(topoOrder[cell]);
+    }
+    sort(first.begin(), first.end());
+    sort(second.begin(), second.end());
+    sort(positions.begin(), positions.end());
+    size_t next = 0;
+    for (size_t i = 0; i < first.size(); i++) {
+        setOrder(first[i].second, positions[next++]);
+    }
+    for (size_t i = 0; i < second.size(); i++) {
+        setOrder(second[i].second, positions[next++]);
+    }
+}
+
+/**
+ * @brief SSModel::moveToEndOfOrder
+ * @param id: spreadsheet cell with a formula, or about to get one
+ */
+void SSModel::moveToEndOfOrder(CellId id) {
+    unordered_map<CellId, long long>::const_iterator it = topoOrder.find(id);
+    if (it != topoOrder.end()) {
+        usedOrders.erase(it->second);
+    }
+    setOrder(id, nextOrder);
+    usedOrders.insert(nextOrder);
+    nextOrder += kOrderGap;
+}
+
+/**
+ * @brief SSModel::setOrder
+ * @param id: spreadsheet cell with a formula, or about to get one
+ * @param position: its new position
+ * Inside a transaction the first position the cell had, or -1 if it had none, is kept in savedOrder
+ */
+void SSModel::setOrder(CellId id, long long position) {
+    if (inTransaction && savedOrder.count(id) == 0) {
+        savedOrder[id] = positionOf(id);
     }
-    startNode->visited = true;
-    for (string neighbor : incomingNeighbors[start]) {
-        Vertex* vertex = graph.getVertex(neighbor);
-        if (!vertex->visited) {
-            if (dfsRecursive(neighbor, end)) {
-                return true;
+    rangeIndex.setPosition(id, position);
+    topoOrder[id] = position;
+}
+
+/**
+ * Described in ssmodel.h
+ */
+long long SSModel::positionOf(CellId id) const {
+    unordered_map<CellId, long long>::const_iterator it = topoOrder.find(id);
+    return (it == topoOrder.end()) ? -1 : it->second;
+}
+
+/**
+ * @brief SSModel::searchDependents
+ * @param start: input cell vertex(i.e. lhs spreadsheet cell)
+ * @param upperBound: latest position a cell may have to be entered
+ * @param precedents: cells the lhs formula reads, placed inside the region searched
+ * @param reached: vertices explored by this cycle check
+ * DFS is done from input cell vertex over the cells which depend on it
+ * Cells still to be explored are kept on an explicit stack, so a long chain of dependencies cannot overflow the call stack
+ * Visited cells are marked in graph for the current traversal only, so the search costs nothing for cells it does not reach
+ * If a cell read by lhs formula can be reached then it returns true which implies cycle will be created in graph
+ */
+bool SSModel::searchDependents(CellId start, long long upperBound, const Vector<CellId>& precedents,
+                               Vector<CellId>& reached) {
+    unordered_set<CellId> precedentSet(precedents.begin(), precedents.end());
+    graph.startTraversal();
+    graph.markVisited(start);
+    vector<CellId> pending(1, start);
+    Vector<CellId> dependentCells;
+    while (!pending.empty()) {
+        CellId node = pending.back();
+        pending.pop_back();
+        if (precedentSet.count(node) > 0) {
+            return true;
+        }
+        reached.add(node);
+        dependentCells.clear();
+        getDependentCells(node, dependentCells);
+        for (CellId neighbor : dependentCells) {
+            if (positionOf(neighbor) <= upperBound && graph.markVisited(neighbor)) {
+                pending.push_back(neighbor);
             }
         }
     }
@@ -244,93 +893,383 @@ bool SSModel::dfsRecursive(const string& start, const string& end) {
 }
 
 /**
- * @brief SSModel::topologicalSort
- * @param startNode: input cellname vertex(i.e. lhs spreadsheet cell)
- * @param topologicalOrder: order in which vertices will be visited when topological sort is done from startNode
- * Same as DFS except that vertex is pushed to stack after all neighboring vertices are processed
+ * @brief SSModel::searchPrecedents
+ * @param precedents: cells to start from
+ * @param lowerBound: position a cell must come after to be entered
+ * @param reached: vertices explored
+ * The cells read through a range and placed after lowerBound come from rangeIndex, so a range costs no more than
+ * the cells found in it
  */
-void SSModel::topologicalSort(Vertex* startNode, Stack<string>& topologicalOrder) {
-    startNode->visited = true;
-    for (Vertex* vertex : graph.getNeighbors(startNode)) {
-        if (!vertex->visited) {
-            topologicalSort(vertex, topologicalOrder);
+void SSModel::searchPrecedents(const Vector<CellId>& precedents, long long lowerBound, Vector<CellId>& reached) {
+    graph.startTraversal();
+    vector<CellId> pending;
+    for (CellId cell : precedents) {
+        if (graph.markVisited(cell)) {
+            pending.push_back(cell);
+        }
+    }
+    Vector<CellId> readCells;
+    while (!pending.empty()) {
+        CellId node = pending.back();
+        pending.pop_back();
+        reached.add(node);
+        readCells.clear();
+        graph.getDependencies(node, readCells);
+        if (rangeNeighbors.containsKey(node)) {
+            for (const range& r : rangeNeighbors[node]) {
+                rangeIndex.getPositionedAfter(r, lowerBound, readCells);
+            }
+        }
+        for (CellId cell : readCells) {
+            if (positionOf(cell) > lowerBound && graph.markVisited(cell)) {
+                pending.push_back(cell);
+            }
         }
     }
-    topologicalOrder.push(startNode->name);
 }
 
 /**
- * Described in ssmodel.h
+ * @brief SSModel::recalculate
+ * @param changedCells: cells whose formula changed
+ * Dirty cells, those due to be evaluated, are kept in a priority queue keyed by their position in topoOrder
+ * It starts with the changed cells, so cells depending on several of them are still evaluated once
+ * The dirty cell with the earliest position is evaluated next, and only if its value changed are the cells which
+ * directly depend on it marked dirty and queued
+ * Every cell a queued cell reads comes earlier in topoOrder, so it is final when the cell is evaluated
+ * Queued cells are marked in graph for the current traversal only
+ * Once the queue holds many cells the rest of the work is handed to recalculateInParallel(), even with a pool of one
+ * thread, since it evaluates runs of cells sharing a formula a column slice at a time
+ * Each cell is a function of the cells it reads only, so both ways give identical values
  */
-double SSModel::getCellData(const string& cellname) const {
-    string cellNameUpper = toUpperCase(cellname);
-    if (spreadsheet.containsKey(cellNameUpper)) {
-        return spreadsheet[cellNameUpper].value;
-    } else {
-        return 0.0;
+void SSModel::recalculate(const Vector<CellId>& changedCells) {
+    priority_queue<pair<long long, CellId>, vector<pair<long long, CellId>>, greater<pair<long long, CellId>>> dirty;
+    rangeTable.startPass();
+    graph.startTraversal();
+    for (CellId id : changedCells) {
+        if (graph.markVisited(id)) {
+            dirty.push(make_pair(topoOrder[id], id));
+        }
+    }
+    Vector<CellId> dependentCells;
+    while (!dirty.empty()) {
+        if ((int) dirty.size() >= kParallelThreshold) {
+            Vector<CellId> dirtyCells;
+            while (!dirty.empty()) {
+                dirtyCells.add(dirty.top().second);
+                dirty.pop();
+            }
+            recalculateInParallel(dirtyCells);
+            return;
+        }
+        CellId node = dirty.top().second;
+        dirty.pop();
+        if (!evaluateCell(node)) continue;
+        dependentCells.clear();
+        getDependentCells(node, dependentCells);
+        for (CellId neighbor : dependentCells) {
+            if (graph.markVisited(neighbor)) {
+                dirty.push(make_pair(topoOrder[neighbor], neighbor));
+            }
+        }
+    }
+}
+
+/**
+ * @brief SSModel::collectAffected
+ * @param changedCells: cells whose formula changed
+ * @param affected: changed cells followed by the cells depending on them, in the order they were reached
+ * @param arcStart: where the dependents of each affected cell start in arcs, plus one final entry
+ * @param arcs: dependents of each affected cell, as indices into affected
+ * Breadth first search over the cells which depend on the changed cells, using affected itself as the queue
+ * A cell reading another one through several ranges has an arc for each
+ */
+void SSModel::collectAffected(const Vector<CellId>& changedCells, vector<CellId>& affected,
+                              vector<int>& arcStart, vector<int>& arcs) {
+    unordered_map<CellId, int> indexOf;
+    for (CellId id : changedCells) {
+        if (indexOf.count(id) == 0) {
+            indexOf[id] = affected.size();
+            affected.push_back(id);
+        }
+    }
+    Vector<CellId> dependentCells;
+    for (size_t i = 0; i < affected.size(); i++) {
+        arcStart.push_back(arcs.size());
+        dependentCells.clear();
+        getDependentCells(affected[i], dependentCells);
+        for (CellId neighbor : dependentCells) {
+            unordered_map<CellId, int>::const_iterator it = indexOf.find(neighbor);
+            if (it == indexOf.end()) {
+                it = indexOf.insert(make_pair(neighbor, (int) affected.size())).first;
+                affected.push_back(neighbor);
+            }
+            arcs.push_back(it->second);
+        }
+    }
+    arcStart.push_back(arcs.size());
+}
+
+/**
+ * @brief SSModel::groupIntoBlocks
+ * @param affected, arcStart, arcs: cells and arcs collected by collectAffected()
+ * @param mergeRuns: whether runs of cells sharing a formula are made into one block
+ * @param blocks: filled with the blocks and the arcs between them
+ * Cells are visited in column-major order, so a run down a column comes out consecutively
+ * A cell joins the block before it if it is the next row of the same column and holds the same Formula, one that
+ * reads no cell of its own column, so no cell of a run reads another
+ * Blocks may still depend on each other in a cycle, e.g. B1 = A1 + 1 and B2 = A2 + 1 sharing a formula with A2 = B1
+ * That is detected by counting off the blocks in topological order, and the caller then uses single cells instead
+ */
+bool SSModel::groupIntoBlocks(const vector<CellId>& affected, const vector<int>& arcStart, const vector<int>& arcs,
+                              bool mergeRuns, BlockGraph& blocks) {
+    int n = affected.size();
+    vector<pair<CellId, int>> order(n);
+    for (int i = 0; i < n; i++) {
+        order[i] = make_pair(affected[i], i);
+    }
+    if (mergeRuns) {
+        sort(order.begin(), order.end());
+    }
+    vector<int> blockOf(n);
+    blocks.cells.clear();
+    blocks.blockStart.clear();
+    Formula* runFormula = NULL;
+    for (int k = 0; k < n; k++) {
+        CellId id = order[k].first;
+        Formula* formula = cells.getFormula(id);
+        bool joins = mergeRuns && k > 0 && formula == runFormula && formula->canRunOnColumn()
+                && cellIdCol(id) == cellIdCol(order[k - 1].first)
+                && cellIdRow(id) == cellIdRow(order[k - 1].first) + 1;
+        if (!joins) {
+            blocks.blockStart.push_back(k);
+        }
+        runFormula = formula;
+        blockOf[order[k].second] = blocks.blockStart.size() - 1;
+        blocks.cells.push_back(order[k].second);
+    }
+    int nBlocks = blocks.blockStart.size();
+    blocks.blockStart.push_back(n);
+    blocks.arcStart.clear();
+    blocks.arcs.clear();
+    vector<int> waiting(nBlocks, 0);
+    vector<int> lastSource(nBlocks, -1);
+    for (int b = 0; b < nBlocks; b++) {
+        blocks.arcStart.push_back(blocks.arcs.size());
+        for (int k = blocks.blockStart[b]; k < blocks.blockStart[b + 1]; k++) {
+            int i = blocks.cells[k];
+            for (int a = arcStart[i]; a < arcStart[i + 1]; a++) {
+                int target = blockOf[arcs[a]];
+                if (target == b) return false;
+                if (lastSource[target] != b) {
+                    lastSource[target] = b;
+                    blocks.arcs.push_back(target);
+                    waiting[target]++;
+                }
+            }
+        }
+    }
+    blocks.arcStart.push_back(blocks.arcs.size());
+    vector<int> ready;
+    for (int b = 0; b < nBlocks; b++) {
+        if (waiting[b] == 0) ready.push_back(b);
+    }
+    int counted = 0;
+    while (!ready.empty()) {
+        int b = ready.back();
+        ready.pop_back();
+        counted++;
+        for (int a = blocks.arcStart[b]; a < blocks.arcStart[b + 1]; a++) {
+            if (--waiting[blocks.arcs[a]] == 0) ready.push_back(blocks.arcs[a]);
+        }
+    }
+    return counted == nBlocks;
+}
+
+/**
+ * @brief SSModel::recalculateInParallel
+ * @param dirtyCells: cells due to be evaluated, none of them depending on a cell evaluated later
+ * Each block waits for one count per block it reads
+ * Blocks waiting for nothing are handed to pool first; a block finishing counts down its dependents and hands over
+ * those reaching zero, which pool keeps on the same worker unless another worker runs out of work and steals them
+ * A finishing block whose value changed marks its dependents dirty before counting them down, so a block reaching
+ * zero knows whether any block it reads changed; if none did it is skipped but still counts down its dependents
+ */
+void SSModel::recalculateInParallel(const Vector<CellId>& dirtyCells) {
+    rangeTable.startPass();
+    vector<CellId> affected;
+    vector<int> arcStart;
+    vector<int> arcs;
+    collectAffected(dirtyCells, affected, arcStart, arcs);
+    BlockGraph blocks;
+    if (!groupIntoBlocks(affected, arcStart, arcs, true, blocks)) {
+        groupIntoBlocks(affected, arcStart, arcs, false, blocks);
+    }
+    int nBlocks = blocks.blockStart.size() - 1;
+    vector<atomic<int>> waiting(nBlocks);
+    vector<atomic<bool>> dirty(nBlocks);
+    vector<char> evaluated(nBlocks, false);
+    for (int b = 0; b < nBlocks; b++) {
+        waiting[b].store(0, memory_order_relaxed);
+        dirty[b].store(false, memory_order_relaxed);
+        for (int k = blocks.blockStart[b]; k < blocks.blockStart[b + 1]; k++) {
+            if (blocks.cells[k] < dirtyCells.size()) dirty[b].store(true, memory_order_relaxed);
+        }
+    }
+    for (size_t a = 0; a < blocks.arcs.size(); a++) {
+        waiting[blocks.arcs[a]].fetch_add(1, memory_order_relaxed);
+    }
+    vector<int> roots;
+    for (int b = 0; b < nBlocks; b++) {
+        if (waiting[b].load(memory_order_relaxed) == 0) roots.push_back(b);
+    }
+    pool.run(roots, [&](int task, vector<int>& ready) {
+        bool changed = false;
+        if (dirty[task].load(memory_order_relaxed)) {
+            CellId first = affected[blocks.cells[blocks.blockStart[task]]];
+            int count = blocks.blockStart[task + 1] - blocks.blockStart[task];
+            changed = (count == 1) ? computeCell(first) : computeBlock(first, count);
+            evaluated[task] = true;
+        }
+        for (int a = blocks.arcStart[task]; a < blocks.arcStart[task + 1]; a++) {
+            if (changed) {
+                dirty[blocks.arcs[a]].store(true, memory_order_relaxed);
+            }
+            if (waiting[blocks.arcs[a]].fetch_sub(1, memory_order_acq_rel) == 1) {
+                ready.push_back(blocks.arcs[a]);
+            }
+        }
+    });
+    for (int b = 0; b < nBlocks; b++) {
+        if (!evaluated[b]) continue;
+        for (int k = blocks.blockStart[b]; k < blocks.blockStart[b + 1]; k++) {
+            CellId id = affected[blocks.cells[k]];
+            view->displayCell(id, getDisplayValue(id));
+        }
     }
 }
 
 /**
  * Described in ssmodel.h
  */
-double SSModel::applyRangeFunction(const string rangeFunctionName, const string startCellLocation, const string endCellLocation) {
-    Vector<double> cellValues;
-    collectCellValues(cellValues, startCellLocation, endCellLocation);
-    return fnTable[toLowerCase(rangeFunctionName)](cellValues);
+double SSModel::getCellData(const string& cellname) {
+    return getCellData(cellId(cellname));
 }
 
 /**
  * Described in ssmodel.h
  */
-void SSModel::collectCellValues(Vector<double>& cellValues, const string startCellLocation, const string endCellLocation) {
-    Vector<string> cellRefs;
-    collectCellRef(cellRefs, startCellLocation, endCellLocation);
-    for (string key : cellRefs) {
-        cellValues.add(getCellData(key));
-    }
+double SSModel::getCellData(CellId id) {
+    refreshCell(id);
+    return cells.getValue(id);
 }
 
 /**
  * Described in ssmodel.h
  */
-void SSModel::collectCellRef(Vector<string>& cellRefs, const string startCellLocation, const string endCellLocation) {
-    if (validRange(startCellLocation, endCellLocation)) {
-        location startLoc;
-        stringToLocation(startCellLocation, startLoc);
-        location endLoc;
-        stringToLocation(endCellLocation, endLoc);
-        location loc;
-        for (char c = startLoc.col; c <= endLoc.col; c++) {
-            for (int r = startLoc.row; r <= endLoc.row; r++) {
-                loc.col = c;
-                loc.row = r;
-                string cellKey = locationToString(loc);
-                cellRefs.add(cellKey);
-            }
+const double* SSModel::bindCell(CellId id) {
+    return cells.getValueSlot(id);
+}
+
+/**
+ * Described in ssmodel.h
+ */
+double SSModel::cellValue(CellId id) const {
+    return cells.getValue(id);
+}
+
+/**
+ * Described in ssmodel.h
+ */
+void SSModel::columnValues(CellId id, int count, double* values) const {
+    cells.getColumnValues(id, count, values);
+}
+
+/**
+ * Described in ssmodel.h
+ */
+double SSModel::applyRangeFunction(RangeFnId fn, CellId startCell, CellId endCell, double parameter, RangeKind kind) {
+    if (kind != BOUNDED_RANGE && !cells.occupiedExtent(startCell, endCell)) {
+        endCell = startCell;
+    }
+    if (isSummaryFunction(fn)) {
+        RangeSummary summary;
+        clearSummary(summary);
+        cells.summarize(summary, startCell, endCell);
+        return summaryValue(fn, summary);
+    }
+    vector<double> cellValues;
+    long empty = cells.collectValues(cellValues, startCell, endCell);
+    return orderStatistic(fn, cellValues, empty, parameter);
+}
+
+/**
+ * @brief SSModel::aggregateValue
+ * @param aggregate: entry of the range table
+ * An entry already checked in the current pass is used as it is, since no cell of its range changes later in a pass
+ * Otherwise the versions of the range are compared with the ones recorded with the value, the column versions first,
+ * which cost one load per column, then the chunk versions, which cost one per chunk; the value is computed again
+ * only if a chunk of the range changed, and a write to a chunk outside the range costs nothing
+ * The versions are read before the value is computed, so a cell changed meanwhile shows up in the next check
+ * Threads evaluating the same call at once each compute it and store the same value, which is cheaper than making
+ * them wait for one another
+ * The value is stored before the versions and the pass, so a thread that finds either matching also sees the value
+ */
+double SSModel::aggregateValue(RangeAggregate& aggregate) {
+    unsigned long pass = rangeTable.currentPass();
+    if (aggregate.pass.load(memory_order_acquire) == pass) {
+        return aggregate.value.load(memory_order_relaxed);
+    }
+    unsigned long columnVersion = cells.columnVersion(aggregate.startCell, aggregate.endCell);
+    if (aggregate.columnVersion.load(memory_order_acquire) != columnVersion) {
+        unsigned long rangeVersion = cells.rangeVersion(aggregate.startCell, aggregate.endCell);
+        if (aggregate.rangeVersion.load(memory_order_acquire) != rangeVersion) {
+            aggregate.value.store(applyRangeFunction(aggregate.fn, aggregate.startCell, aggregate.endCell,
+                                                     aggregate.parameter, aggregate.kind), memory_order_relaxed);
+            aggregate.rangeVersion.store(rangeVersion, memory_order_release);
         }
+        aggregate.columnVersion.store(columnVersion, memory_order_release);
     }
+    aggregate.pass.store(pass, memory_order_release);
+    return aggregate.value.load(memory_order_relaxed);
 }
 
 /**
  * @brief SSModel::printCellInformation
  * @param cellname: input cellname for which information needs to be retrieved
  * If cellname key doesnot exist in map, then cell is empty, else
- * numeric value is retrieved from spreadsheet map
- * Cells on which cellname directly depends is retrieved from incomingNeighbors map
- * Cells which directly depends on cellname is retrieved by getting adjacent neighboring vertices of cellname from graph
+ * numeric value is retrieved from the cell store
+ * Cells on which cellname directly depends is retrieved from graph, followed by the ranges it reads, whole columns
+ * and rows printed as A:A and 3:3 as in the formula
+ * Cells which directly depends on cellname is retrieved by getDependentCells()
  */
 void SSModel::printCellInformation(const string& cellname) {
-    string key = toUpperCase(cellname);
-    if (spreadsheet.containsKey(key)) {
-        cout << key << " = " << spreadsheet[key].exp->toString() << endl;
+    CellId id = cellId(cellname);
+    string key = cellIdToString(id);
+    refreshCell(id);
+    if (cells.contains(id)) {
+        cout << key << " = " << cells.getFormula(id)->toString(id) << endl;
         string incoming = "";
         string outgoing = "";
-        for (string neighbor : incomingNeighbors[key]) {
-            incoming += neighbor + " ";
+        Vector<CellId> dependencies;
+        graph.getDependencies(id, dependencies);
+        Set<CellId> precedents;
+        for (CellId neighbor : dependencies) {
+            precedents.add(neighbor);
         }
-        for (Vertex* v : graph.getNeighbors(key)) {
-            outgoing += v->name + " ";
+        for (CellId neighbor : precedents) {
+            incoming += cellIdToString(neighbor) + " ";
+        }
+        for (const range& r : rangeNeighbors[id]) {
+            incoming += rangeToString(r.startCell, r.stopCell, r.kind) + " ";
+        }
+        Vector<CellId> dependentCells;
+        getDependentCells(id, dependentCells);
+        Set<CellId> dependentSet;
+        for (CellId neighbor : dependentCells) {
+            dependentSet.add(neighbor);
+        }
+        for (CellId neighbor : dependentSet) {
+            outgoing += cellIdToString(neighbor) + " ";
         }
         trimInPlace(incoming);
         trimInPlace(outgoing);
@@ -344,61 +1283,279 @@ void SSModel::printCellInformation(const string& cellname) {
 /**
  * @brief SSModel::writeToStream
  * @param outfile
- * writes cached value of expression in spreadsheet map to outfile stream
+ * writes cached expression of every occupied cell in the cell store to outfile stream
+ * Cells are written column by column
+ * A run of cells down a column sharing one Formula is written as a single line for the whole run
  */
 void SSModel::writeToStream(ostream& outfile) const {
-    for (string cellname : spreadsheet) {
-        string line = cellname + " = " + spreadsheet[cellname].exp->toString();
+    Vector<CellId> ids;
+    cells.getCells(ids);
+    int i = 0;
+    while (i < ids.size()) {
+        CellId first = ids[i];
+        Formula* formula = cells.getFormula(first);
+        int n = 1;
+        while (i + n < ids.size() && ids[i + n] == first + n && cells.getFormula(ids[i + n]) == formula) {
+            n++;
+        }
+        string line = cellIdToString(first);
+        if (n > 1) {
+            line += ":" + cellIdToString(ids[i + n - 1]);
+        }
+        line += " = " + formula->toString(first);
         outfile << line << endl;
+        i += n;
     }
 }
 
 /**
  * @brief SSModel::readFromStream
  * @param infile
- * reads each line from file in token scanner and passes it to setLinesFromFile() for processing
+ * reads each line from file and passes it to setLinesFromFile() for processing
+ * All lines are stored inside one transaction, so a malformed line or a cycle rolls back the whole file
+ * Once the graph is complete, findComponents() finds every cycle in one pass and the order to evaluate the cells in
+ * The cells reached from the loaded cells are moved, in that order, to the end of topoOrder and evaluated once each,
+ * by recalculateInParallel() if there are many of them
+ * In lazy mode they are marked stale instead, and only the visible ones evaluated
  * Details in ssmodel.h
  */
 void SSModel::readFromStream(istream& infile) {
     Vector<string> lines;
-    TokenScanner scanner;
-    scanner.ignoreWhitespace();
-    scanner.scanNumbers();
-    scanner.scanStrings();
     readEntireFile(infile, lines);
-    for (string line : lines) {
-        scanner.setInput(line);
-        setLinesFromFile(scanner);
+    beginTransaction();
+    Vector<CellId> order;
+    Vector<Vector<CellId>> cycles;
+    try {
+        for (const string& line : lines) {
+            setLinesFromFile(line);
+        }
+        findComponents(editedCells, order, cycles);
+    } catch (ErrorException&) {
+        rollbackTransaction();
+        throw;
+    }
+    if (!cycles.isEmpty()) {
+        rollbackTransaction();
+        string message = "Invalid action: Cell formulas would introduce cycles:";
+        for (int i = 0; i < cycles.size(); i++) {
+            message += (i == 0) ? " " : "; ";
+            for (int j = 0; j < cycles[i].size(); j++) {
+                message += (j == 0 ? "" : " ") + cellIdToString(cycles[i][j]);
+            }
+        }
+        error(message + ".");
+    }
+    forgetSavedCells();
+    for (CellId id : order) {
+        moveToEndOfOrder(id);
+    }
+    if (lazyEvaluation) {
+        markStale(order);
+        refreshVisibleCells();
+        return;
+    }
+    if (order.size() >= kParallelThreshold) {
+        recalculateInParallel(order);
+        return;
+    }
+    rangeTable.startPass();
+    for (CellId id : order) {
+        evaluateCell(id);
     }
 }
 
 /**
  * @brief SSModel::setLinesFromFile
- * @param scanner
- * Processes expression by using setCellFromScanner() method
+ * @param line: line of the file
+ * Reads the line with a FormulaLexer, so the cell names and the formula are scanned without copying them
+ * Parses expression by calling parseExp(), optimizes it by calling optimizeExp() and stores it by calling
+ * storeExpression()
  * Details in ssmodel.h
  */
-void SSModel::setLinesFromFile(TokenScanner& scanner) {
-    if (!scanner.hasMoreTokens())
+CellId SSModel::setLinesFromFile(const string& line) {
+    FormulaLexer lexer(line);
+    if (!lexer.hasMoreTokens())
         error("The set command requires a cell name and a value.");
-    string cellname = scanner.nextToken();
-    if (!nameIsValid(cellname))
-        error("Invalid cell name " + cellname);
-    if (scanner.nextToken() != "=")
+    FormulaToken cellname = lexer.nextToken();
+    CellId id;
+    if (!stringToCellId(cellname.text.data(), cellname.text.length(), id) || !cellIdIsValid(id))
+        error("Invalid cell name " + cellname.toString());
+    CellId lastId = id;
+    FormulaToken token = lexer.nextToken();
+    if (token.is(':')) {
+        FormulaToken lastname = lexer.nextToken();
+        if (!stringToCellId(lastname.text.data(), lastname.text.length(), lastId) || !cellIdIsValid(lastId))
+            error("Invalid cell name " + lastname.toString());
+        if (cellIdCol(lastId) != cellIdCol(id) || cellIdRow(lastId) < cellIdRow(id))
+            error("Invalid run of cells " + cellname.toString() + ":" + lastname.toString());
+        token = lexer.nextToken();
+    }
+    if (!token.is('='))
         error("= expected.");
-    setCellFromScanner(cellname, scanner);
+    ExpArena* arena = new ExpArena;
+    Expression* exp;
+    Vector<CellId> dependents;
+    Vector<range> rangeDependents;
+    int runLength = cellIdRow(lastId) - cellIdRow(id);
+    try {
+        exp = optimizeExp(parseExp(lexer, this, *arena), *arena);
+        exp->getDependent(dependents, rangeDependents);
+        for (CellId dep : dependents) {
+            if (cellIdRow(dep) + runLength >= totalRows)
+                error("Formula of " + cellname.toString() + " refers below the sheet when filled down");
+        }
+        for (const range& r : rangeDependents) {
+            if (r.kind != COLUMN_RANGE && cellIdRow(r.stopCell) + runLength >= totalRows)
+                error("Formula of " + cellname.toString() + " refers below the sheet when filled down");
+        }
+    } catch (ErrorException&) {
+        delete arena;
+        throw;
+    }
+    storeExpression(id, exp, arena, dependents, rangeDependents);
+    Formula* formula = cells.getFormula(id);
+    for (int offset = 1; offset <= runLength; offset++) {
+        Vector<CellId> movedDependents;
+        Vector<range> movedRanges;
+        for (CellId dep : dependents) {
+            movedDependents.add(shiftCellId(dep, offset, 0));
+        }
+        for (range r : rangeDependents) {
+            r.startCell = shiftRangeCorner(r.startCell, r.kind, offset, 0);
+            r.stopCell = shiftRangeCorner(r.stopCell, r.kind, offset, 0);
+            movedRanges.add(r);
+        }
+        setFormula(shiftCellId(id, offset, 0), formula, movedDependents, movedRanges);
+    }
+    return id;
+}
+
+/**
+ * @brief SSModel::findComponents
+ * @param loadedCells: cells stored by the load
+ * @param order: cells reached which are not part of a cycle, in topological order
+ * @param cycles: cells of each cycle found, sorted
+ * Tarjan's algorithm numbers cells in the order they are first visited and tracks the lowest number reachable from each
+ * A cell whose lowest reachable number is its own closes a component, made of the cells above it on the component stack
+ * Components are closed only after every component reachable from them, so reversing them gives topological order
+ * Instead of recursion, each cell being explored has a frame on an explicit stack, with its dependents kept on a
+ * shared stack of arcs for as long as the frame is open
+ */
+void SSModel::findComponents(const Vector<CellId>& loadedCells, Vector<CellId>& order, Vector<Vector<CellId>>& cycles) {
+    struct TarjanState { int index; int lowlink; bool onStack; bool readsItself; };
+    struct Frame { CellId cell; int firstArc; int nextArc; int endArc; };
+    unordered_map<CellId, TarjanState> state;
+    vector<Frame> frames;
+    vector<CellId> arcs;
+    vector<CellId> componentStack;
+    vector<CellId> reverseOrder;
+    Vector<CellId> dependentCells;
+    int counter = 0;
+    for (CellId root : loadedCells) {
+        if (state.count(root) > 0) continue;
+        CellId next = root;
+        bool visitNext = true;
+        while (true) {
+            if (visitNext) {
+                TarjanState& s = state[next];
+                s.index = s.lowlink = counter++;
+                s.onStack = true;
+                s.readsItself = false;
+                componentStack.push_back(next);
+                Frame frame;
+                frame.cell = next;
+                frame.firstArc = frame.nextArc = arcs.size();
+                dependentCells.clear();
+                getDependentCells(next, dependentCells);
+                for (CellId neighbor : dependentCells) {
+                    arcs.push_back(neighbor);
+                }
+                frame.endArc = arcs.size();
+                frames.push_back(frame);
+                visitNext = false;
+            }
+            Frame& frame = frames.back();
+            if (frame.nextArc < frame.endArc) {
+                CellId neighbor = arcs[frame.nextArc++];
+                unordered_map<CellId, TarjanState>::iterator it = state.find(neighbor);
+                if (it == state.end()) {
+                    next = neighbor;
+                    visitNext = true;
+                } else if (it->second.onStack) {
+                    TarjanState& s = state[frame.cell];
+                    s.lowlink = min(s.lowlink, it->second.index);
+                    if (neighbor == frame.cell) s.readsItself = true;
+                }
+                continue;
+            }
+            CellId cell = frame.cell;
+            arcs.resize(frame.firstArc);
+            frames.pop_back();
+            TarjanState& s = state[cell];
+            if (!frames.empty()) {
+                TarjanState& parent = state[frames.back().cell];
+                parent.lowlink = min(parent.lowlink, s.lowlink);
+            }
+            if (s.lowlink == s.index) {
+                vector<CellId> component;
+                CellId member;
+                do {
+                    member = componentStack.back();
+                    componentStack.pop_back();
+                    state[member].onStack = false;
+                    component.push_back(member);
+                } while (member != cell);
+                if (component.size() > 1 || s.readsItself) {
+                    sort(component.begin(), component.end());
+                    Vector<CellId> cycle;
+                    for (CellId cycleCell : component) {
+                        cycle.add(cycleCell);
+                    }
+                    cycles.add(cycle);
+                } else {
+                    reverseOrder.push_back(cell);
+                }
+            }
+            if (frames.empty()) break;
+        }
+    }
+    for (int i = reverseOrder.size() - 1; i >= 0; i--) {
+        order.add(reverseOrder[i]);
+    }
 }
 
 /**
  * @brief SSModel::clear
  * Displays empty spreadsheet
- * Clears spreadsheet map
- * Clears incomingNeighbors map
- * Clears dependency graph
+ * Clears cell store
+ * Releases every formula, ending any transaction in progress
+ * Forgets stale cells
+ * Clears rangeNeighbors map and rangeIndex
+ * Clears dependency graph and its topological order
  */
 void SSModel::clear() {
     view->displayEmptySpreadsheet();
     graph.clear();
-    incomingNeighbors.clear();
-    spreadsheet.clear();
+    rangeNeighbors.clear();
+    rangeIndex.clear();
+    topoOrder.clear();
+    usedOrders.clear();
+    nextOrder = kFirstOrder;
+    frontOrder = kFirstOrder - kOrderGap;
+    staleCells.clear();
+    forgetSavedCells();
+    releaseFormulas();
+    cells.clear();
+}
+
+/**
+ * @brief SSModel::releaseFormulas
+ * Releases the formula of every cell in the cell store, freeing each one with its last cell
+ */
+void SSModel::releaseFormulas() {
+    Vector<CellId> ids;
+    cells.getCells(ids);
+    for (CellId id : ids) {
+        releaseFormula(cells.getFormula(id), id);
+    }
 }
@@ -17,11 +17,20 @@
 #define _ssmodel_
 
 #include <fstream>
-#include "tokenscanner.h"
+#include <unordered_map>
+#include <unordered_set>
+#include <string_view>
 #include "ssview.h"
 #include "ssutil.h"
 #include "map.h"
-#include "basicgraph.h"
+#include "set.h"
+#include "cellstore.h"
+#include "rangeindex.h"
+#include "depgraph.h"
+#include "bytecode.h"
+#include "formula.h"
+#include "rangetable.h"
+#include "threadpool.h"
 using namespace std;
 
 /**
@@ -32,20 +41,7 @@ using namespace std;
  */
 
 class Expression;
-
-/**
- * The celldata struct used to represent and store data(cache data) corresponding to valid cell in spreadsheet
- * Values Stored: (1): Expression* cellExpression, expression generated for spreadsheet cell from input equation
- *                (2): string displayValue: Value to be displayed on spreadsheet, evaluated value for a cell or string if it is string
- *                (3): double value: actual numeric value of a cell, 0.0 in case of string or empty cell, else evaluated expression value
- * Expression is stored so when parent cell changes its value, dependent cells can recalculate its expression value and cache them
- */
-
-struct celldata {
-    Expression* exp;
-    string displayValue;
-    double value;
-} ;
+class ExpArena;
 
 /**
  * Class: SSModel
@@ -91,6 +87,16 @@ public:
 
     bool nameIsValid(const std::string& name) const;
 
+/**
+ * Member function: cellIdIsValid
+ * Usage: if (model.cellIdIsValid(id))...
+ * ------------------------------------------
+ * This member function returns true if id refers to a cell location
+ * within bounds for this model, false otherwise.
+ */
+
+    bool cellIdIsValid(CellId id) const;
+
 /**
  * Member function: rangeFnIsValid
  * Usage: if (model.rangeFnIsValid(name))...
@@ -102,30 +108,110 @@ public:
 
     bool rangeFnIsValid(const std::string& name) const;
 
+/**
+ * Member function: getRangeFnId
+ * Usage: RangeFnId fn = model.getRangeFnId(name);
+ * ------------------------------------------
+ * This member function returns the id of the range function with the given valid name
+ * Used by parser.cpp so that range expressions carry a resolved function id
+ */
+
+    RangeFnId getRangeFnId(const std::string& name) const;
+
 /**
  * Member function: validRange
- * Usage: if (model.validRange(startCellRefName, endCellRefName))...
+ * Usage: if (model.validRange(startCell, endCell))...
  * ------------------------------------------
  * This member function returns true if range from start cell to end cell is a valid range
  * A range is valid if end row and column is at least equal to start row and column
  */
 
-    bool validRange(const std::string& startCellName, const std::string& endCellName) const;
+    bool validRange(CellId startCell, CellId endCell) const;
+
+/**
+ * Member function: openRange
+ * Usage: range r = model.openRange(COLUMN_RANGE, 0, 2);
+ * ------------------------------------------
+ * This member function returns the rectangle of the whole columns (COLUMN_RANGE) or whole rows (ROW_RANGE) numbered
+ * first to last, which runs over every row, row 0 included, or across every column of the spreadsheet
+ * Used by parser.cpp for range references such as A:C and 3:5
+ */
+
+    range openRange(RangeKind kind, int first, int last) const;
 
  /**
-  * Member function: setCellFromScanner
-  * Usage: model.setCellFromScanner("A1", scanner);
-  * -----------------------------------------------
-  * This member function reads an expression from the scanner and
+  * Member function: setCellFromText
+  * Usage: model.setCellFromText("A1", "sum(B1:B9) + 1");
+  * -----------------------------------------------------
+  * This member function reads an expression from the text, which is
+  * scanned in place rather than copied, and
   * stores it as the the contents for the named cell.  If there is
   * any problem with setting the cell's value (the expression is
   * malformed, contains a circular reference, etc.) error is called
   * and the cell's contents are unchanged.  If the contents were
   * successfully updated, the new cell is displayed in the view
   * and its dependent cells are updated as well.
+  * Inside a transaction the cell is only recorded, see beginTransaction,
+  * and an error rolls back the whole transaction before it is reported.
+  * The transaction is then over: its earlier edits are undone, the message
+  * says the transaction was rolled back, and the caller must not commit it.
   */
 	
-    void setCellFromScanner(const std::string& cellname, TokenScanner& scanner);
+    void setCellFromText(const std::string& cellname, std::string_view text);
+
+/**
+ * Member functions: beginTransaction, commitTransaction, rollbackTransaction
+ * Usage: model.beginTransaction();
+ *        model.setCellFromText("A1", text1);
+ *        model.setCellFromText("A2", text2);
+ *        model.commitTransaction();
+ * -----------------------------------------------
+ * Groups a batch of edits.  Between begin and commit, setCellFromText
+ * checks and records each formula, keeping the dependency graph up to date,
+ * but evaluates nothing: cells keep showing their old values.  Each formula
+ * is checked for cycles against the cells set before it in the batch.
+ * commitTransaction then evaluates every edited cell and every cell that
+ * depends on them in a single pass in topological order, so a cell shared
+ * by many edits is evaluated once.  If any formula in the batch is
+ * malformed or cyclic, the whole batch is rolled back, the transaction is
+ * ended and error is called with a message saying so; commitTransaction
+ * must not be called after that.  rollbackTransaction does the same on
+ * request.  Transactions do not nest.
+ */
+
+    void beginTransaction();
+    void commitTransaction();
+    void rollbackTransaction();
+
+/**
+ * Member functions: setLazyEvaluation, isLazyEvaluation
+ * Usage: model.setLazyEvaluation(true);
+ * -------------------------------------
+ * Switches between eager evaluation, the default, and lazy evaluation.
+ * In lazy mode an edit only marks the edited cells and every cell
+ * depending on them as stale.  A stale cell is evaluated when its value is
+ * needed: by getCellData, by printCellInformation, or because it lies in
+ * the visible range of the view.  The value is then kept until one of the
+ * cells it depends on changes again.  Saving writes formulas only, so it
+ * needs no values.  Switching back to eager mode evaluates every stale
+ * cell.
+ */
+
+    void setLazyEvaluation(bool lazy);
+    bool isLazyEvaluation() const;
+
+/**
+ * Member function: setVisibleRange
+ * Usage: model.setVisibleRange(startCell, endCell);
+ * -------------------------------------------------
+ * Tells the model which cells the view currently shows.  In lazy mode these
+ * cells are kept up to date after every edit, and cells outside them are
+ * left stale until read.  Initially the range covers the first
+ * kNumRowsDisplayed rows and kNumColsDisplayed columns; the controller
+ * sets it from SSView::getVisibleRange.
+ */
+
+    void setVisibleRange(CellId startCell, CellId endCell);
 
 /**
  * Member function: printCellInformation
@@ -134,6 +220,7 @@ public:
  * This member function prints the cell information for the named
  * cell to cout.  Cell information includes its current contents
  * and dependencies (and other information you choose to include).
+ * In lazy mode the cell is brought up to date first.
  */
 
     void printCellInformation(const std::string& cellname);
@@ -141,33 +228,75 @@ public:
 /**
  * Member function: getCellData()
  * Usage: model.getCellData("A1");
+ *        model.getCellData(id);
  * ----------------------------------------
  * This member function returns numeric value to a corresponding valid spreadsheet cell
  * If cell is empty or contains string, value returned is 0.0 else cached numeric value is returned
+ * In lazy mode a stale cell is evaluated first, along with the stale cells it depends on
+ */
+
+    double getCellData(const string& cellname);
+    double getCellData(CellId id);
+
+/**
+ * Member function: bindCell
+ * Usage: const double* slot = model.bindCell(id);
+ * ----------------------------------------
+ * This member function returns the address where the numeric value of the cell is kept
+ * Used by parser.cpp so that cell references in a formula read their value with a single load
+ * The slot stays valid while the cell is set or emptied, until the model is cleared
+ */
+
+    const double* bindCell(CellId id);
+
+/**
+ * Member function: cellValue
+ * Usage: double value = model.cellValue(id);
+ * ----------------------------------------
+ * This member function returns the numeric value cached for the cell, 0.0 if it is empty, without bringing it up to date
+ * Used by bytecode.cpp for the references of a shared formula, which are moved to each cell using it and so cannot be bound
+ */
+
+    double cellValue(CellId id) const;
+
+/**
+ * Member function: columnValues
+ * Usage: model.columnValues(id, count, values);
+ * ----------------------------------------
+ * Copies the values cached for the count cells from id down its column into values, like cellValue
+ * Used by bytecode.cpp to load a column slice when a formula is evaluated for a run of cells at once
  */
 
-    double getCellData(const string& cellname) const;
+    void columnValues(CellId id, int count, double* values) const;
 
 /**
  * Member function: applyRangeFunction
- * Usage: model.applyRangeFunction(sum, "A1", "D4");
+ * Usage: model.applyRangeFunction(FN_SUM, startCell, endCell, 0, BOUNDED_RANGE);
  * ----------------------------------------
  * This member function applies input range function to cells ranging from start to end spreadsheet cell.
  * After applying range function, the result of that is returned to the caller function.
+ * parameter is the number following the range for percentile and quartile, and is ignored otherwise.
+ * A whole-column or whole-row range, as given by kind, is evaluated over its populated extent only: the smallest
+ * rectangle holding all its occupied cells, or a single empty cell if it has none.
+ * An empty cell counts as a value of 0.0 for every function: it adds nothing to sum, makes product 0,
+ * and counts towards average, stdev, min, max and the order statistics.  Only occupied cells are read:
+ * median, percentile and quartile select over a copy of their values with the empty cells counted
+ * as zeros, and every other function is computed from a summary of the range taken straight from the
+ * cell store, in which an unallocated chunk costs no more than a single cell.
  */
 
-    double applyRangeFunction(const string rangeFunctionName, const string startCellLocation, const string endCellLocation);
+    double applyRangeFunction(RangeFnId fn, CellId startCell, CellId endCell, double parameter, RangeKind kind);
 
 /**
- * Member function: collectCellRef
- * Usage: model.collectCellRef(cellReferencesVector, "A1", "D4");
+ * Member function: aggregateValue
+ * Usage: double value = model.aggregateValue(aggregate);
  * ----------------------------------------
- * This member function iterates through spreadsheet map(spreadsheet model) and
- * collects all references ranging from start cell to end cell.
- * The range of cells from start to end is returned as a vector of string representing cell names.
+ * Returns the value of a range function call shared through the model's range table, calling applyRangeFunction()
+ * only the first time the call is needed in the current evaluation pass
+ * Used by bytecode.cpp, possibly from several threads at once
  */
 
-    void collectCellRef(Vector<string>& cellRefs, const string startCellLocation, const string endCellLocation);
+    double aggregateValue(RangeAggregate& aggregate);
 
 /**
  * Member functions: writeToStream, readFromStream
@@ -181,9 +310,20 @@ public:
  *      A1 = 3
  *      A2 = 4 * (A1 + 8)
  *      A3 = "a string"
+ *      B2:B100 = (A2 * 1.1)
  *
+ * A line naming a run of cells down one column gives the formula of its
+ * first cell; each cell below holds the same formula with its references
+ * moved down as far as the cell is, as if filled down.  writeToStream
+ * writes every run of cells sharing a formula this way.
  * error is called if there is any trouble reading/writing
  * the file.
+ * readFromStream loads the whole file as one batch: every line is parsed
+ * and added to the dependency graph first, then all cycles are found in a
+ * single pass and every cell is evaluated exactly once, in topological
+ * order.  If a line is malformed, or the formulas form cycles, error is
+ * called and the model is left unchanged; every cycle is reported in the
+ * same message.
  */
 
     void writeToStream(std::ostream &outfile) const;
@@ -194,7 +334,7 @@ public:
  * Usage: model.clear();
  * ----------------------------------------
  * Resets and clears spreadsheet model.
- * Clears the spreadsheet map as well as the dependency graphs associated with spreadsheet
+ * Clears the cell store as well as the dependency graphs associated with spreadsheet
  * ssview is called to display empty spreadsheet
  */
 
@@ -206,15 +346,19 @@ public:
 private:
 
 /**
- * Map<string cellName, celldata cellData> spreadsheet;
- * Mappings: "A1" => {Expression* exp, string displayValue, double numericValue}
- * spreadsheet model is represented as a map so cells are created on demand
- * Keys are strings representing valid cell names in uppercase
- * Key values are stored as celldata struct to cache calculated expression, expression value and display value to be displayed on spreadsheet
- * If a cell name is valid but is not present as a key in map, that represents empty cell
+ * CellStore cells: backing store for the contents of every spreadsheet cell
+ * Cells are addressed by CellId, see cellId() below
+ * For each occupied cell the store caches:
+ *                (1): Formula* formula, the expression generated from input equation together with its bytecode,
+ *                     shared by every cell holding the same formula relative to its position, see formulaTable
+ *                (2): double value: actual numeric value of a cell, 0.0 in case of string or empty cell, else evaluated expression value
+ * Program is stored so when parent cell changes its value, dependent cells can recalculate its expression value and cache them
+ * Expression is kept for printing and saving the formula
+ * The value to be displayed is made from the formula and value when the cell is displayed, see getDisplayValue()
+ * A cell that is not occupied in the store represents an empty cell
  */
 
-    Map<string, celldata> spreadsheet;
+    CellStore cells;
 
 /**
  * totalRows: total number of rows spreadsheet contains
@@ -236,103 +380,499 @@ private:
     SSView* view;
 
 /**
- * BasicGraph graph: directed graph to represent dependency between spreadsheet cells
- * The edge arrow reprsents dependent cell and edge tail represent the dependency(parent) cell
- * Vertices and edges are created on demand in graph as new spreadsheet cells are defined
+ * DepGraph graph: directed graph to represent dependency between spreadsheet cells
+ * An arc from a cell to another represents that the other cell refers to it by name in its formula
+ * Keeps arcs in both directions in compact arrays, see depgraph.h
+ * Nodes are created on demand as new spreadsheet cells are defined
  */
 
-    BasicGraph graph;
+    DepGraph graph;
 
 /**
- * Map<string rangeFunctionName, rangeFnT rangeFunction> fnTable
- * Map represents mapping from string representing range function to actual range function definition
- * This works same as cmdFnT
+ * Map<string rangeFunctionName, RangeFnId rangeFunction> fnTable
+ * Map represents mapping from string representing range function to id of range function definition
+ * The implementation is chosen from the id by applyRangeFunction()
  * The map is initialized by calling setUpRangeTable() method added in ssutil
  */
 
-    Map<string, rangeFnT> fnTable;
+    Map<string, RangeFnId> fnTable;
+
+/**
+ * Map<CellId cell, Vector<range> rangesItReads> rangeNeighbors
+ * Ranges read by range functions in the formula of each cell, e.g. A1:T10000 for sum(A1:T10000)
+ * A range is never expanded into one dependency per cell, and keeps its kind, so A:A still prints as A:A
+ */
+
+    Map<CellId, Vector<range>> rangeNeighbors;
+
+/**
+ * RangeIndex rangeIndex: spatial index over the ranges in rangeNeighbors
+ * Answers which cells read a given cell through a range with a stabbing query
+ * Together with graph this gives every cell which directly depends on a cell
+ * It also mirrors topoOrder, giving the latest position of any cell inside a range
+ */
+
+    RangeIndex rangeIndex;
+
+/**
+ * unordered_map<CellId cell, long long position> topoOrder
+ * Position of every cell with a formula in a topological order of the dependency graph
+ * Every cell comes after all the cells it reads, by name or through a range
+ * Empty cells depend on nothing and are left out
+ * Positions are kept up to date as formulas change, see checkForCycle, and need not be consecutive
+ * No two cells share a position; the positions in use are kept in usedOrders
+ */
+
+    std::unordered_map<CellId, long long> topoOrder;
+    std::unordered_set<long long> usedOrders;
+
+/**
+ * nextOrder, frontOrder: positions given to the next cell placed at the end or at the front of topoOrder
+ * Both move by kOrderGap, leaving free positions between neighbouring cells for new cells to be placed in
+ */
+
+    long long nextOrder;
+    long long frontOrder;
+
+/**
+ * Type: SavedCell
+ * ---------------
+ * State of a cell before the first edit made to it in the current transaction, enough to restore it on rollback
+ */
+
+    struct SavedCell {
+        bool occupied;
+        Formula* formula;
+        double value;
+        Vector<CellId> dependencies;
+        Vector<range> ranges;
+    };
+
+/**
+ * inTransaction: true between beginTransaction and commitTransaction or rollbackTransaction
+ */
+
+    bool inTransaction;
+
+/**
+ * Map<CellId cell, SavedCell state> savedCells
+ * State of each cell edited in the current transaction before its first edit
+ * editedCells holds the same cells in the order they were first edited
+ */
+
+    std::unordered_map<CellId, SavedCell> savedCells;
+    Vector<CellId> editedCells;
+
+/**
+ * unordered_map<CellId cell, long long position> savedOrder
+ * Position of each cell moved in topoOrder by the current transaction, before it was first moved, -1 if it had none
+ * savedNextOrder and savedFrontOrder are nextOrder and frontOrder when the transaction began
+ */
+
+    std::unordered_map<CellId, long long> savedOrder;
+    long long savedNextOrder;
+    long long savedFrontOrder;
+
+/**
+ * unordered_multimap<size_t shapeHash, Formula* formula> formulaTable
+ * Every formula in use by a cell or saved cell, keyed by Formula::getShapeHash()
+ * Cells anywhere in the sheet holding the same formula relative to their position share one Formula through it,
+ * so a formula repeated across the sheet is kept and compiled once
+ */
+
+    std::unordered_multimap<size_t, Formula*> formulaTable;
+
+/**
+ * RangeTable rangeTable: the range function calls of every compiled formula, each distinct call kept once
+ * A call is computed at most once per evaluation pass however many formulas make it, and is not computed again
+ * in later passes while the cell store's version counters show its range unchanged, see aggregateValue()
+ * Each batch of evaluations, such as a recalculation or a refresh, starts a new pass: the cells are evaluated in
+ * topological order, so a range read once in a pass holds no cell evaluated later in the pass
+ * It also keeps the formulas built on range calls, keyed by their structure and computed once a pass too
+ */
+
+    RangeTable rangeTable;
+
+/**
+ * ThreadPool pool: workers used to evaluate independent cells concurrently when a recalculation is large
+ */
+
+    ThreadPool pool;
+
+/**
+ * lazyEvaluation: true in lazy mode, see setLazyEvaluation
+ */
+
+    bool lazyEvaluation;
+
+/**
+ * unordered_set<CellId> staleCells
+ * Cells whose cached value is out of date, in lazy mode
+ * Every cell depending on a stale cell is stale too, so marking can stop at a cell already stale
+ */
+
+    std::unordered_set<CellId> staleCells;
 
 /**
- * Map<string cellName, Set<string> cellNameAdjacentVertices> incomingNeighbors
- * This map needs to be defined to keep track of incoming dependencies of any cell
- * graph defined above keeps track of arcs in only one direction
- * This map keep track of arcs in opposite direction
+ * range visibleRange: cells shown by the view, kept up to date in lazy mode
  */
 
-    Map<string, Set<string>> incomingNeighbors;
+    range visibleRange;
 
 /**
- * Member function: evaluateExpression
- * Usage: evaluateExpression("A1", expression*);
+ * Member function: cellId
+ * Usage: CellId id = cellId("A1");
  * ---------------------------------------------
- * Given cell name and expression for cell as input, evaluates expression value by calling eval(SSModel* model) of exp.cpp
- * Also gets the expression string by calling toString() method of exp.cpp
- * Caches the evaluated value and display value in spreadsheet map
+ * Converts a valid cell name (in either case) to its CellId
  */
-    void evaluateExpression(const string& cellname, Expression* exp);
+
+    CellId cellId(const string& cellname) const;
+
+/**
+ * Member function: evaluateCell
+ * Usage: evaluateCell(id);
+ * ---------------------------------------------
+ * Given id of a cell with a formula, evaluates its value by running the cell's Formula
+ * Caches the evaluated value in the cell store and displays the cell
+ * Returns true if the numeric value differs, bit for bit, from the one cached before
+ */
+    bool evaluateCell(CellId id);
+
+/**
+ * Member function: computeCell
+ * Usage: if (computeCell(id)) ...
+ * ---------------------------------------------
+ * Same as evaluateCell but without displaying the cell, so it can run on any thread
+ * Reads only the cells the formula refers to and writes only the cell itself
+ */
+    bool computeCell(CellId id);
 
 /**
- * Member function: collectCellValues
- * Usage: collectCellValues(Vector<double>& cellValues, "A1", "D4");
+ * Member function: computeBlock
+ * Usage: if (computeBlock(id, count)) ...
  * ---------------------------------------------
- * Defines vector of double values and collect cell names by calling collectCellRef() between given range
- * Adds the numeric value of each cells in range of given input to the vector defined
+ * Same as computeCell for the count cells from id down its column, which must share one Formula that can run on a column
+ * The formula is run once over the whole run of cells; returns true if any of their values changed
  */
+    bool computeBlock(CellId id, int count);
 
-    void collectCellValues(Vector<double>& cellValues, const string startCellLocation, const string endCellLocation);
+/**
+ * Member function: storeFormula
+ * Usage: storeFormula(A1, text);
+ * ---------------------------------------------
+ * Parses the formula from text, checks it for cycles and stores it in the cell without evaluating it
+ * Must be called inside a transaction, which records the previous state of the cell
+ */
+    void storeFormula(CellId id, std::string_view text);
+
+/**
+ * Member function: storeExpression
+ * Usage: storeExpression(A1, exp, arena, dependents, rangeDependents);
+ * ---------------------------------------------
+ * Stores a parsed formula, whose nodes arena holds, in the cell and the dependency graph, without checking it for
+ * cycles or evaluating it
+ * The arena is handed to a new Formula, unless some cell holds the same formula relative to its own position, in
+ * which case the cell shares that Formula and the arena is deleted
+ * Must be called inside a transaction, which records the previous state of the cell
+ */
+    void storeExpression(CellId id, Expression* exp, ExpArena* arena, Vector<CellId>& dependents,
+                         Vector<range>& rangeDependents);
+
+/**
+ * Member function: setFormula
+ * Usage: setFormula(A1, formula, dependents, rangeDependents);
+ * ---------------------------------------------
+ * Makes the cell a user of formula and records its dependencies, without checking for cycles or evaluating it
+ * Must be called inside a transaction, which records the previous state of the cell
+ */
+    void setFormula(CellId id, Formula* formula, Vector<CellId>& dependents, Vector<range>& rangeDependents);
+
+/**
+ * Member function: findSharedFormula
+ * Usage: Formula* formula = findSharedFormula(A2, exp);
+ * ---------------------------------------------
+ * Returns a Formula in formulaTable that matches exp, parsed for id, or NULL if there is none
+ */
+    Formula* findSharedFormula(CellId id, const Expression* exp) const;
+
+/**
+ * Member function: releaseFormula
+ * Usage: releaseFormula(formula, id);
+ * ---------------------------------------------
+ * Drops the user of formula, which may be NULL, at cell id, and frees the formula once no cell or saved cell uses
+ * it, removing it from formulaTable
+ */
+    void releaseFormula(Formula* formula, CellId id);
+
+/**
+ * Member function: getDisplayValue
+ * Usage: string text = getDisplayValue(A1);
+ * ---------------------------------------------
+ * Returns the text shown for an occupied cell: the text of a string, otherwise the cached value
+ */
+    string getDisplayValue(CellId id) const;
+
+/**
+ * Member function: saveCell
+ * Usage: saveCell(id);
+ * ---------------------------------------------
+ * Records the state of the cell in savedCells, the first time it is edited in the current transaction
+ */
+    void saveCell(CellId id);
+
+/**
+ * Member function: moveToEndOfOrder
+ * Usage: moveToEndOfOrder(id);
+ * ---------------------------------------------
+ * Gives the cell the next position at the end of topoOrder by calling setOrder(), freeing the one it had
+ */
+    void moveToEndOfOrder(CellId id);
+
+/**
+ * Member function: setOrder
+ * Usage: setOrder(id, position);
+ * ---------------------------------------------
+ * Gives the cell the position in topoOrder, recording its previous position in savedOrder
+ * The position is recorded in rangeIndex too; usedOrders is left to the caller
+ */
+    void setOrder(CellId id, long long position);
+
+/**
+ * Member function: positionOf
+ * Usage: long long position = positionOf(id);
+ * ---------------------------------------------
+ * Returns the position of the cell in topoOrder, or -1 if it has none
+ */
+    long long positionOf(CellId id) const;
+
+/**
+ * Member function: forgetSavedCells
+ * Usage: forgetSavedCells();
+ * ---------------------------------------------
+ * Ends the current transaction keeping its edits, releasing the formulas the edits replaced
+ */
+    void forgetSavedCells();
+
+/**
+ * Member function: releaseFormulas
+ * Usage: releaseFormulas();
+ * ---------------------------------------------
+ * Releases the formula of every cell in the cell store
+ */
+    void releaseFormulas();
 
 /**
  * Member function: addDataToGraph
- * Usage: addDataToGraph("A1", {"B1, C2, D3"});
+ * Usage: addDataToGraph(A1, {B1, C2, D3}, {E1:E100});
  * ---------------------------------------------
- * Adds vertex and neighboring vertices and depedency arcs between them in member graph
- * Also adds incoming depedency arcs to incomingNeighbors map
+ * Replaces the dependency arcs between cell and the cells it depends on in graph
+ * Ranges are recorded in rangeNeighbors and rangeIndex as one rectangle each
  */
 
-    void addDataToGraph(const string& cellname, Vector<string>& dependents);
+    void addDataToGraph(CellId id, Vector<CellId>& dependents, Vector<range>& rangeDependents);
+
+/**
+ * Member function: getDependentCells
+ * Usage: getDependentCells(A1, dependentCells);
+ * ---------------------------------------------
+ * Adds every cell which directly depends on the cell, by name or through a range, to dependentCells
+ */
+
+    void getDependentCells(CellId id, Vector<CellId>& dependentCells);
+
+/**
+ * Member function: getOpenRangeReaders
+ * Usage: getOpenRangeReaders(A1, readers);
+ * ---------------------------------------------
+ * Adds every cell reading the cell through a whole-column or whole-row range to readers
+ */
+
+    void getOpenRangeReaders(CellId id, Vector<CellId>& readers);
 
 /**
  * Member function: setLinesFromFile
- * Usage: setLinesFromFile(scanner);
+ * Usage: setLinesFromFile(line);
  * ---------------------------------------------
- * Input: Scanner containing string representing each line in input file to be read
- * Passes the input string to setCellFromScanner() method to parse and evaluate each cell from input file
+ * Input: string representing each line in input file to be read
+ * Parses the formula on the line and stores it by calling storeExpression(), leaving cycle checks and
+ * evaluation to readFromStream
+ * For a line naming a run of cells, the cells after the first share its Formula
+ * Returns the first cell set by the line
  * Throws error if malformed input line
  */
 
-    void setLinesFromFile(TokenScanner& scanner);
+    CellId setLinesFromFile(const string& line);
+
+/**
+ * Member function: findComponents
+ * Usage: findComponents(loadedCells, order, cycles);
+ * ---------------------------------------------
+ * Finds the strongly connected components of the cells reachable from the loaded cells over their dependents
+ * Uses Tarjan's algorithm with an explicit stack of cells still being explored
+ * Cells which are not part of any cycle are added to order, in topological order
+ * Every cycle, including a cell reading itself, is added to cycles
+ */
+
+    void findComponents(const Vector<CellId>& loadedCells, Vector<CellId>& order, Vector<Vector<CellId>>& cycles);
 
 /**
  * Member function: checkForCycle
- * Usage: if(checkForCycle("A1", {"B1", "C1", D1"}));
+ * Usage: if(checkForCycle(A1, {B1, C1, D1}, {E1:E100}));
  * ---------------------------------------------
  * Checks if adding the new cell and its corresponding vertex will create a cycle in graph
  * If cycle is created either through direct or indirect dependency then formula is rejected
+ * Otherwise topoOrder is updated so that the cell comes after every cell its new formula reads
+ * Only the cells placed between the cell and the latest cell its new formula reads are searched and reordered
+ */
+
+    bool checkForCycle(CellId id, const Vector<CellId>& dependents, const Vector<range>& rangeDependents);
+
+/**
+ * Member function: searchDependents
+ * Usage: if(searchDependents(A1, latest, precedents, reached));
+ * ---------------------------------------------
+ * Do Depth first search over the cells depending on input start vertex, using an explicit stack
+ * Cells placed after upperBound in topoOrder are not entered
+ * If a cell in precedents is visited during DFS, returns true else returns false
+ * Every visited cell is added to reached
+ */
+
+    bool searchDependents(CellId start, long long upperBound, const Vector<CellId>& precedents,
+                          Vector<CellId>& reached);
+
+/**
+ * Member function: searchPrecedents
+ * Usage: searchPrecedents(precedents, lowerBound, reached);
+ * ---------------------------------------------
+ * Do Depth first search from the input cells over the cells they read, by name or through a range, using an
+ * explicit stack
+ * Cells placed at or before lowerBound in topoOrder are not entered
+ * Every visited cell is added to reached
+ */
+
+    void searchPrecedents(const Vector<CellId>& precedents, long long lowerBound, Vector<CellId>& reached);
+
+/**
+ * Member function: reorderRegion
+ * Usage: reorderRegion(backward, forward);
+ * ---------------------------------------------
+ * Hands the positions held by the cells of both vectors out again, in increasing order, first to the cells of
+ * backward and then to those of forward, each group keeping its own order
+ */
+
+    void reorderRegion(const Vector<CellId>& backward, const Vector<CellId>& forward);
+
+/**
+ * Member function: placeNewCell
+ * Usage: placeNewCell(A1, dependents, rangeDependents, dependentCells);
+ * ---------------------------------------------
+ * Gives a cell without a position one after every cell its formula reads and before every cell in dependentCells,
+ * the cells which directly depend on it
+ */
+
+    void placeNewCell(CellId id, const Vector<CellId>& dependents, const Vector<range>& rangeDependents,
+                      const Vector<CellId>& dependentCells);
+
+/**
+ * Member function: recalculate
+ * Usage: recalculate(editedCells);
+ * ---------------------------------------------
+ * Evaluates the input cells and every cell depending on them, directly or indirectly, whose inputs changed
+ * Cells are evaluated in topoOrder so each one is updated only once, after all the cells it reads
+ * A cell whose value comes out bit for bit the same does not cause the cells depending on it to be evaluated
+ */
+
+    void recalculate(const Vector<CellId>& changedCells);
+
+/**
+ * Member function: markStale
+ * Usage: markStale(editedCells);
+ * ---------------------------------------------
+ * Adds the input cells and every cell depending on them to staleCells
+ */
+
+    void markStale(const Vector<CellId>& changedCells);
+
+/**
+ * Member function: refreshCell
+ * Usage: refreshCell(id);
+ * ---------------------------------------------
+ * If the cell is stale, evaluates it together with every stale cell it depends on, directly or indirectly
+ */
+
+    void refreshCell(CellId id);
+
+/**
+ * Member function: refreshVisibleCells
+ * Usage: refreshVisibleCells();
+ * ---------------------------------------------
+ * Calls refreshCell() on every stale cell in visibleRange
+ */
+
+    void refreshVisibleCells();
+
+/**
+ * Member function: getStaleCells
+ * Usage: getStaleCells(r, staleInRange);
+ * ---------------------------------------------
+ * Adds the stale cells inside the range to the vector
+ */
+
+    void getStaleCells(const range& r, Vector<CellId>& staleInRange) const;
+
+/**
+ * Member function: collectAffected
+ * Usage: collectAffected(changedCells, affected, arcStart, arcs);
+ * ---------------------------------------------
+ * Collects the input cells and every cell depending on them into affected
+ * The dependents of affected[i] among the affected cells are arcs[arcStart[i]] to arcs[arcStart[i + 1] - 1],
+ * given as indices into affected
+ */
+
+    void collectAffected(const Vector<CellId>& changedCells, vector<CellId>& affected,
+                         vector<int>& arcStart, vector<int>& arcs);
+
+/**
+ * Type: BlockGraph
+ * ---------------
+ * Cells collected by collectAffected() grouped into blocks, each a single cell or a run of cells down a column
+ * sharing a Formula that can run on a column
+ * The cells of block b are cells[blockStart[b]] to cells[blockStart[b + 1] - 1], as indices into affected, in row order
+ * The blocks depending on block b are arcs[arcStart[b]] to arcs[arcStart[b + 1] - 1], each listed once
  */
 
-    bool checkForCycle(const string& cellname, const Vector<string>& dependents);
+    struct BlockGraph {
+        vector<int> cells;
+        vector<int> blockStart;
+        vector<int> arcStart;
+        vector<int> arcs;
+    };
 
 /**
- * Member function: dfsRecursive
- * Usage: if(dfsRecursive("D1", "A1"));
+ * Member function: groupIntoBlocks
+ * Usage: if (groupIntoBlocks(affected, arcStart, arcs, true, blocks)) ...
  * ---------------------------------------------
- * Do Depth first search on dependency graph from input start vertex
- * If end cell(vertex) is visited during DFS, returns true else returns false
+ * Fills blocks from the cells and arcs made by collectAffected(), putting each cell in a block of its own unless
+ * mergeRuns is true
+ * Returns false if the blocks depend on each other in a cycle, which runs of cells can do even though cells cannot
  */
 
-    bool dfsRecursive(const string& start, const string& end);
+    bool groupIntoBlocks(const vector<CellId>& affected, const vector<int>& arcStart, const vector<int>& arcs,
+                         bool mergeRuns, BlockGraph& blocks);
 
 /**
- * Member function: topologicalSort
- * Usage: topologicalSort(Vertex* A1, {});
+ * Member function: recalculateInParallel
+ * Usage: recalculateInParallel(dirtyCells);
  * ---------------------------------------------
- * Do DFS from start vertex and visits all neigboring vertices to do topological sort
- * After all vertices from input vertex is visited, vertex is added to stack
- * Topological sort helps in updating cells dependent on input cell only once
- * Returns Stack with vertices added in topologically sorted manner
+ * Finishes a recalculation on pool, given the cells still due to be evaluated, which must all be dirty
+ * The cells depending on them are collected by collectAffected() and grouped by groupIntoBlocks(), each block
+ * counts the blocks it still waits for and is run once the count drops to zero
+ * A block is evaluated only if it is dirty, that is it holds one of the input cells or a block it reads changed value
+ * A run of cells sharing a formula is evaluated by computeBlock(), a column slice at a time
+ * Evaluated cells are displayed afterwards on the calling thread
  */
 
-    void topologicalSort(Vertex* startNode, Stack<string>& topologicalOrder);
+    void recalculateInParallel(const Vector<CellId>& dirtyCells);
 
 };
 
@@ -8,90 +8,389 @@
 #include "ssutil.h"
 #include <cctype>
 #include <cmath>
-#include <sstream>
 #include <algorithm>
 #include "map.h"
+#include "error.h"
+#include "strlib.h"
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define SS_X86_KERNELS
+#endif
 using namespace std;
 
 
+bool stringToCellId(const char* name, int length, CellId& id) {
+    if (length < 2 || !isalpha(name[0])) return false;
+    int row = 0;
+    for (int i = 1; i < length; i++) {
+        if (!isdigit(name[i])) return false;
+        row = row * 10 + (name[i] - '0');
+        if (row > kMaxCellIdRow) return false;
+    }
+    id = packCellId(row, toupper(name[0]) - 'A');
+    return true;
+}
+
+bool stringToCellId(const string& name, CellId& id) {
+    return stringToCellId(name.data(), name.length(), id);
+}
+
+int cellIdToChars(CellId id, char* buffer) {
+    char digits[kMaxCellNameLength];
+    int nDigits = 0;
+    int row = cellIdRow(id);
+    do {
+        digits[nDigits++] = '0' + row % 10;
+        row /= 10;
+    } while (row > 0);
+    int length = 0;
+    buffer[length++] = 'A' + cellIdCol(id);
+    while (nDigits > 0) {
+        buffer[length++] = digits[--nDigits];
+    }
+    return length;
+}
+
+string cellIdToString(CellId id) {
+    char buffer[kMaxCellNameLength];
+    return string(buffer, cellIdToChars(id, buffer));
+}
+
+string rangeToString(CellId startCell, CellId endCell, RangeKind kind) {
+    switch (kind) {
+    case COLUMN_RANGE:
+        return string(1, 'A' + cellIdCol(startCell)) + ':' + string(1, 'A' + cellIdCol(endCell));
+    case ROW_RANGE:
+        return integerToString(cellIdRow(startCell)) + ':' + integerToString(cellIdRow(endCell));
+    default:
+        return cellIdToString(startCell) + ':' + cellIdToString(endCell);
+    }
+}
+
 bool stringToLocation(const string& name, location& loc) {
-	stringstream sstr;
-	sstr << name;	// insert name into stream, then parse it back out
-	char ch;
-	int num;
-    sstr >> ch >> num;	// expect char followed by integer
-    if (!isalpha(ch) || sstr.fail() || !sstr.eof()) return false;
-	loc.col = toupper(ch);
-	loc.row = num;
-	return true;
+    CellId id;
+    if (!stringToCellId(name, id)) return false;
+    loc.col = 'A' + cellIdCol(id);
+    loc.row = cellIdRow(id);
+    return true;
 }
 
 string locationToString(const location& loc) {
-	return string(1, toupper(loc.col)) + integerToString(loc.row);
+    return cellIdToString(packCellId(loc.row, toupper(loc.col) - 'A'));
+}
+
+/**
+ * Implementation notes: percentile
+ * --------------------------------
+ * nth_element places the value of rank floor(p * (n - 1)) and leaves only
+ * values no smaller than it after it, so the next rank up is the smallest
+ * of those.  The interpolation weights both neighbours, which for a median
+ * of an even count gives exactly the mean of the two middle values.
+ */
+double percentile(vector<double>& values, double p) {
+	double rank = p * (values.size() - 1);
+	size_t lower = (size_t) rank;
+	double fraction = rank - lower;
+	nth_element(values.begin(), values.begin() + lower, values.end());
+	if (fraction == 0) return values[lower];
+	double next = *min_element(values.begin() + lower + 1, values.end());
+	return values[lower] * (1 - fraction) + next * fraction;
+}
+
+/**
+ * Implementation notes: percentile with zeros
+ * -------------------------------------------
+ * The zeros are counted, never stored.  values is split into its negative
+ * values and the rest, which places the zeros between the two parts in
+ * sorted order; a rank then falls among the negatives, the zeros or the
+ * rest, and only the part it falls in is searched.
+ */
+static double valueOfRank(vector<double>& values, size_t negatives, long zeros, size_t rank) {
+	if (rank < negatives) {
+		nth_element(values.begin(), values.begin() + rank, values.begin() + negatives);
+		return values[rank];
+	}
+	if (rank < negatives + zeros) return 0.0;
+	rank -= zeros;
+	nth_element(values.begin() + negatives, values.begin() + rank, values.end());
+	return values[rank];
+}
+
+double percentile(vector<double>& values, long zeros, double p) {
+	if (zeros == 0) return percentile(values, p);
+	double rank = p * (values.size() + zeros - 1);
+	size_t lower = (size_t) rank;
+	double fraction = rank - lower;
+	size_t negatives = partition(values.begin(), values.end(), [](double v) { return v < 0; }) - values.begin();
+	double value = valueOfRank(values, negatives, zeros, lower);
+	if (fraction == 0) return value;
+	return value * (1 - fraction) + valueOfRank(values, negatives, zeros, lower + 1) * fraction;
+}
+
+bool hasParameter(RangeFnId id) {
+    return id == FN_PERCENTILE || id == FN_QUARTILE;
+}
+
+bool validParameter(RangeFnId id, double parameter) {
+    switch (id) {
+    case FN_PERCENTILE: return parameter >= 0 && parameter <= 1;
+    case FN_QUARTILE: return parameter >= 0 && parameter <= 4 && parameter == floor(parameter);
+    default: return true;
+    }
+}
+
+double orderStatistic(RangeFnId id, vector<double>& values, long zeros, double parameter) {
+    switch (id) {
+    case FN_MEDIAN: return percentile(values, zeros, 0.5);
+    case FN_PERCENTILE: return percentile(values, zeros, parameter);
+    case FN_QUARTILE: return percentile(values, zeros, parameter / 4);
+    default: error("orderStatistic: not an order statistic");
+    }
+    return 0;
+}
+
+void setUpRangeTable(Map<string, RangeFnId>& table) {
+    // store map entries using lowercase, always use lowercase to lookup
+    table["min"] = FN_MIN;
+    table["max"] = FN_MAX;
+    table["sum"] = FN_SUM;
+    table["product"] = FN_PRODUCT;
+    table["average"] = FN_AVERAGE;
+    table["mean"] = FN_AVERAGE;
+    table["median"] = FN_MEDIAN;
+    table["stdev"] = FN_STDEV;
+    table["percentile"] = FN_PERCENTILE;
+    table["quartile"] = FN_QUARTILE;
 }
 
-double min(const Vector<double>& values) {
-	double min = values[0];
-	for (int i = 1; i < values.size(); i++) 
-		if (values[i] < min) 
-            min = values[i];
-	return min;
+void clearSummary(RangeSummary& summary) {
+    summary.count = 0;
+    summary.sum = 0;
+    summary.product = 1;
+    summary.min = summary.max = 0;
+    summary.mean = summary.m2 = 0;
 }
 
-double max(const Vector<double>& values) {
-	double max = values[0];
-	for (int i = 1; i < values.size(); i++) 
-		if (values[i] > max) 
-            max = values[i];
-	return max;
+/* min and max follow the kernels above: a NaN is only kept if it comes first */
+
+void addToSummary(RangeSummary& summary, double value) {
+    if (summary.count == 0) {
+        summary.min = summary.max = value;
+    } else {
+        if (value < summary.min) summary.min = value;
+        if (value > summary.max) summary.max = value;
+    }
+    summary.count++;
+    summary.sum += value;
+    summary.product *= value;
+    double delta = value - summary.mean;
+    summary.mean += delta / summary.count;
+    summary.m2 += delta * (value - summary.mean);
+}
+
+/**
+ * Implementation notes: mergeSummary
+ * ----------------------------------
+ * The mean and m2 of the union are combined with the pairwise update of
+ * Chan, Golub and LeVeque, which stays accurate however unevenly the values
+ * are split between the two summaries.
+ */
+
+void mergeSummary(RangeSummary& summary, const RangeSummary& other) {
+    if (other.count == 0) return;
+    if (summary.count == 0) {
+        summary = other;
+        return;
+    }
+    if (other.min < summary.min) summary.min = other.min;
+    if (other.max > summary.max) summary.max = other.max;
+    double n = double(summary.count) + other.count;
+    double delta = other.mean - summary.mean;
+    summary.mean += delta * other.count / n;
+    summary.m2 += other.m2 + delta * delta * summary.count * (other.count / n);
+    summary.count += other.count;
+    summary.sum += other.sum;
+    summary.product *= other.product;
+}
+
+/**
+ * Implementation notes: block kernels
+ * -----------------------------------
+ * summarizeValues cuts its input into blocks of kBlockSize values and
+ * summarizes each block with a kernel that makes two passes over it, the
+ * first for sum, product, min and max and the second for the squared
+ * deviations from the block's mean.  The block is still in cache for the
+ * second pass, so memory is read once; the block summaries are then merged
+ * in order.  On x86-64 the kernel uses AVX2 when the processor has it and
+ * SSE2 otherwise; elsewhere it is a plain loop.  All three keep min and max
+ * in the order-sensitive form used by addToSummary: every lane starts from
+ * the block's first value, and a NaN later in the block is never taken.
+ */
+
+static const int kBlockSize = 256;
+
+typedef void (*blockKernelT)(RangeSummary& block, const double* values, int n);
+
+#ifndef SS_X86_KERNELS
+
+static void summarizeBlockScalar(RangeSummary& block, const double* values, int n) {
+    double sum = 0, product = 1, min = values[0], max = values[0];
+    for (int i = 0; i < n; i++) {
+        sum += values[i];
+        product *= values[i];
+        if (values[i] < min) min = values[i];
+        if (values[i] > max) max = values[i];
+    }
+    double mean = sum / n, m2 = 0;
+    for (int i = 0; i < n; i++) {
+        m2 += (values[i] - mean) * (values[i] - mean);
+    }
+    block.count = n;
+    block.sum = sum;
+    block.product = product;
+    block.min = min;
+    block.max = max;
+    block.mean = mean;
+    block.m2 = m2;
 }
 
-double sum(const Vector<double>& values) {
-	double sum = 0;
-	for (int i = 0; i < values.size(); i++) 
+#else
+
+/* Folds the lanes of a block and the values past the last full vector */
+
+static void finishBlock(RangeSummary& block, const double* values, int n, int i,
+                        const double* sums, const double* products,
+                        const double* mins, const double* maxes, int lanes) {
+    double sum = 0, product = 1, min = mins[0], max = maxes[0];
+    for (int lane = 0; lane < lanes; lane++) {
+        sum += sums[lane];
+        product *= products[lane];
+        if (mins[lane] < min) min = mins[lane];
+        if (maxes[lane] > max) max = maxes[lane];
+    }
+    for (; i < n; i++) {
         sum += values[i];
-	return sum;
+        product *= values[i];
+        if (values[i] < min) min = values[i];
+        if (values[i] > max) max = values[i];
+    }
+    block.count = n;
+    block.sum = sum;
+    block.product = product;
+    block.min = min;
+    block.max = max;
+    block.mean = sum / n;
 }
 
-double product(const Vector<double>& values) {
-	double prod = 1;
-	for (int i = 0; i < values.size(); i++) 
-		prod *= values[i];
-	return prod;
+/*
+ * minpd(x, acc) yields acc whenever either operand is NaN, so a NaN value
+ * is skipped and a NaN first value sticks, as in the scalar comparison.
+ */
+
+__attribute__((target("avx2")))
+static void summarizeBlockAvx2(RangeSummary& block, const double* values, int n) {
+    __m256d sum0 = _mm256_setzero_pd(), sum1 = _mm256_setzero_pd();
+    __m256d product = _mm256_set1_pd(1);
+    __m256d min = _mm256_set1_pd(values[0]), max = min;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256d x0 = _mm256_loadu_pd(values + i);
+        __m256d x1 = _mm256_loadu_pd(values + i + 4);
+        sum0 = _mm256_add_pd(sum0, x0);
+        sum1 = _mm256_add_pd(sum1, x1);
+        product = _mm256_mul_pd(product, _mm256_mul_pd(x0, x1));
+        min = _mm256_min_pd(x1, _mm256_min_pd(x0, min));
+        max = _mm256_max_pd(x1, _mm256_max_pd(x0, max));
+    }
+    double sums[4], products[4], mins[4], maxes[4];
+    _mm256_storeu_pd(sums, _mm256_add_pd(sum0, sum1));
+    _mm256_storeu_pd(products, product);
+    _mm256_storeu_pd(mins, min);
+    _mm256_storeu_pd(maxes, max);
+    finishBlock(block, values, n, i, sums, products, mins, maxes, 4);
+    __m256d mean = _mm256_set1_pd(block.mean);
+    __m256d m2 = _mm256_setzero_pd();
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256d d = _mm256_sub_pd(_mm256_loadu_pd(values + i), mean);
+        m2 = _mm256_add_pd(m2, _mm256_mul_pd(d, d));
+    }
+    double m2s[4];
+    _mm256_storeu_pd(m2s, m2);
+    block.m2 = (m2s[0] + m2s[1]) + (m2s[2] + m2s[3]);
+    for (; i < n; i++) {
+        block.m2 += (values[i] - block.mean) * (values[i] - block.mean);
+    }
 }
 
-/* This function should be accessible by both name "mean" and "average" */
-double average(const Vector<double>& values) {
-	return sum(values)/values.size();
+static void summarizeBlockSse2(RangeSummary& block, const double* values, int n) {
+    __m128d sum0 = _mm_setzero_pd(), sum1 = _mm_setzero_pd();
+    __m128d product = _mm_set1_pd(1);
+    __m128d min = _mm_set1_pd(values[0]), max = min;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128d x0 = _mm_loadu_pd(values + i);
+        __m128d x1 = _mm_loadu_pd(values + i + 2);
+        sum0 = _mm_add_pd(sum0, x0);
+        sum1 = _mm_add_pd(sum1, x1);
+        product = _mm_mul_pd(product, _mm_mul_pd(x0, x1));
+        min = _mm_min_pd(x1, _mm_min_pd(x0, min));
+        max = _mm_max_pd(x1, _mm_max_pd(x0, max));
+    }
+    double sums[2], products[2], mins[2], maxes[2];
+    _mm_storeu_pd(sums, _mm_add_pd(sum0, sum1));
+    _mm_storeu_pd(products, product);
+    _mm_storeu_pd(mins, min);
+    _mm_storeu_pd(maxes, max);
+    finishBlock(block, values, n, i, sums, products, mins, maxes, 2);
+    __m128d mean = _mm_set1_pd(block.mean);
+    __m128d m2 = _mm_setzero_pd();
+    for (i = 0; i + 2 <= n; i += 2) {
+        __m128d d = _mm_sub_pd(_mm_loadu_pd(values + i), mean);
+        m2 = _mm_add_pd(m2, _mm_mul_pd(d, d));
+    }
+    double m2s[2];
+    _mm_storeu_pd(m2s, m2);
+    block.m2 = m2s[0] + m2s[1];
+    for (; i < n; i++) {
+        block.m2 += (values[i] - block.mean) * (values[i] - block.mean);
+    }
 }
 
-double median(const Vector<double>& values) {
-    Vector<double> clone = values;
-	sort(clone.begin(), clone.end());
-	int n = clone.size();
-	if (n % 2 == 0) 
-		return (clone[n/2] + clone[n/2 - 1])/2;
-	else 
-		return clone[n/2];
+#endif
+
+static blockKernelT chooseBlockKernel() {
+#ifdef SS_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return summarizeBlockAvx2;
+    return summarizeBlockSse2;
+#else
+    return summarizeBlockScalar;
+#endif
 }
 
-double stdev(const Vector<double>& values) {
-	double sum = 0, sumsquares = 0;
-	for (int i = 0; i < values.size(); i++) {
-		sum += values[i];
-		sumsquares += values[i] * values[i];
-	}
-	return sqrt((values.size() * sumsquares - sum*sum)/(values.size() * values.size()));
+static const blockKernelT summarizeBlock = chooseBlockKernel();
+
+void summarizeValues(RangeSummary& summary, const double* values, int n) {
+    for (int start = 0; start < n; start += kBlockSize) {
+        RangeSummary block;
+        summarizeBlock(block, values + start, std::min(kBlockSize, n - start));
+        mergeSummary(summary, block);
+    }
 }
 
-void setUpRangeTable(Map<string, rangeFnT>& table) {
-    // store map entries using lowercase, always use lowercase to lookup
-    table["min"] = min;
-    table["max"] = max;
-    table["sum"] = sum;
-    table["product"] = product;
-    table["average"] = average;
-    table["mean"] = average;
-    table["median"] = median;
-    table["stdev"] = stdev;
+bool isSummaryFunction(RangeFnId id) {
+    return id != FN_MEDIAN && !hasParameter(id);
+}
+
+double summaryValue(RangeFnId id, const RangeSummary& summary) {
+    switch (id) {
+    case FN_MIN: return summary.min;
+    case FN_MAX: return summary.max;
+    case FN_SUM: return summary.sum;
+    case FN_PRODUCT: return summary.product;
+    case FN_AVERAGE: return summary.sum / summary.count;
+    case FN_STDEV: return sqrt(summary.m2 / summary.count);
+    default: error("summaryValue: order statistics cannot be computed from a summary");
+    }
+    return 0;
 }
@@ -8,6 +8,7 @@
 #ifndef _ssutil_
 #define _ssutil_
 
+#include <vector>
 #include "vector.h"
 #include "map.h"
 using namespace std;
@@ -24,28 +25,115 @@ struct location {
 	int row;
 } ;
 	
+/**
+ * Type: CellId
+ * ------------
+ * Compact identifier for a cell, packing the zero-based column index
+ * ('A' == 0) above the row number, which occupies the low kCellIdRowBits bits.
+ * Ids therefore sort column by column, and the row and column can be
+ * recovered with a shift and a mask.  Cell names are converted to and from
+ * CellIds only where they enter or leave the program.
+ */
+
+typedef unsigned int CellId;
+
+static const int kCellIdRowBits = 24;
+static const int kMaxCellIdRow = (1 << kCellIdRowBits) - 1;
+
+/**
+ * Functions: packCellId, cellIdRow, cellIdCol
+ * Usage: CellId id = packCellId(row, col);
+ * ----------------------------------------
+ * Packs a row number and a zero-based column index into a CellId, and
+ * unpacks the two halves again.
+ */
+
+inline CellId packCellId(int row, int col) {
+    return ((CellId) col << kCellIdRowBits) | (CellId) row;
+}
+
+inline int cellIdRow(CellId id) {
+    return (int) (id & kMaxCellIdRow);
+}
+
+inline int cellIdCol(CellId id) {
+    return (int) (id >> kCellIdRowBits);
+}
+
+/**
+ * Function: shiftCellId
+ * Usage: CellId below = shiftCellId(id, 1, 0);
+ * --------------------------------------------
+ * Returns the cell rowOffset rows down and colOffset columns right of id.
+ * The caller must make sure the result lies inside the sheet.
+ */
+
+inline CellId shiftCellId(CellId id, int rowOffset, int colOffset) {
+    return packCellId(cellIdRow(id) + rowOffset, cellIdCol(id) + colOffset);
+}
+
+/**
+ * Type: RangeKind
+ * ---------------
+ * How a range reference in a formula was written: BOUNDED_RANGE for a pair
+ * of cells such as A1:B10, COLUMN_RANGE for whole columns such as A:A or
+ * A:C, and ROW_RANGE for whole rows such as 3:3 or 3:5.  The rectangle of a
+ * whole-column range runs from the first to the last row of the sheet, and
+ * that of a whole-row range across every column, so cells added anywhere
+ * along it are covered without parsing the formula again.
+ */
+
+enum RangeKind { BOUNDED_RANGE, COLUMN_RANGE, ROW_RANGE };
+
 /**
  * Type: range
  * -----------
- * This struct can be used to identify a range. It represents start/stop
- * cells as locations. An alternative would be to store string 
- * cellnames for the start and stop cell, and if you'd rather, feel free
- * to change the definition to better fit your needs.
+ * This struct identifies a rectangular range of cells by the CellIds of
+ * its top-left (start) and bottom-right (stop) corners, and records how
+ * the reference to it was written.
  */
 
 struct range {
-	location startCell, stopCell;
+	CellId startCell, stopCell;
+	RangeKind kind = BOUNDED_RANGE;
 } ;
+
+/**
+ * Function: shiftRangeCorner
+ * Usage: CellId start = shiftRangeCorner(startCell, kind, 1, 0);
+ * ---------------------------------------------------------------
+ * Returns a corner of a range of the given kind as seen from a cell
+ * rowOffset rows down and colOffset columns right, as for a shared or
+ * filled formula.  A whole-column range moves across but not down, and a
+ * whole-row range down but not across.
+ */
+
+inline CellId shiftRangeCorner(CellId id, RangeKind kind, int rowOffset, int colOffset) {
+    return shiftCellId(id, (kind == COLUMN_RANGE) ? 0 : rowOffset, (kind == ROW_RANGE) ? 0 : colOffset);
+}
+
+/**
+ * Function: rangeContains
+ * Usage: if (rangeContains(r, id))....
+ * ------------------------------------
+ * Returns true if the cell lies inside the rectangle of the range.
+ */
+
+inline bool rangeContains(const range& r, CellId id) {
+    return cellIdCol(id) >= cellIdCol(r.startCell) && cellIdCol(id) <= cellIdCol(r.stopCell)
+        && cellIdRow(id) >= cellIdRow(r.startCell) && cellIdRow(id) <= cellIdRow(r.stopCell);
+}
 		
 /**
- * Typedef: rangeFnT
+ * Type: RangeFnId
  * ---------------
- * This typedef makes a shorthand name for the function prototype
- * so we can refer to it as rangeFnT instead of the long form
- * This typedef is used to define common interface for using range functions
+ * Small integer identifying each built-in range function, so that compiled
+ * formulas can refer to a function without a name lookup.  Several names
+ * may map to the same id ("mean" and "average").
  */
 
-typedef double (*rangeFnT)(const Vector<double>& values);
+enum RangeFnId { FN_MIN, FN_MAX, FN_SUM, FN_PRODUCT, FN_AVERAGE, FN_MEDIAN, FN_STDEV,
+                 FN_PERCENTILE, FN_QUARTILE, NUM_RANGE_FNS };
 
 /**
  * Function: stringToLocation
@@ -60,6 +148,51 @@ typedef double (*rangeFnT)(const Vector<double>& values);
 
 bool stringToLocation(const std::string& name, location& loc);
 
+/**
+ * Function: stringToCellId
+ * Usage: if (stringToCellId(name, id))....
+ * ----------------------------------------
+ * Parses a cell name consisting of one column letter (either case) followed
+ * by a row number directly into a CellId, without allocating.  Returns false
+ * and leaves id unchanged if the name is not in that format.  Bounds against
+ * a particular sheet are checked by the model.
+ */
+
+bool stringToCellId(const char* name, int length, CellId& id);
+bool stringToCellId(const std::string& name, CellId& id);
+
+/**
+ * Function: cellIdToChars
+ * Usage: int length = cellIdToChars(id, buffer);
+ * ----------------------------------------------
+ * Writes the name of the cell (e.g. "A7") into buffer, which must hold at
+ * least kMaxCellNameLength characters, and returns the number written.
+ * The buffer is not null-terminated.
+ */
+
+static const int kMaxCellNameLength = 12;
+
+int cellIdToChars(CellId id, char* buffer);
+
+/**
+ * Function: cellIdToString
+ * Usage: name = cellIdToString(id);
+ * ---------------------------------
+ * Returns the name of the cell as a string, for output to the user or a file.
+ */
+
+std::string cellIdToString(CellId id);
+
+/**
+ * Function: rangeToString
+ * Usage: name = rangeToString(startCell, endCell, kind);
+ * ------------------------------------------------------
+ * Returns a range reference as it is written in a formula: "A1:B10" for a
+ * bounded range, "A:B" for whole columns and "1:10" for whole rows.
+ */
+
+std::string rangeToString(CellId startCell, CellId endCell, RangeKind kind);
+
 /**
  * Function: locationToString
  * Usage: name = locationToString(loc);
@@ -71,28 +204,127 @@ bool stringToLocation(const std::string& name, location& loc);
 std::string locationToString(const location& loc);
 
 /**
- * Functions: average, sum, product, max, min, median, stdev
- * Usage: avg =  average(values);
- * ------------------------------
- * Implementation of built-in functions supported in cell formulas. Each
- * takes a vector of double values and returns the computed result.
+ * Function: percentile
+ * Usage: double p90 = percentile(values, 0.9);
+ * --------------------------------------------
+ * Returns the value below which the fraction p of values lies, interpolating
+ * linearly between the two nearest values when the rank p * (n - 1) is not
+ * a whole number.  values must not be empty and is reordered in the process,
+ * which takes linear time on average rather than a full sort.
+ */
+
+double percentile(std::vector<double>& values, double p);
+
+/**
+ * Function: percentile
+ * Usage: double p90 = percentile(values, zeros, 0.9);
+ * ---------------------------------------------------
+ * Returns the percentile of values together with zeros further values of
+ * 0.0, which are counted rather than stored, so that the empty cells of a
+ * sparse range cost nothing.  values and zeros must not both be empty.
+ */
+
+double percentile(std::vector<double>& values, long zeros, double p);
+
+/**
+ * Function: hasParameter
+ * Usage: if (hasParameter(id)) ...
+ * --------------------------------
+ * Returns true if the range function with the given id takes a numeric
+ * parameter after its range, as in percentile(A1:A100, 0.9) or
+ * quartile(A1:A100, 3).
+ */
+
+bool hasParameter(RangeFnId id);
+
+/**
+ * Function: validParameter
+ * Usage: if (validParameter(FN_QUARTILE, 3)) ...
+ * ----------------------------------------------
+ * Returns true if parameter is acceptable to the range function with the
+ * given id: a fraction from 0 to 1 for percentile, and a whole number from
+ * 0 to 4 for quartile.
+ */
+
+bool validParameter(RangeFnId id, double parameter);
+
+/**
+ * Function: orderStatistic
+ * Usage: double result = orderStatistic(FN_MEDIAN, values, zeros, 0);
+ * -------------------------------------------------------------------
+ * Computes median, percentile or quartile, with the given parameter, of
+ * values together with zeros further values of 0.0, by selection.  values
+ * is reordered.
  */
 
-double average(const Vector<double> & values);
-double sum(const Vector<double> & values);
-double product(const Vector<double> & values);
-double max(const Vector<double> & values);
-double min(const Vector<double> & values);
-double median(const Vector<double> & values);
-double stdev(const Vector<double> & values);
+double orderStatistic(RangeFnId id, std::vector<double>& values, long zeros, double parameter);
 
 /**
  * Function: setUpRangeTable
- * Usage: setUpRangeTable(Map<string, rangeFnT>& table);
+ * Usage: setUpRangeTable(Map<string, RangeFnId>& table);
+ * ------------------------------------------------------
+ * Input: Map from lowercase range function name to the id of that function
+ * RangeFnId is decsribed as enum at top of this file.
+ */
+void setUpRangeTable(Map<string, RangeFnId>& table);
+
+/**
+ * Type: RangeSummary
+ * ------------------
+ * Running aggregates of a set of values from which every range function
+ * except median, percentile and quartile can be computed.  The mean and m2 (sum of squared
+ * deviations from the mean) fields give the standard deviation without the
+ * cancellation of the sum-of-squares formula.  Two summaries of disjoint
+ * sets can be merged into the summary of their union.
+ */
+
+struct RangeSummary {
+    int count;
+    double sum, product, min, max, mean, m2;
+};
+
+/**
+ * Functions: clearSummary, addToSummary, mergeSummary
+ * Usage: addToSummary(summary, value);
+ * ------------------------------------
+ * clearSummary makes summary describe no values, addToSummary adds one value
+ * to it and mergeSummary adds all the values described by other.
+ */
+
+void clearSummary(RangeSummary& summary);
+void addToSummary(RangeSummary& summary, double value);
+void mergeSummary(RangeSummary& summary, const RangeSummary& other);
+
+/**
+ * Function: summarizeValues
+ * Usage: summarizeValues(summary, values, n);
+ * -------------------------------------------
+ * Adds the n contiguous values starting at values to summary.  The values
+ * are processed a block at a time with vector instructions where the
+ * processor supports them, so results may differ from adding the values
+ * one by one in the last bits.
+ */
+
+void summarizeValues(RangeSummary& summary, const double* values, int n);
+
+/**
+ * Function: isSummaryFunction
+ * Usage: if (isSummaryFunction(id)) ...
+ * -------------------------------------
+ * Returns true if the range function with the given id can be computed from
+ * a RangeSummary.
+ */
+
+bool isSummaryFunction(RangeFnId id);
+
+/**
+ * Function: summaryValue
+ * Usage: double result = summaryValue(FN_SUM, summary);
  * -----------------------------------------------------
- * Input: Map for providing common interface for using range functions over a vector of values
- * rangeFnT is decsribed as typedef at top of this file.
+ * Returns the result of the range function with the given id over the
+ * values described by summary, which must not be empty.
  */
-void setUpRangeTable(Map<string, rangeFnT>& table);
+
+double summaryValue(RangeFnId id, const RangeSummary& summary);
 
 #endif
@@ -123,6 +123,22 @@ void SSView::displayCell(const string& cellname, const string& txt) {
     table.set(loc.row, loc.col - 'A' + 1, txt);
 }
 
+void SSView::displayCell(CellId id, const string& txt) {
+    table.set(cellIdRow(id), cellIdCol(id) + 1, txt);
+}
+
+/**
+ * @brief SSView::getVisibleRange
+ * Row 0 and column 0 of the table hold the axis labels, so the cells shown are rows 1 to kNumRowsDisplayed - 1 of
+ * columns A onwards, see labelAxes
+ */
+range SSView::getVisibleRange() const {
+    range shown;
+    shown.startCell = packCellId(1, 0);
+    shown.stopCell = packCellId(kNumRowsDisplayed - 1, kNumColsDisplayed - 1);
+    return shown;
+}
+
 
 /* Note: we treat the axes as cells that are editable in the GTable,
  * so to extend this be sure you have special error handling code for
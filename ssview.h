@@ -13,6 +13,7 @@
 #include "gtable.h"
 #include "gwindow.h"
 #include "ginteractors.h"
+#include "ssutil.h"
 
 /**
  * Class constants: kNumRowsDisplayed, kNumColsDisplayed
@@ -110,6 +111,26 @@ public:
 
     void displayCell(const std::string& cellname, const std::string& txt);
 
+/**
+ * Member function: displayCell
+ * Usage: view.displayCell(id, contents);
+ * --------------------------------------
+ * Same as above, but for a cell already identified by its CellId.  This is
+ * the form used by the model, which never deals in cell names.
+ */
+
+    void displayCell(CellId id, const std::string& txt);
+
+/**
+ * Member function: getVisibleRange
+ * Usage: range shown = view.getVisibleRange();
+ * --------------------------------------------
+ * Returns the rectangle of cells the table shows, which the controller
+ * passes on to the model so that lazy evaluation keeps them up to date.
+ */
+
+    range getVisibleRange() const;
+
 private:
     GTable table;
 
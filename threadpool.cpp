@@ -0,0 +1,251 @@
+/**
+ * File: threadpool.cpp
+ * --------------------
+ * This file implements the threadpool.h interface.
+ */
+
+#include "threadpool.h"
+using namespace std;
+
+/* Number of times an idle worker looks for a task, yielding in between, before it sleeps until one is queued */
+
+static const int kSpinRounds = 64;
+
+ThreadPool::ThreadPool(int nThreads) {
+    if (nThreads <= 0) {
+        nThreads = thread::hardware_concurrency();
+        if (nThreads <= 0) nThreads = 1;
+    }
+    current = NULL;
+    runNumber = 0;
+    busyWorkers = 0;
+    stopping = false;
+    idleWorkers = 0;
+    wakeups = 0;
+    outstanding = 0;
+    failed = false;
+    for (int i = 0; i < nThreads; i++) {
+        workers.push_back(new Worker);
+    }
+    for (int i = 1; i < nThreads; i++) {
+        threads.push_back(thread(&ThreadPool::workerLoop, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> guard(runLock);
+        stopping = true;
+    }
+    runStarted.notify_all();
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        delete workers[i];
+    }
+}
+
+int ThreadPool::size() const {
+    return workers.size();
+}
+
+/**
+ * @brief ThreadPool::run
+ * The roots are dealt out across all the deques so that every worker has
+ * something to start on.  The outstanding count covers every task queued
+ * or running; a task's successors are counted before the task itself is
+ * discounted, so the count reaches zero only when the run is complete.
+ * A pool of one worker has no background threads to wake, so the calling
+ * thread simply works through the tasks itself.
+ */
+void ThreadPool::run(const vector<int>& roots, const TaskFn& fn) {
+    if (roots.empty()) return;
+    current = &fn;
+    failed = false;
+    failure = exception_ptr();
+    outstanding = roots.size();
+    for (size_t i = 0; i < roots.size(); i++) {
+        workers[i % workers.size()]->tasks.push_back(roots[i]);
+    }
+    if (threads.empty()) {
+        work(0);
+        current = NULL;
+        if (failed) {
+            rethrow_exception(failure);
+        }
+        return;
+    }
+    {
+        lock_guard<mutex> guard(runLock);
+        busyWorkers = threads.size();
+        runNumber++;
+    }
+    runStarted.notify_all();
+    work(0);
+    {
+        unique_lock<mutex> guard(runLock);
+        runFinished.wait(guard, [this] { return busyWorkers == 0; });
+    }
+    current = NULL;
+    if (failed) {
+        rethrow_exception(failure);
+    }
+}
+
+/**
+ * @brief ThreadPool::workerLoop
+ * @param index: worker number of this background thread
+ * Sleeps until a run starts, takes part in it, and reports back when the
+ * run has no tasks left.
+ */
+void ThreadPool::workerLoop(int index) {
+    unsigned long lastRun = 0;
+    while (true) {
+        {
+            unique_lock<mutex> guard(runLock);
+            runStarted.wait(guard, [this, lastRun] { return stopping || runNumber != lastRun; });
+            if (stopping) return;
+            lastRun = runNumber;
+        }
+        work(index);
+        {
+            lock_guard<mutex> guard(runLock);
+            busyWorkers--;
+        }
+        runFinished.notify_all();
+    }
+}
+
+/**
+ * @brief ThreadPool::work
+ * @param index: worker number
+ * Runs tasks until none are left anywhere.  Once a task has thrown, the
+ * tasks still queued are only counted off, not run.  A worker finding no
+ * task yields for a few rounds, then sleeps in waitForTask until tasks are
+ * queued or the run is over, so idle workers do not hold a core.  The
+ * worker takes the first task it makes ready itself, so others are only
+ * woken for the rest.
+ */
+void ThreadPool::work(int index) {
+    vector<int> ready;
+    int idleRounds = 0;
+    while (outstanding > 0) {
+        int task;
+        if (!takeTask(index, task)) {
+            if (++idleRounds < kSpinRounds) {
+                this_thread::yield();
+            } else {
+                waitForTask();
+                idleRounds = 0;
+            }
+            continue;
+        }
+        idleRounds = 0;
+        ready.clear();
+        if (!failed) {
+            try {
+                (*current)(task, ready);
+            } catch (...) {
+                lock_guard<mutex> guard(runLock);
+                if (!failed) {
+                    failure = current_exception();
+                    failed = true;
+                }
+                ready.clear();
+            }
+        }
+        if (!ready.empty()) {
+            outstanding += ready.size();
+            {
+                lock_guard<mutex> guard(workers[index]->lock);
+                for (size_t i = 0; i < ready.size(); i++) {
+                    workers[index]->tasks.push_back(ready[i]);
+                }
+            }
+            if (ready.size() > 1) {
+                wakeIdle(ready.size() > 2);
+            }
+        }
+        if (--outstanding == 0) {
+            wakeIdle(true);
+        }
+    }
+}
+
+/**
+ * @brief ThreadPool::waitForTask
+ * Sleeps until wakeIdle is called or the run is over.  The worker counts
+ * itself idle before looking at the deques once more, and wakeIdle checks
+ * that count only after queueing, so a task queued meanwhile is either seen
+ * here or followed by a wakeup.
+ */
+void ThreadPool::waitForTask() {
+    unique_lock<mutex> guard(idleLock);
+    idleWorkers++;
+    unsigned long seen = wakeups;
+    if (outstanding > 0 && !hasTask()) {
+        taskQueued.wait(guard, [this, seen] { return wakeups != seen || outstanding == 0; });
+    }
+    idleWorkers--;
+}
+
+/**
+ * @brief ThreadPool::wakeIdle
+ * @param all: wake every sleeping worker rather than one
+ * Does nothing, without locking, when no worker is asleep.
+ */
+void ThreadPool::wakeIdle(bool all) {
+    if (idleWorkers == 0) return;
+    {
+        lock_guard<mutex> guard(idleLock);
+        wakeups++;
+    }
+    if (all) {
+        taskQueued.notify_all();
+    } else {
+        taskQueued.notify_one();
+    }
+}
+
+/**
+ * @brief ThreadPool::hasTask
+ * Returns true if any worker's deque holds a task.
+ */
+bool ThreadPool::hasTask() {
+    for (size_t i = 0; i < workers.size(); i++) {
+        lock_guard<mutex> guard(workers[i]->lock);
+        if (!workers[i]->tasks.empty()) return true;
+    }
+    return false;
+}
+
+/**
+ * @brief ThreadPool::takeTask
+ * @param index: worker number
+ * @param task: set to the task taken
+ * Takes the newest task of the worker's own deque, or failing that steals
+ * the oldest task of the first other worker that has one.
+ */
+bool ThreadPool::takeTask(int index, int& task) {
+    Worker* own = workers[index];
+    {
+        lock_guard<mutex> guard(own->lock);
+        if (!own->tasks.empty()) {
+            task = own->tasks.back();
+            own->tasks.pop_back();
+            return true;
+        }
+    }
+    int n = workers.size();
+    for (int i = 1; i < n; i++) {
+        Worker* victim = workers[(index + i) % n];
+        lock_guard<mutex> guard(victim->lock);
+        if (!victim->tasks.empty()) {
+            task = victim->tasks.front();
+            victim->tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,135 @@
+/**
+ * File: threadpool.h
+ * ------------------
+ * This file defines the ThreadPool class, a small work-stealing pool used to
+ * evaluate independent spreadsheet cells concurrently.  The pool runs graphs
+ * of tasks whose dependencies are only discovered as tasks finish: each task
+ * reports the tasks it has made ready, and those are queued on the worker
+ * that ran it.
+ */
+
+#ifndef _threadpool_
+#define _threadpool_
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+
+/**
+ * Class: ThreadPool
+ * -----------------
+ * Every worker owns a deque of ready tasks.  A worker pushes the tasks it
+ * makes ready onto the back of its own deque and takes its next task from
+ * the back too, so a chain of dependent tasks tends to stay on one thread
+ * with its data still in cache.  A worker whose deque is empty steals from
+ * the front of another worker's deque, where the oldest, and usually
+ * largest, pieces of work are.  A worker finding nothing to steal sleeps
+ * until more tasks are queued.  The thread calling run takes part as one of
+ * the workers; a pool of one, as on a single hardware thread, starts no
+ * background threads and runs everything on the calling thread.
+ */
+
+class ThreadPool {
+
+public:
+
+/**
+ * Type: TaskFn
+ * ------------
+ * Runs task number task, appending to ready the numbers of the tasks it has
+ * made ready to run.  Called concurrently from several threads.
+ */
+
+    typedef std::function<void(int task, std::vector<int>& ready)> TaskFn;
+
+/**
+ * Constructor: ThreadPool
+ * Usage: ThreadPool pool(nThreads);
+ * ---------------------------------
+ * Creates a pool of nThreads workers, counting the thread that calls run.
+ * With nThreads 0 the pool uses one worker per hardware thread.
+ */
+
+    ThreadPool(int nThreads = 0);
+
+/**
+ * Destructor: ~ThreadPool
+ * -----------------------
+ * Stops and joins the worker threads.
+ */
+
+    ~ThreadPool();
+
+/**
+ * Member function: size
+ * Usage: int n = pool.size();
+ * ---------------------------
+ * Returns the number of workers, counting the thread that calls run.
+ */
+
+    int size() const;
+
+/**
+ * Member function: run
+ * Usage: pool.run(roots, fn);
+ * ---------------------------
+ * Runs fn on each task in roots and on every task made ready along the way,
+ * returning once all of them have finished.  If a task throws, the
+ * remaining tasks are abandoned and the first exception is rethrown here.
+ * Only one run may be in progress at a time.
+ */
+
+    void run(const std::vector<int>& roots, const TaskFn& fn);
+
+private:
+
+/**
+ * Type: Worker
+ * ------------
+ * The deque of ready tasks owned by one worker, with the lock that guards it.
+ */
+
+    struct Worker {
+        std::deque<int> tasks;
+        std::mutex lock;
+    };
+
+    std::vector<Worker*> workers;           /* one per worker, index 0 is the thread calling run */
+    std::vector<std::thread> threads;       /* background threads for workers 1 and up */
+    std::mutex runLock;                     /* guards the fields below */
+    std::condition_variable runStarted;     /* signalled when a run starts or the pool stops */
+    std::condition_variable runFinished;    /* signalled when a background worker leaves a run */
+    const TaskFn* current;                  /* task function of the run in progress */
+    unsigned long runNumber;                /* incremented at the start of each run */
+    int busyWorkers;                        /* background workers still inside the current run */
+    bool stopping;                          /* set by the destructor */
+    std::atomic<int> outstanding;           /* tasks queued or running in the current run */
+    std::atomic<bool> failed;               /* set once a task has thrown */
+    std::exception_ptr failure;             /* first exception thrown by a task */
+    std::mutex idleLock;                    /* guards wakeups */
+    std::condition_variable taskQueued;     /* signalled when tasks are queued or the run is over */
+    unsigned long wakeups;                  /* incremented each time taskQueued is signalled */
+    std::atomic<int> idleWorkers;           /* workers asleep in waitForTask, or about to be */
+
+/* Private helpers */
+
+    void workerLoop(int index);
+    void work(int index);
+    bool takeTask(int index, int& task);
+    bool hasTask();
+    void waitForTask();
+    void wakeIdle(bool all);
+
+/* Copying a pool would duplicate its threads, so it is disallowed */
+
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+
+};
+
+#endif